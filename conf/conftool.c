@@ -9,28 +9,26 @@
 #include <mcp2210.h>
 #include "config.h"
 
-static ssize_t get_device_list(hid_handle_t ***devices)
+// List devices without opening them
+static ssize_t get_device_list(hid_device_info_t **devices)
 {
-	ssize_t device_count;
-	for (size_t i = 10;; i *= 2) {
-		*devices = malloc(i);
+	for (size_t i = 8;; i *= 2) {
+		*devices = malloc(i * sizeof(hid_device_info_t));
 		if (!*devices) abort();
-		device_count = hid_find_devices(MCP2210_VID, MCP2210_PID, *devices, 10);
+		ssize_t device_count = hid_enumerate(MCP2210_VID, MCP2210_PID, *devices, i);
 		if (-1 == device_count) {
-			if (errno == ENOMEM) {
-				free(*devices);
+			free(*devices);
+			if (errno == ENOMEM)
 				continue;
-			}
 			return -1;
 		}
-		break;
+		return device_count;
 	}
-	return device_count;
 }
 
 static int command_list()
 {
-	hid_handle_t **devices;
+	hid_device_info_t *devices;
 	ssize_t device_count = get_device_list(&devices);
 	if (-1 == device_count) {
 		perror("Failed to search for HID devices");
@@ -44,8 +42,9 @@ static int command_list()
 
 	printf("Found %ld devices\n", device_count);
 	for (size_t i = 0; i < (size_t) device_count; ++i) {
-		printf("[%ld] %s\n", i + 1, hid_device_desc(devices[i]));
-		hid_cleanup_device(devices[i]);
+		printf("[%ld] port %s, %s, serial: %s, %s %s\n", i + 1,
+			devices[i].port_path, devices[i].path, devices[i].serial,
+			devices[i].manufacturer, devices[i].product);
 	}
 
 done:
@@ -53,6 +52,43 @@ done:
 	return 0;
 }
 
+// Open a device by its number in the list, serial=<serial number>,
+// a USB port path such as 1-4.2 or a backend path such as /dev/hidraw3
+static hid_handle_t *open_device(const char *name)
+{
+	hid_handle_t *device;
+
+	if (!strncmp(name, "serial=", 7)) {
+		device = hid_open_serial(MCP2210_VID, MCP2210_PID, name + 7);
+	} else if (strchr(name, '/') || strchr(name, ':')) {
+		device = hid_open_path(name);
+	} else if (strchr(name, '-')) {
+		device = hid_open_port(name);
+	} else {
+		hid_device_info_t *devices;
+		ssize_t device_count = get_device_list(&devices);
+		if (-1 == device_count) {
+			perror("Failed to search for HID devices");
+			return NULL;
+		}
+
+		size_t index = strtol(name, NULL, 10);
+		if (index > (size_t) device_count || !index) {
+			fprintf(stderr, "Invalid device number %ld\n", index);
+			free(devices);
+			return NULL;
+		}
+
+		// Only open the device we actually use
+		device = hid_open(&devices[index - 1]);
+		free(devices);
+	}
+
+	if (!device)
+		perror("Failed to open device");
+	return device;
+}
+
 static void print_spi_settings(mcp2210_spi_settings_t s)
 {
 	printf("{\n\t.bitrate = %d\n\t.idle_cs = 0x%04x\n"
@@ -121,35 +157,25 @@ static int command_get_set(int argc, char **argv)
 	}
 
 	if (optind >= argc - 1) {
-		fprintf(stderr, "Usage: %s <chip_number>"
+		fprintf(stderr, "Usage: %s <device>"
 			" <product_name|manufacturer_name|spi_settings|"
 			"chip_settings|key_parameters>\n",
 			argv[0]);
 		return 1;
 	}
 
-	hid_handle_t **devices;
-	ssize_t device_count = get_device_list(&devices);
-	if (-1 == device_count) {
-		perror("Failed to search for HID devices");
+	hid_handle_t *device = open_device(argv[optind]);
+	if (!device)
 		return 1;
-	}
 
 	int status = 0;
 
-	size_t index = strtol(argv[optind], NULL, 10);
-	if (index > (size_t) device_count || !index) {
-		fprintf(stderr, "Invalid device number %ld\n", index);
-		status = 1;
-		goto done;
-	}
-
 	if (!strcmp(argv[optind + 1], "spi_settings")) {
 		mcp2210_spi_settings_t spi_settings;
 
 		if (!get) {
 			printf("Writing SPI settings...\n");
-			if (-1 == write_spi_settings(devices[index - 1], &config_spi_settings, is_nvram)) {
+			if (-1 == write_spi_settings(device, &config_spi_settings, is_nvram)) {
 				perror("Failed to write SPI settings");
 				status = 1;
 				goto done;
@@ -158,7 +184,7 @@ static int command_get_set(int argc, char **argv)
 		}
 
 		printf("Reading SPI settings...\n");
-		if (-1 == read_spi_settings(devices[index - 1], &spi_settings, is_nvram)) {
+		if (-1 == read_spi_settings(device, &spi_settings, is_nvram)) {
 			perror("Failed to read SPI settings");
 			status = 1;
 			goto done;
@@ -169,7 +195,7 @@ static int command_get_set(int argc, char **argv)
 
 		if (!get) {
 			printf("Writing chip settings...\n");
-			if (-1 == write_chip_settings(devices[index - 1], &config_chip_settings, is_nvram)) {
+			if (-1 == write_chip_settings(device, &config_chip_settings, is_nvram)) {
 				perror("Failed to write chip settings");
 				status = 1;
 				goto done;
@@ -178,7 +204,7 @@ static int command_get_set(int argc, char **argv)
 		}
 
 		printf("Reading chip settings...\n");
-		if (-1 == read_chip_settings(devices[index - 1], &chip_settings, is_nvram)) {
+		if (-1 == read_chip_settings(device, &chip_settings, is_nvram)) {
 			perror("Failed to read chip settings");
 			status = 1;
 			goto done;
@@ -190,7 +216,7 @@ static int command_get_set(int argc, char **argv)
 
 		if (!get) {
 			printf("Writing product name...\n");
-			if (-1 == write_product_name(devices[index - 1], CONFIG_PRODUCT_NAME)) {
+			if (-1 == write_product_name(device, CONFIG_PRODUCT_NAME)) {
 				perror("Failed to write product name");
 				status = 1;
 				goto done;
@@ -198,22 +224,20 @@ static int command_get_set(int argc, char **argv)
 		}
 
 		printf("Reading product name...\n");
-		char *buffer = malloc(100);
-		if (-1 == read_product_name(devices[index - 1], buffer, 100)) {
-			free(buffer);
+		char buffer[MCP2210_NAME_MAX + 1];
+		if (-1 == read_product_name(device, buffer, sizeof(buffer))) {
 			perror("Failed to read product name");
 			status = 1;
 			goto done;
 		}
 		printf("Product name: %s\n", buffer);
-		free(buffer);
 	} else if (!strcmp(argv[optind + 1], "manufacturer_name")) {
 		if (!is_nvram && !get)
 			printf("NOTE: The manufacturer name is always set in NVRAM.\n");
 
 		if (!get) {
 			printf("Writing manufacturer name...\n");
-			if (-1 == write_manufacturer_name(devices[index - 1], CONFIG_MANUFACTURER_NAME)) {
+			if (-1 == write_manufacturer_name(device, CONFIG_MANUFACTURER_NAME)) {
 				perror("Failed to write manufacturer name");
 				status = 1;
 				goto done;
@@ -221,22 +245,20 @@ static int command_get_set(int argc, char **argv)
 		}
 
 		printf("Reading manufacturer name...\n");
-		char *buffer = malloc(100);
-		if (-1 == read_manufacturer_name(devices[index - 1], buffer, 100)) {
-			free(buffer);
+		char buffer[MCP2210_NAME_MAX + 1];
+		if (-1 == read_manufacturer_name(device, buffer, sizeof(buffer))) {
 			perror("Failed to read manufacturer name");
 			status = 1;
 			goto done;
 		}
 		printf("Manufacturer name: %s\n", buffer);
-		free(buffer);
 	} else if (!strcmp(argv[optind + 1], "key_parameters")) {
 		if (!is_nvram && !get)
 			printf("NOTE: The key parameters are always set in NVRAM.\n");
 
 		if (!get) {
 			printf("Writing key parameters...\n");
-			if (-1 == write_key_parameters(devices[index - 1], &config_key_parameters)) {
+			if (-1 == write_key_parameters(device, &config_key_parameters)) {
 				perror("Failed to write key parameters");
 				status = 1;
 				goto done;
@@ -245,7 +267,7 @@ static int command_get_set(int argc, char **argv)
 
 		printf("Reading key parameters...\n");
 		mcp2210_key_parameters_t key_parameters;
-		if (-1 == read_key_parameters(devices[index - 1], &key_parameters)) {
+		if (-1 == read_key_parameters(device, &key_parameters)) {
 			perror("Failed to read key parameters");
 			status = 1;
 			goto done;
@@ -258,10 +280,196 @@ static int command_get_set(int argc, char **argv)
 	}
 
 done:
-	for (size_t i = 0; i < (size_t) device_count; ++i) {
-		hid_cleanup_device(devices[i]);
+	hid_cleanup_device(device);
+	return status;
+}
+
+// Print everything the chip stores, read in one batch
+static int command_dump_state(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <device>\n", argv[0]);
+		return 1;
 	}
-	free(devices);
+
+	hid_handle_t *device = open_device(argv[1]);
+	if (!device)
+		return 1;
+
+	int status = 0;
+	mcp2210_device_state_t state;
+	if (-1 == mcp2210_read_device_state(device, &state)) {
+		perror("Failed to read device state");
+		status = 1;
+		goto done;
+	}
+
+	printf("SPI settings:\n");
+	print_spi_settings(state.spi_settings);
+	printf("SPI settings in NVRAM:\n");
+	print_spi_settings(state.nv_spi_settings);
+	printf("Chip settings:\n");
+	print_chip_settings(state.chip_settings);
+	printf("Chip settings in NVRAM:\n");
+	print_chip_settings(state.nv_chip_settings);
+	printf("Key parameters:\n");
+	print_key_parameters(state.key_parameters);
+	printf("Product name: %s\n", state.product_name);
+	printf("Manufacturer name: %s\n", state.manufacturer_name);
+
+done:
+	hid_cleanup_device(device);
+	return status;
+}
+
+// Time GPIO reads, first normally and then in low latency mode
+static int command_latency(int argc, char **argv)
+{
+	int opt;
+	unsigned long count = 1000, spin_us = 200;
+	long cpu = -1;
+	while ((opt = getopt(argc, argv, "n:s:c:")) != -1) {
+		switch ((char) opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			spin_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (optind >= argc || !spin_us) {
+		fprintf(stderr, "Usage: %s [-n count] [-s spin_us] [-c cpu] <device>\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (cpu >= 0 && -1 == mcp2210_pin_thread(cpu)) {
+		perror("Failed to pin thread");
+		return 1;
+	}
+
+	hid_handle_t *device = open_device(argv[optind]);
+	if (!device)
+		return 1;
+
+	int status = 0;
+	mcp2210_reset_stats(device);
+	for (int pass = 0; pass < 2; ++pass) {
+		if (pass && -1 == mcp2210_set_low_latency(device, spin_us)) {
+			perror("Failed to enable low latency mode");
+			status = 1;
+			goto done;
+		}
+		for (unsigned long i = 0; i < count; ++i) {
+			uint16_t value;
+			if (-1 == mcp2210_get_gpio(device, &value)) {
+				perror("Failed to read GPIO");
+				status = 1;
+				goto done;
+			}
+		}
+	}
+
+	mcp2210_stats_t stats;
+	mcp2210_get_stats(device, &stats);
+	printf("%-16s %10s %10s\n", "round trip", "normal", "low latency");
+	for (size_t i = 0; i < MCP2210_RTT_BUCKETS; ++i) {
+		if (!stats.rtt[0][i] && !stats.rtt[1][i])
+			continue;
+		char range[32];
+		if (i == MCP2210_RTT_BUCKETS - 1)
+			snprintf(range, sizeof(range), ">= %luus", 1UL << (i - 1));
+		else
+			snprintf(range, sizeof(range), "< %luus", 1UL << i);
+		printf("%-16s %10llu %10llu\n", range,
+			(unsigned long long) stats.rtt[0][i],
+			(unsigned long long) stats.rtt[1][i]);
+	}
+
+done:
+	mcp2210_set_low_latency(device, 0);
+	hid_cleanup_device(device);
+	return status;
+}
+
+// Parse seconds since the epoch with an optional fraction
+static int parse_time(const char *str, uint64_t *time_us)
+{
+	char *end;
+	errno = 0;
+	double seconds = strtod(str, &end);
+	if (errno || end == str || *end || seconds < 0) {
+		fprintf(stderr, "Invalid time %s\n", str);
+		return -1;
+	}
+	*time_us = seconds * 1000000 + 0.5;
+	return 0;
+}
+
+static void print_hex(const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		printf("%02x", data[i]);
+}
+
+// Print the records of a capture file between two times, one per line
+static int command_export(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <capture> [<from> [<to>]]\n"
+			"Times are seconds since the epoch\n", argv[0]);
+		return 1;
+	}
+
+	uint64_t from = 0, to = UINT64_MAX;
+	if (argc > 2 && -1 == parse_time(argv[2], &from))
+		return 1;
+	if (argc > 3 && -1 == parse_time(argv[3], &to))
+		return 1;
+
+	mcp2210_capture_reader_t *reader = mcp2210_capture_reader_open(argv[1]);
+	if (!reader) {
+		perror("Failed to open capture");
+		return 1;
+	}
+
+	int status = 0;
+	if (-1 == mcp2210_capture_seek(reader, from)) {
+		perror("Failed to seek in capture");
+		status = 1;
+		goto done;
+	}
+
+	for (;;) {
+		mcp2210_capture_record_t record;
+		int read = mcp2210_capture_next(reader, &record);
+		if (-1 == read) {
+			perror("Failed to read capture");
+			status = 1;
+			break;
+		}
+		if (!read || record.time_us > to)
+			break;
+
+		printf("%llu.%06llu channel %u status 0x%02x send ",
+			(unsigned long long) (record.time_us / 1000000),
+			(unsigned long long) (record.time_us % 1000000),
+			record.channel, record.status);
+		print_hex(record.send, record.send_len);
+		printf(" recv ");
+		print_hex(record.recv, record.recv_len);
+		printf("\n");
+	}
+
+done:
+	mcp2210_capture_reader_close(reader);
 	return status;
 }
 
@@ -272,6 +480,10 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	// Capture files don't need any device
+	if (!strcmp(argv[1], "export"))
+		return command_export(argc - 1, argv + 1);
+
 	// Initialize HID library
 	if (-1 == hid_init()) {
 		perror("Failed to initialize HID module");
@@ -283,6 +495,10 @@ int main(int argc, char **argv)
 		return command_list();
 	} else if (!strcmp(argv[1], "get") || !strcmp(argv[1], "set")) {
 		return command_get_set(argc - 1, argv + 1);
+	} else if (!strcmp(argv[1], "dump-state")) {
+		return command_dump_state(argc - 1, argv + 1);
+	} else if (!strcmp(argv[1], "latency")) {
+		return command_latency(argc - 1, argv + 1);
 	} else {
 		fprintf(stderr, "Unknown command %s\n", argv[1]);
 		return 1;
@@ -6,6 +6,13 @@
 export USE_LIBUSB := 1
 export USE_HIDRAW := 0
 
+# hidraw: send reports through io_uring, needs liburing
+export USE_IO_URING := 0
+
+# USDT probes for bpftrace/perf, needs <sys/sdt.h> (systemtap-sdt-dev)
+export USE_SDT := 0
+
 # tools
 export CC     := cc
-export CFLAGS := -std=c99 -pedantic -D_XOPEN_SOURCE=700 -Wall -Wextra
+export CFLAGS := -std=c99 -pedantic -D_XOPEN_SOURCE=700 -Wall -Wextra -pthread
+export LIBS   := -pthread
@@ -2,16 +2,93 @@
 #ifndef HID_H
 #define HID_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Defined by each HID module
 typedef struct hid_handle hid_handle_t;
 
-// Initialize the HID module
+// Independent instance of the HID module: every context has its own backend
+// state (libusb context, udev instance, io_uring or broker connection) and
+// its own event loop. A handle belongs to the context it was opened in. The
+// calls without a context use the default one, created by hid_init.
+typedef struct hid_context hid_context_t;
+
+// Initialize the HID module and its default context
 // Returns: 0 -> success; -1 -> error, errno is set
 int hid_init();
 
-// Find all HID devices with the specified VID and PID
+// Initialize the HID module, taking handles and backend buffers from memory
+// supplied by the caller instead of the heap. Closed handles and freed
+// contexts go back to the arena for the next open or create. It has to stay
+// valid until hid_fini.
+// Returns: 0 -> success; -1 -> error, errno is set (EBUSY -> arena in use)
+int hid_init_arena(void *arena, size_t arena_len);
+
+// Bytes of arena needed for the default context and this many handles open
+// at once
+size_t hid_arena_size(size_t handles);
+
+// Create a context of its own, from the arena if there is one
+// Returns: context; NULL -> error, errno is set
+hid_context_t *hid_context_create(void);
+
+// Free a context after closing all of its handles
+void hid_context_free(hid_context_t *ctx);
+
+// Context used by the calls without one, NULL before hid_init
+hid_context_t *hid_default_context(void);
+
+// Context a handle was opened in
+hid_context_t *hid_context(hid_handle_t *handle);
+
+// Description of a device that was found but not opened
+#define HID_INFO_STRLEN 64
+typedef struct hid_device_info {
+	uint16_t vid, pid;
+	uint8_t bus;
+	// USB port path, e.g. 1-4.2
+	char port_path[HID_INFO_STRLEN];
+	// Backend specific path passed to hid_open, e.g. /dev/hidraw3
+	char path[HID_INFO_STRLEN];
+	// String descriptors, empty if the backend can't read them unopened
+	char serial[HID_INFO_STRLEN];
+	char manufacturer[HID_INFO_STRLEN];
+	char product[HID_INFO_STRLEN];
+} hid_device_info_t;
+
+// List all HID devices with the specified VID and PID without opening them
+// Returns: number of devices found; -1 -> error, errno is set
+ssize_t hid_enumerate(uint16_t vid, uint16_t pid, hid_device_info_t *dest, size_t dest_len);
+ssize_t hid_ctx_enumerate(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_device_info_t *dest, size_t dest_len);
+
+// Open a device returned by hid_enumerate
+// Returns: handle; NULL -> error, errno is set
+hid_handle_t *hid_open(const hid_device_info_t *info);
+hid_handle_t *hid_ctx_open(hid_context_t *ctx, const hid_device_info_t *info);
+
+// The calls below look up a single device instead of scanning for all of
+// them, they fail with ENODEV if there is no such device
+
+// Open the MCP2210 at a USB port path, e.g. 1-4.2, any other device there
+// fails with ENODEV
+hid_handle_t *hid_open_port(const char *port_path);
+hid_handle_t *hid_ctx_open_port(hid_context_t *ctx, const char *port_path);
+// Open a device by its backend path, e.g. /dev/hidraw3
+hid_handle_t *hid_open_path(const char *path);
+hid_handle_t *hid_ctx_open_path(hid_context_t *ctx, const char *path);
+// Open the device with the specified VID, PID and serial number
+hid_handle_t *hid_open_serial(uint16_t vid, uint16_t pid, const char *serial);
+hid_handle_t *hid_ctx_open_serial(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *serial);
+
+// Find and open all HID devices with the specified VID and PID
 // Returns: number of devices found; -1 -> error, errno is set
 ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t dest_len);
+ssize_t hid_ctx_find_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_handle_t **dest, size_t dest_len);
 
 // Get a textual representation of a HID device
 const char *hid_device_desc(hid_handle_t *handle);
@@ -24,9 +101,56 @@ ssize_t hid_write(hid_handle_t *handle, void *data, size_t data_len);
 // Returns: number of bytes read; -1 -> error, errno is set
 ssize_t hid_read(hid_handle_t *handle, void *buffer, size_t buffer_len);
 
+// Low latency mode: reads poll for the response for up to spin_us before
+// sleeping, and USB autosuspend of the device is kept off while the mode is
+// on. 0 turns it off again.
+// Returns: 0 -> success; -1 -> error, errno is set
+int hid_set_low_latency(hid_handle_t *handle, uint32_t spin_us);
+
+// Reports that may be written before reading the first response, the
+// backend holds on to the responses until they are read
+size_t hid_pipeline_depth(hid_handle_t *handle);
+
+// Completion of an asynchronous exchange, error is 0 or an errno value
+typedef void (*hid_callback_t)(hid_handle_t *handle, int error, void *arg);
+
+// Write a report and read the response without waiting for it. The buffers
+// have to stay valid until the callback ran from hid_handle_events of the
+// context of the handle, only one exchange may be in flight per handle.
+// Returns: 0 -> submitted; -1 -> error, errno is set
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg);
+
+// Wait up to timeout_ms (-1 -> forever, 0 -> don't wait) for exchanges to
+// complete and run their callbacks
+// Returns: number of callbacks run; -1 -> error, errno is set
+int hid_handle_events(int timeout_ms);
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms);
+
+struct pollfd;
+
+// File descriptors to wait on instead of calling hid_handle_events with a
+// timeout, *timeout_ms is lowered if the backend needs to run earlier
+// Returns: number of fds stored; -1 -> error, errno is set (ENOMEM -> too small)
+ssize_t hid_get_pollfds(struct pollfd *fds, size_t fds_len, int *timeout_ms);
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms);
+
 // Call when finished using a device
 void hid_cleanup_device(hid_handle_t *handle);
 
-// Call when finished using the HID module
+// Protocol layer state stored in every handle
+struct mcp2210_state;
+struct mcp2210_state *hid_state(hid_handle_t *handle);
+
+// Protocol layer event loop stored in every context
+struct mcp2210_loop;
+struct mcp2210_loop *hid_loop(hid_context_t *ctx);
+
+// Call when finished using the HID module, frees the default context
 void hid_fini();
+
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -0,0 +1,160 @@
+/* caller supplied memory for HID handles and backend buffers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+
+// Every allocation starts on its own cache line
+#define ARENA_ALIGN 64
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+// Unused part of the arena, NULL -> allocate from the heap
+static uint8_t *arena_next, *arena_end;
+static uint8_t *arena_start;
+
+// Handles closed with hid_cleanup_device, reused by the next open
+struct free_handle {
+	struct free_handle *next;
+};
+static struct free_handle *free_handles;
+
+// Other memory given back to the arena, reused by allocations of the same
+// cost. The backends allocate few sizes, so blocks aren't split or merged.
+struct free_block {
+	struct free_block *next;
+	size_t cost;
+};
+static struct free_block *free_blocks;
+
+size_t hid_arena_cost(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+int hid_init_arena(void *arena, size_t arena_len)
+{
+	pthread_mutex_lock(&arena_lock);
+	if (arena_start) {
+		pthread_mutex_unlock(&arena_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	uintptr_t start = hid_arena_cost((uintptr_t) arena);
+	if (start - (uintptr_t) arena > arena_len) {
+		pthread_mutex_unlock(&arena_lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	arena_start = arena_next = (uint8_t *) start;
+	arena_end = (uint8_t *) arena + arena_len;
+	free_handles = NULL;
+	free_blocks = NULL;
+	pthread_mutex_unlock(&arena_lock);
+
+	if (-1 == hid_init()) {
+		hid_arena_release();
+		return -1;
+	}
+	return 0;
+}
+
+void *hid_arena_alloc(size_t size)
+{
+	pthread_mutex_lock(&arena_lock);
+	if (!arena_start) {
+		pthread_mutex_unlock(&arena_lock);
+		return calloc(1, size);
+	}
+
+	size_t cost = hid_arena_cost(size);
+	for (struct free_block **cur = &free_blocks; *cur; cur = &(*cur)->next) {
+		struct free_block *block = *cur;
+		if (block->cost == cost) {
+			*cur = block->next;
+			pthread_mutex_unlock(&arena_lock);
+			memset(block, 0, size);
+			return block;
+		}
+	}
+	if ((size_t) (arena_end - arena_next) < cost) {
+		pthread_mutex_unlock(&arena_lock);
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *ptr = arena_next;
+	arena_next += cost;
+	pthread_mutex_unlock(&arena_lock);
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static bool in_arena(const void *ptr)
+{
+	return arena_start && (const uint8_t *) ptr >= arena_start &&
+		(const uint8_t *) ptr < arena_end;
+}
+
+void hid_arena_free(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&arena_lock);
+	if (in_arena(ptr)) {
+		struct free_block *block = ptr;
+		block->cost = hid_arena_cost(size);
+		block->next = free_blocks;
+		free_blocks = block;
+		pthread_mutex_unlock(&arena_lock);
+		return;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	free(ptr);
+}
+
+void *hid_alloc_handle(size_t size)
+{
+	pthread_mutex_lock(&arena_lock);
+	struct free_handle *handle = free_handles;
+	if (handle) {
+		free_handles = handle->next;
+		pthread_mutex_unlock(&arena_lock);
+		memset(handle, 0, size);
+		return handle;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	return hid_arena_alloc(size);
+}
+
+void hid_free_handle(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&arena_lock);
+	if (in_arena(ptr)) {
+		struct free_handle *handle = ptr;
+		handle->next = free_handles;
+		free_handles = handle;
+		pthread_mutex_unlock(&arena_lock);
+		return;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	free(ptr);
+}
+
+void hid_arena_release(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	arena_start = arena_next = arena_end = NULL;
+	free_handles = NULL;
+	free_blocks = NULL;
+	pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,629 @@
+/* HID support code going through the mcpd broker */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+#include "mcpd_proto.h"
+
+// Poll the ring this many times before sleeping on the notify fd
+#define SPIN_COUNT 4000
+
+// HID context
+struct hid_context {
+	// Control socket, each request and its reply are exchanged under the lock
+	int broker;
+	pthread_mutex_t control_lock;
+	// Handles waiting for the response of an asynchronous exchange
+	struct hid_handle *pending;
+	size_t pending_count;
+	// Owned by the thread handling events, grown as needed
+	struct pollfd *fds;
+	size_t fds_len;
+	// Protocol layer event loop
+	struct mcp2210_loop loop;
+};
+
+// HID handle
+struct hid_handle {
+	hid_context_t *ctx;
+	// Index of the device at the broker
+	uint32_t index;
+
+	// Channel, opened on first use
+	uint32_t channel;
+	mcpd_ring_t *ring;
+	int doorbell, notify;
+
+	// User-friendly text description
+	char desc[MCPD_DESC_LEN];
+
+	// Asynchronous exchange in flight
+	void *in;
+	size_t in_len;
+	hid_callback_t callback;
+	void *arg;
+	struct hid_handle *pending_next;
+	// client_waiting was set for an outside event loop
+	bool armed;
+	// Low latency mode, 0 -> off
+	uint32_t spin_us;
+
+	// Protocol layer state
+	struct mcp2210_state state;
+};
+
+// Every context has a connection of its own
+static int connect_broker(void)
+{
+	const char *path = getenv(MCPD_SOCKET_ENV);
+	if (!path)
+		path = MCPD_SOCKET_PATH;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (-1 == connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+hid_context_t *hid_context_create(void)
+{
+	hid_context_t *ctx = hid_arena_alloc(sizeof(hid_context_t));
+	if (!ctx)
+		return NULL;
+	if (-1 == (ctx->broker = connect_broker()))
+		goto err1;
+	if (-1 == mcp2210_loop_init(&ctx->loop))
+		goto err2;
+	pthread_mutex_init(&ctx->control_lock, NULL);
+	return ctx;
+
+err2:
+	close(ctx->broker);
+err1:
+	hid_arena_free(ctx, sizeof(hid_context_t));
+	return NULL;
+}
+
+void hid_context_free(hid_context_t *ctx)
+{
+	mcp2210_loop_fini(&ctx->loop);
+	free(ctx->fds);
+	pthread_mutex_destroy(&ctx->control_lock);
+	close(ctx->broker);
+	hid_arena_free(ctx, sizeof(hid_context_t));
+}
+
+// Ask the broker for a channel to the device
+static int open_channel(hid_handle_t *handle)
+{
+	hid_context_t *ctx = handle->ctx;
+	mcpd_msg_t msg = { MCPD_OPEN, handle->index };
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct iovec iov = { &msg, sizeof(msg) };
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control.buf;
+	hdr.msg_controllen = sizeof(control.buf);
+
+	// Another thread's reply must not end up here
+	pthread_mutex_lock(&ctx->control_lock);
+	ssize_t len = send(ctx->broker, &msg, sizeof(msg), 0);
+	if (len != -1)
+		len = recvmsg(ctx->broker, &hdr, MSG_CMSG_CLOEXEC);
+	pthread_mutex_unlock(&ctx->control_lock);
+	if (len == -1)
+		return -1;
+	if (msg.type == MCPD_ERROR) {
+		errno = msg.arg;
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	if (msg.type != MCPD_OPENED || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	int fds[3];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	void *ring = mmap(NULL, sizeof(mcpd_ring_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (ring == MAP_FAILED) {
+		close(fds[1]);
+		close(fds[2]);
+		return -1;
+	}
+
+	handle->channel = msg.arg;
+	handle->ring = ring;
+	handle->doorbell = fds[1];
+	handle->notify = fds[2];
+	return 0;
+}
+
+// Fetch the device list of the broker
+static int list_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	mcpd_device_list_t *list)
+{
+	mcpd_msg_t msg = { MCPD_LIST, (uint32_t) vid << 16 | pid };
+	pthread_mutex_lock(&ctx->control_lock);
+	ssize_t len = send(ctx->broker, &msg, sizeof(msg), 0);
+	if (len != -1)
+		len = recv(ctx->broker, list, sizeof(*list), 0);
+	pthread_mutex_unlock(&ctx->control_lock);
+	if (len == -1)
+		return -1;
+	if ((size_t) len < offsetof(mcpd_device_list_t, devices) ||
+			list->type != MCPD_DEVICES || list->count > MCPD_MAX_DEVICES) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t hid_ctx_enumerate(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_device_info_t *dest, size_t dest_len)
+{
+	mcpd_device_list_t list;
+	if (-1 == list_devices(ctx, vid, pid, &list))
+		return -1;
+
+	if (list.count > dest_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < list.count; ++i)
+		dest[i] = list.devices[i].info;
+	return list.count;
+}
+
+static hid_handle_t *new_handle(hid_context_t *ctx, uint32_t index, const char *desc)
+{
+	hid_handle_t *handle = hid_alloc_handle(sizeof(hid_handle_t));
+	if (!handle)
+		return NULL;
+	handle->ctx = ctx;
+	handle->index = index;
+	handle->ring = NULL;
+	handle->doorbell = handle->notify = -1;
+	snprintf(handle->desc, sizeof(handle->desc), "%s", desc);
+	mcp2210_state_init(&handle->state);
+	return handle;
+}
+
+static hid_handle_t *open_index(hid_context_t *ctx, uint32_t index, const char *desc)
+{
+	hid_handle_t *handle = new_handle(ctx, index, desc);
+	if (handle && -1 == open_channel(handle)) {
+		hid_cleanup_device(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+hid_handle_t *hid_ctx_open_path(hid_context_t *ctx, const char *path)
+{
+	unsigned index;
+	if (1 != sscanf(path, "mcpd:%u", &index)) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	char desc[MCPD_DESC_LEN];
+	snprintf(desc, sizeof(desc), "mcpd [%u]", index);
+	return open_index(ctx, index, desc);
+}
+
+hid_handle_t *hid_ctx_open(hid_context_t *ctx, const hid_device_info_t *info)
+{
+	return hid_ctx_open_path(ctx, info->path);
+}
+
+// The broker keeps the list, so lookups are a single request
+static hid_handle_t *open_matching(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *port_path, const char *serial)
+{
+	mcpd_device_list_t list;
+	if (-1 == list_devices(ctx, vid, pid, &list))
+		return NULL;
+
+	for (size_t i = 0; i < list.count; ++i) {
+		hid_device_info_t *info = &list.devices[i].info;
+		if ((port_path && !strcmp(info->port_path, port_path)) ||
+				(serial && !strcmp(info->serial, serial)))
+			return open_index(ctx, i, list.devices[i].desc);
+	}
+
+	errno = ENODEV;
+	return NULL;
+}
+
+hid_handle_t *hid_ctx_open_port(hid_context_t *ctx, const char *port_path)
+{
+	// The broker only serves MCP2210s
+	return open_matching(ctx, MCP2210_VID, MCP2210_PID, port_path, NULL);
+}
+
+hid_handle_t *hid_ctx_open_serial(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *serial)
+{
+	return open_matching(ctx, vid, pid, NULL, serial);
+}
+
+ssize_t hid_ctx_find_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_handle_t **dest, size_t dest_len)
+{
+	mcpd_device_list_t list;
+	if (-1 == list_devices(ctx, vid, pid, &list))
+		return -1;
+
+	if (list.count > dest_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// Channels are opened on first use
+	for (size_t i = 0; i < list.count; ++i) {
+		dest[i] = new_handle(ctx, i, list.devices[i].desc);
+		if (!dest[i]) {
+			while (i--)
+				hid_cleanup_device(dest[i]);
+			return -1;
+		}
+	}
+	return list.count;
+}
+
+// Wait until the broker moves *index away from seen or reports an error
+static int wait_broker(hid_handle_t *handle, uint32_t *index, uint32_t seen)
+{
+	mcpd_ring_t *ring = handle->ring;
+
+	// The low latency mode spins for a time instead of a number of checks
+	uint64_t deadline = handle->spin_us ? mcp2210_now_us() + handle->spin_us : 0;
+	for (size_t i = 0; i < SPIN_COUNT || (deadline && mcp2210_now_us() < deadline); ++i) {
+		if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != seen ||
+				__atomic_load_n(&ring->error, __ATOMIC_RELAXED))
+			return 0;
+	}
+
+	int result = 0;
+	__atomic_store_n(&ring->client_waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen &&
+			!__atomic_load_n(&ring->error, __ATOMIC_RELAXED)) {
+		// The control socket only becomes readable when the broker is gone
+		struct pollfd fds[2] = {
+			{ handle->notify, POLLIN, 0 },
+			{ handle->ctx->broker, 0, 0 }
+		};
+		if (-1 == poll(fds, 2, -1)) {
+			if (errno == EINTR)
+				continue;
+			result = -1;
+			break;
+		}
+		if (fds[1].revents) {
+			errno = EPIPE;
+			result = -1;
+			break;
+		}
+		uint64_t count;
+		if (fds[0].revents & POLLIN)
+			(void) !read(handle->notify, &count, sizeof(count));
+	}
+	__atomic_store_n(&ring->client_waiting, 0, __ATOMIC_RELAXED);
+	return result;
+}
+
+// The broker owns the device, its power settings are not ours to change
+int hid_set_low_latency(hid_handle_t *handle, uint32_t spin_us)
+{
+	handle->spin_us = spin_us;
+	return 0;
+}
+
+const char *hid_device_desc(hid_handle_t *handle)
+{
+	return handle->desc;
+}
+
+// Requests wait in the ring, the broker runs them one after another
+size_t hid_pipeline_depth(hid_handle_t *handle)
+{
+	(void) handle;
+	return MCPD_RING_SLOTS;
+}
+
+ssize_t hid_write(hid_handle_t *handle, void *data, size_t data_len)
+{
+	if (data_len > MCPD_REPORT_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!handle->ring && -1 == open_channel(handle))
+		return -1;
+
+	mcpd_ring_t *ring = handle->ring;
+	uint32_t head = ring->req_head;
+
+	// Wait for a free slot
+	if (head - __atomic_load_n(&ring->req_tail, __ATOMIC_ACQUIRE) >= MCPD_RING_SLOTS &&
+			-1 == wait_broker(handle, &ring->req_tail, head - MCPD_RING_SLOTS))
+		return -1;
+
+	uint8_t *slot = ring->req[head % MCPD_RING_SLOTS];
+	memcpy(slot, data, data_len);
+	memset(slot + data_len, 0, MCPD_REPORT_SIZE - data_len);
+	__atomic_store_n(&ring->req_head, head + 1, __ATOMIC_SEQ_CST);
+
+	// Only ring the doorbell when the broker went to sleep
+	if (__atomic_load_n(&ring->broker_waiting, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (-1 == write(handle->doorbell, &one, sizeof(one)))
+			return -1;
+	}
+	return data_len;
+}
+
+ssize_t hid_read(hid_handle_t *handle, void *buffer, size_t buffer_len)
+{
+	if (!handle->ring && -1 == open_channel(handle))
+		return -1;
+
+	mcpd_ring_t *ring = handle->ring;
+	uint32_t tail = ring->resp_tail;
+
+	if (-1 == wait_broker(handle, &ring->resp_head, tail))
+		return -1;
+
+	if (__atomic_load_n(&ring->resp_head, __ATOMIC_ACQUIRE) == tail) {
+		errno = __atomic_exchange_n(&ring->error, 0, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (buffer_len > MCPD_REPORT_SIZE)
+		buffer_len = MCPD_REPORT_SIZE;
+	memcpy(buffer, ring->resp[tail % MCPD_RING_SLOTS], buffer_len);
+	__atomic_store_n(&ring->resp_tail, tail + 1, __ATOMIC_RELEASE);
+	return buffer_len;
+}
+
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg)
+{
+	// Posting to the ring does not wait for the broker
+	if (-1 == hid_write(handle, out, out_len))
+		return -1;
+
+	handle->in = in;
+	handle->in_len = in_len;
+	handle->callback = callback;
+	handle->arg = arg;
+	hid_context_t *ctx = handle->ctx;
+	handle->pending_next = ctx->pending;
+	handle->armed = false;
+	ctx->pending = handle;
+	ctx->pending_count++;
+	return 0;
+}
+
+static bool response_ready(hid_handle_t *handle)
+{
+	mcpd_ring_t *ring = handle->ring;
+	return __atomic_load_n(&ring->resp_head, __ATOMIC_ACQUIRE) != ring->resp_tail ||
+		__atomic_load_n(&ring->error, __ATOMIC_RELAXED);
+}
+
+// Unlink the handles with a response, NULL if none
+static hid_handle_t *collect_ready(hid_context_t *ctx)
+{
+	hid_handle_t *done = NULL, **cur = &ctx->pending;
+	while (*cur) {
+		hid_handle_t *handle = *cur;
+		if (response_ready(handle)) {
+			*cur = handle->pending_next;
+			handle->pending_next = done;
+			done = handle;
+			ctx->pending_count--;
+		} else {
+			cur = &handle->pending_next;
+		}
+	}
+	return done;
+}
+
+// Sleep on the notify fds of all pending handles
+static int wait_pending(hid_context_t *ctx, int timeout_ms)
+{
+	if (ctx->pending_count + 1 > ctx->fds_len) {
+		size_t len = ctx->fds_len ? ctx->fds_len * 2 : 16;
+		while (len < ctx->pending_count + 1)
+			len *= 2;
+		struct pollfd *fds = realloc(ctx->fds, len * sizeof(*fds));
+		if (!fds)
+			return -1;
+		ctx->fds = fds;
+		ctx->fds_len = len;
+	}
+
+	struct pollfd *fds = ctx->fds;
+	size_t n = 0;
+	for (hid_handle_t *cur = ctx->pending; cur; cur = cur->pending_next) {
+		__atomic_store_n(&cur->ring->client_waiting, 1, __ATOMIC_SEQ_CST);
+		fds[n].fd = cur->notify;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+	// The control socket only becomes readable when the broker is gone
+	fds[n].fd = ctx->broker;
+	fds[n].events = 0;
+	fds[n].revents = 0;
+
+	int result = 0;
+	// Responses that arrived before client_waiting was seen won't notify
+	bool ready = false;
+	for (hid_handle_t *cur = ctx->pending; cur; cur = cur->pending_next)
+		ready = ready || response_ready(cur);
+
+	if (!ready) {
+		result = poll(fds, n + 1, timeout_ms);
+		if (result != -1 && fds[n].revents) {
+			errno = EPIPE;
+			result = -1;
+		}
+	}
+
+	uint64_t count;
+	for (size_t i = 0; i < n; ++i)
+		if (fds[i].revents & POLLIN)
+			(void) !read(fds[i].fd, &count, sizeof(count));
+	for (hid_handle_t *cur = ctx->pending; cur; cur = cur->pending_next)
+		__atomic_store_n(&cur->ring->client_waiting, 0, __ATOMIC_RELAXED);
+	return result == -1 ? -1 : 0;
+}
+
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	if (!ctx->pending_count)
+		return 0;
+
+	// Spin first, the broker usually answers within microseconds
+	hid_handle_t *done = collect_ready(ctx);
+	for (size_t i = 0; timeout_ms && i < SPIN_COUNT && !done; ++i)
+		done = collect_ready(ctx);
+
+	if (!done && timeout_ms) {
+		if (-1 == wait_pending(ctx, timeout_ms))
+			return -1;
+		done = collect_ready(ctx);
+	}
+
+	int count = 0;
+	while (done) {
+		hid_handle_t *handle = done;
+		done = handle->pending_next;
+		if (handle->armed) {
+			uint64_t count;
+			__atomic_store_n(&handle->ring->client_waiting, 0, __ATOMIC_RELAXED);
+			(void) !read(handle->notify, &count, sizeof(count));
+			handle->armed = false;
+		}
+		int error = 0;
+		if (-1 == hid_read(handle, handle->in, handle->in_len))
+			error = errno;
+		handle->callback(handle, error, handle->arg);
+		count++;
+	}
+	return count;
+}
+
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
+{
+	if (ctx->pending_count + 1 > fds_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t n = 0;
+	for (hid_handle_t *cur = ctx->pending; cur; cur = cur->pending_next) {
+		// The broker only signals clients that announced they sleep
+		__atomic_store_n(&cur->ring->client_waiting, 1, __ATOMIC_SEQ_CST);
+		cur->armed = true;
+		if (response_ready(cur))
+			*timeout_ms = 0;
+		fds[n].fd = cur->notify;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+	// Becomes readable when the broker is gone
+	fds[n].fd = ctx->broker;
+	fds[n].events = 0;
+	fds[n].revents = 0;
+	return n + 1;
+}
+
+void hid_cleanup_device(hid_handle_t *handle)
+{
+	// Drop an exchange that never completed
+	hid_context_t *ctx = handle->ctx;
+	for (hid_handle_t **cur = &ctx->pending; *cur; cur = &(*cur)->pending_next) {
+		if (*cur == handle) {
+			*cur = handle->pending_next;
+			ctx->pending_count--;
+			break;
+		}
+	}
+
+	if (handle->ring) {
+		mcpd_msg_t msg = { MCPD_CLOSE, handle->channel };
+		// Sent under the lock like every control message
+		pthread_mutex_lock(&ctx->control_lock);
+		send(ctx->broker, &msg, sizeof(msg), 0);
+		pthread_mutex_unlock(&ctx->control_lock);
+		munmap(handle->ring, sizeof(mcpd_ring_t));
+		close(handle->doorbell);
+		close(handle->notify);
+	}
+	mcp2210_state_fini(&handle->state);
+	hid_free_handle(handle);
+}
+
+struct mcp2210_state *hid_state(hid_handle_t *handle)
+{
+	return &handle->state;
+}
+
+hid_context_t *hid_context(hid_handle_t *handle)
+{
+	return handle->ctx;
+}
+
+struct mcp2210_loop *hid_loop(hid_context_t *ctx)
+{
+	return &ctx->loop;
+}
+
+size_t hid_arena_size(size_t handles)
+{
+	// Slack for aligning the start of the arena
+	return hid_arena_cost(sizeof(hid_context_t)) +
+		handles * hid_arena_cost(sizeof(hid_handle_t)) + hid_arena_cost(1);
+}
@@ -0,0 +1,87 @@
+/* default context of the HID module, used by the calls without one */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+
+static hid_context_t *default_context;
+
+int hid_init()
+{
+	if (default_context)
+		return 0;
+	default_context = hid_context_create();
+	return default_context ? 0 : -1;
+}
+
+void hid_fini()
+{
+	if (default_context) {
+		hid_context_free(default_context);
+		default_context = NULL;
+	}
+	hid_arena_release();
+}
+
+hid_context_t *hid_default_context(void)
+{
+	return default_context;
+}
+
+// The default context, EINVAL before hid_init
+static hid_context_t *get_default(void)
+{
+	if (!default_context)
+		errno = EINVAL;
+	return default_context;
+}
+
+ssize_t hid_enumerate(uint16_t vid, uint16_t pid, hid_device_info_t *dest, size_t dest_len)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_enumerate(ctx, vid, pid, dest, dest_len) : -1;
+}
+
+hid_handle_t *hid_open(const hid_device_info_t *info)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_open(ctx, info) : NULL;
+}
+
+hid_handle_t *hid_open_port(const char *port_path)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_open_port(ctx, port_path) : NULL;
+}
+
+hid_handle_t *hid_open_path(const char *path)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_open_path(ctx, path) : NULL;
+}
+
+hid_handle_t *hid_open_serial(uint16_t vid, uint16_t pid, const char *serial)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_open_serial(ctx, vid, pid, serial) : NULL;
+}
+
+ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t dest_len)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_find_devices(ctx, vid, pid, dest, dest_len) : -1;
+}
+
+int hid_handle_events(int timeout_ms)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_handle_events(ctx, timeout_ms) : -1;
+}
+
+ssize_t hid_get_pollfds(struct pollfd *fds, size_t fds_len, int *timeout_ms)
+{
+	hid_context_t *ctx = get_default();
+	return ctx ? hid_ctx_get_pollfds(ctx, fds, fds_len, timeout_ms) : -1;
+}
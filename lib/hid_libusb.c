@@ -6,11 +6,23 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <libusb.h>
 #include "hid.h"
+#include "mcp2210_priv.h"
+
+// HID context
+struct hid_context {
+	libusb_context *usb;
+	// Callbacks run from hid_ctx_handle_events so far
+	int completed;
+	// Protocol layer event loop
+	struct mcp2210_loop loop;
+};
 
 // HID handle
 struct hid_handle {
+	hid_context_t *ctx;
 	// libusb handle
 	libusb_device_handle *libusb_handle;
 
@@ -18,116 +30,354 @@ struct hid_handle {
 	uint8_t endpoint_in, endpoint_out;
 
 	// User-friendly text description
-	char text[33];
+	char text[96];
+
+	// Asynchronous exchange, the IN transfer is posted before the OUT
+	// transfer so the response can't be missed
+	struct libusb_transfer *transfer_in, *transfer_out;
+	// Reused by hid_write and hid_read
+	struct libusb_transfer *transfer_sync;
+	// Low latency mode, 0 -> off
+	uint32_t spin_us;
+	struct hid_power power;
+	hid_callback_t callback;
+	void *arg;
+	// Halves of the exchange not completed yet, atomic since the thread
+	// submitting and the one handling events race for it
+	int transfers_left;
+	int error;
+	// Set when submitting failed halfway and the callback must not run, atomic
+	int abandoned;
+
+	// Protocol layer state
+	struct mcp2210_state state;
 };
 
-int hid_init()
+hid_context_t *hid_context_create(void)
 {
-	if (libusb_init(NULL) < 0) {
-		return -1;
+	hid_context_t *ctx = hid_arena_alloc(sizeof(hid_context_t));
+	if (!ctx)
+		return NULL;
+	if (libusb_init(&ctx->usb) < 0) {
+		errno = EIO;
+		goto err1;
 	}
-	return 0;
+	if (-1 == mcp2210_loop_init(&ctx->loop))
+		goto err2;
+	return ctx;
+
+err2:
+	libusb_exit(ctx->usb);
+err1:
+	hid_arena_free(ctx, sizeof(hid_context_t));
+	return NULL;
+}
+
+void hid_context_free(hid_context_t *ctx)
+{
+	mcp2210_loop_fini(&ctx->loop);
+	libusb_exit(ctx->usb);
+	hid_arena_free(ctx, sizeof(hid_context_t));
 }
 
-ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t dest_len)
+// Format the port path of a device like the Linux kernel does
+static void get_port_path(libusb_device *device, char *dest, size_t dest_len)
 {
+	uint8_t ports[8];
+	int port_count = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+	int len = snprintf(dest, dest_len, "%u", libusb_get_bus_number(device));
+	for (int i = 0; i < port_count && len > 0 && (size_t) len < dest_len; ++i)
+		len += snprintf(dest + len, dest_len - len, "%c%u",
+			i ? '.' : '-', ports[i]);
+}
+
+// Read a string attribute of a USB device, empty if unavailable
+static void get_sysfs_string(const char *port_path, const char *attr,
+	char *dest, size_t dest_len)
+{
+	dest[0] = '\0';
+#ifdef __linux__
+	// libusb can only read string descriptors from an open device, but
+	// Linux caches them in sysfs
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", port_path, attr);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return;
+	if (fgets(dest, dest_len, file))
+		dest[strcspn(dest, "\n")] = '\0';
+	fclose(file);
+#else
+	(void) port_path;
+	(void) attr;
+	(void) dest_len;
+#endif
+}
+
+ssize_t hid_ctx_enumerate(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_device_info_t *dest, size_t dest_len)
+{
+	MCP2210_TRACE2(enumerate_entry, vid, pid);
+
 	libusb_device **devices;
-	ssize_t device_count = libusb_get_device_list(NULL, &devices);
+	ssize_t device_count = libusb_get_device_list(ctx->usb, &devices);
 	if (device_count < 0)
-		return -1;
+		goto err1;
 
 	size_t dev_index = 0;
 
 	for (size_t dev_i = 0; dev_i < (size_t) device_count; ++dev_i) {
 		struct libusb_device_descriptor dev_desc;
 
-		if (libusb_get_device_descriptor(devices[dev_i], &dev_desc) < 0) {
-			goto err;
+		// The device descriptor is cached, this does not open the device
+		if (libusb_get_device_descriptor(devices[dev_i], &dev_desc) < 0)
+			goto err2;
+
+		if (dev_desc.idVendor != vid || dev_desc.idProduct != pid)
+			continue;
+
+		if (dev_index >= dest_len) {
+			errno = ENOMEM;
+			goto err2;
 		}
 
-		if (dev_desc.idVendor == vid && dev_desc.idProduct == pid) {
-			// Create a handle and open the device
-			hid_handle_t *handle = malloc(sizeof(hid_handle_t));
-			if (libusb_open(devices[dev_i], &handle->libusb_handle) < 0) {
-				free(handle);
-				goto err;
-			}
+		hid_device_info_t *info = &dest[dev_index++];
+		info->vid = vid;
+		info->pid = pid;
+		info->bus = libusb_get_bus_number(devices[dev_i]);
+		get_port_path(devices[dev_i], info->port_path, sizeof(info->port_path));
+		// Port paths are short, USB allows 7 tiers of hubs
+		snprintf(info->path, sizeof(info->path), "usb:%.*s",
+			HID_INFO_STRLEN - 5, info->port_path);
+		get_sysfs_string(info->port_path, "serial",
+			info->serial, sizeof(info->serial));
+		get_sysfs_string(info->port_path, "manufacturer",
+			info->manufacturer, sizeof(info->manufacturer));
+		get_sysfs_string(info->port_path, "product",
+			info->product, sizeof(info->product));
+	}
 
-			// Now check if it actually has a HID interface and claim it
-			struct libusb_config_descriptor *conf_desc;
-			if (libusb_get_config_descriptor(devices[dev_i], 0, &conf_desc) < 0) {
-				libusb_close(handle->libusb_handle);
-				free(handle);
-				goto err;
-			}
+	libusb_free_device_list(devices, 1);
+	MCP2210_TRACE1(enumerate_return, (ssize_t) dev_index);
+	return dev_index;
+err2:
+	libusb_free_device_list(devices, 1);
+err1:
+	MCP2210_TRACE1(enumerate_return, (ssize_t) -1);
+	return -1;
+}
 
-			// FIXME: This works with the MCP2210, but someone more familiar with
-			// libusb and USB terminology should clean this up
-			if (conf_desc->bNumInterfaces != 1 ||
-					conf_desc->interface[0].num_altsetting != 1 ||
-					conf_desc->interface[0].altsetting[0].bInterfaceClass
-						!= LIBUSB_CLASS_HID) {
-				libusb_free_config_descriptor(conf_desc);
-				libusb_close(handle->libusb_handle);
-				free(handle);
-				goto err;
-			}
+// Open a device, check if it actually has a HID interface and claim it
+static hid_handle_t *open_device(hid_context_t *ctx, libusb_device *device,
+	const char *port_path)
+{
+	struct libusb_device_descriptor dev_desc;
+	if (libusb_get_device_descriptor(device, &dev_desc) < 0)
+		return NULL;
 
-			size_t in_cnt = 0, out_cnt = 0;
-
-			// We need an IN and OUT interrupt endpoint
-			for (size_t ep_i = 0; ep_i < conf_desc->interface[0]
-					.altsetting[0].bNumEndpoints; ++ep_i) {
-				const struct libusb_endpoint_descriptor *endpoint =
-					&conf_desc->interface[0].altsetting[0].endpoint[ep_i];
-
-				// Looking only for interrupt transfer endpoints
-				if ((endpoint->bmAttributes | LIBUSB_TRANSFER_TYPE_MASK) |
-						LIBUSB_TRANSFER_TYPE_INTERRUPT) {
-					if (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
-						handle->endpoint_in = endpoint->bEndpointAddress;
-						in_cnt++;
-					} else {
-						handle->endpoint_out = endpoint->bEndpointAddress;
-						out_cnt++;
-					}
-				}
-			}
+	hid_handle_t *handle = hid_alloc_handle(sizeof(hid_handle_t));
+	if (!handle)
+		return NULL;
+	handle->ctx = ctx;
+	if (libusb_open(device, &handle->libusb_handle) < 0)
+		goto err1;
 
-			// It should only have one IN and one OUT endpoint
-			if (in_cnt != 1 || out_cnt != 1) {
-				libusb_free_config_descriptor(conf_desc);
-				libusb_close(handle->libusb_handle);
-				free(handle);
-				goto err;
-			}
+	struct libusb_config_descriptor *conf_desc;
+	if (libusb_get_config_descriptor(device, 0, &conf_desc) < 0)
+		goto err2;
+
+	// FIXME: This works with the MCP2210, but someone more familiar with
+	// libusb and USB terminology should clean this up
+	if (conf_desc->bNumInterfaces != 1 ||
+			conf_desc->interface[0].num_altsetting != 1 ||
+			conf_desc->interface[0].altsetting[0].bInterfaceClass
+				!= LIBUSB_CLASS_HID)
+		goto err3;
+
+	size_t in_cnt = 0, out_cnt = 0;
 
-			libusb_set_auto_detach_kernel_driver(handle->libusb_handle, 1);
-			if (libusb_claim_interface(handle->libusb_handle, 0) < 0) {
-				libusb_free_config_descriptor(conf_desc);
-				libusb_close(handle->libusb_handle);
-				free(handle);
-				goto err;
+	// We need an IN and OUT interrupt endpoint
+	for (size_t ep_i = 0; ep_i < conf_desc->interface[0]
+			.altsetting[0].bNumEndpoints; ++ep_i) {
+		const struct libusb_endpoint_descriptor *endpoint =
+			&conf_desc->interface[0].altsetting[0].endpoint[ep_i];
+
+		// Looking only for interrupt transfer endpoints
+		if ((endpoint->bmAttributes | LIBUSB_TRANSFER_TYPE_MASK) |
+				LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+			if (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+				handle->endpoint_in = endpoint->bEndpointAddress;
+				in_cnt++;
+			} else {
+				handle->endpoint_out = endpoint->bEndpointAddress;
+				out_cnt++;
 			}
+		}
+	}
+
+	// It should only have one IN and one OUT endpoint
+	if (in_cnt != 1 || out_cnt != 1)
+		goto err3;
 
-			// Generate a user friendly description of the device
-			snprintf(handle->text, 33, "MCP2210 => VID: %04x, PID: %04x\n",
-				dev_desc.idVendor, dev_desc.idProduct);
+	handle->transfer_in = libusb_alloc_transfer(0);
+	handle->transfer_out = libusb_alloc_transfer(0);
+	handle->transfer_sync = libusb_alloc_transfer(0);
+	if (!handle->transfer_in || !handle->transfer_out || !handle->transfer_sync)
+		goto err4;
 
-			// Add it to the array
-			if (dev_index < dest_len)
-				dest[dev_index++] = handle;
+	libusb_set_auto_detach_kernel_driver(handle->libusb_handle, 1);
+	if (libusb_claim_interface(handle->libusb_handle, 0) < 0)
+		goto err4;
 
-			// Cleanup
-			libusb_free_config_descriptor(conf_desc);
+	// Generate a user friendly description of the device
+	snprintf(handle->text, sizeof(handle->text),
+		"MCP2210 => VID: %04x, PID: %04x, port: %s",
+		dev_desc.idVendor, dev_desc.idProduct, port_path);
+
+	mcp2210_state_init(&handle->state);
+	libusb_free_config_descriptor(conf_desc);
+	return handle;
+
+err4:
+	libusb_free_transfer(handle->transfer_in);
+	libusb_free_transfer(handle->transfer_out);
+	libusb_free_transfer(handle->transfer_sync);
+err3:
+	libusb_free_config_descriptor(conf_desc);
+err2:
+	libusb_close(handle->libusb_handle);
+err1:
+	hid_free_handle(handle);
+	errno = EIO;
+	return NULL;
+}
+
+// Open the device at a port, as long as it has the expected IDs. Claiming
+// the interface detaches the kernel driver of whatever else is plugged in.
+static hid_handle_t *open_port(hid_context_t *ctx, const char *port_path,
+	uint16_t vid, uint16_t pid)
+{
+	unsigned bus;
+	if (1 != sscanf(port_path, "%u-", &bus)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	libusb_device **devices;
+	ssize_t device_count = libusb_get_device_list(ctx->usb, &devices);
+	if (device_count < 0)
+		return NULL;
+
+	// Only compare the port path on the right bus, nothing is opened
+	hid_handle_t *handle = NULL;
+	errno = ENODEV;
+	for (size_t dev_i = 0; dev_i < (size_t) device_count; ++dev_i) {
+		char cur_path[HID_INFO_STRLEN];
+		if (libusb_get_bus_number(devices[dev_i]) != bus)
+			continue;
+		get_port_path(devices[dev_i], cur_path, sizeof(cur_path));
+		if (!strcmp(cur_path, port_path)) {
+			struct libusb_device_descriptor dev_desc;
+			if (libusb_get_device_descriptor(devices[dev_i], &dev_desc) == 0 &&
+					dev_desc.idVendor == vid && dev_desc.idProduct == pid)
+				handle = open_device(ctx, devices[dev_i], cur_path);
+			break;
 		}
 	}
 
 	libusb_free_device_list(devices, 1);
-	return dev_index;
-err:
+	return handle;
+}
+
+hid_handle_t *hid_ctx_open_port(hid_context_t *ctx, const char *port_path)
+{
+	return open_port(ctx, port_path, MCP2210_VID, MCP2210_PID);
+}
+
+hid_handle_t *hid_ctx_open_path(hid_context_t *ctx, const char *path)
+{
+	// Paths of this backend are usb:<port path>
+	if (strncmp(path, "usb:", 4)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return hid_ctx_open_port(ctx, path + 4);
+}
+
+hid_handle_t *hid_ctx_open(hid_context_t *ctx, const hid_device_info_t *info)
+{
+	return open_port(ctx, info->port_path, info->vid, info->pid);
+}
+
+// Read the serial number descriptor, this has to open the device
+static void get_serial_descriptor(libusb_device *device, uint8_t index,
+	char *dest, size_t dest_len)
+{
+	libusb_device_handle *libusb_handle;
+
+	dest[0] = '\0';
+	if (!index || libusb_open(device, &libusb_handle) < 0)
+		return;
+	if (libusb_get_string_descriptor_ascii(libusb_handle, index,
+			(unsigned char *) dest, dest_len) < 0)
+		dest[0] = '\0';
+	libusb_close(libusb_handle);
+}
+
+hid_handle_t *hid_ctx_open_serial(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *serial)
+{
+	libusb_device **devices;
+	ssize_t device_count = libusb_get_device_list(ctx->usb, &devices);
+	if (device_count < 0)
+		return NULL;
+
+	hid_handle_t *handle = NULL;
+	errno = ENODEV;
+	for (size_t dev_i = 0; dev_i < (size_t) device_count; ++dev_i) {
+		struct libusb_device_descriptor dev_desc;
+		if (libusb_get_device_descriptor(devices[dev_i], &dev_desc) < 0 ||
+				dev_desc.idVendor != vid || dev_desc.idProduct != pid)
+			continue;
+
+		char port_path[HID_INFO_STRLEN], cur_serial[HID_INFO_STRLEN];
+		get_port_path(devices[dev_i], port_path, sizeof(port_path));
+		get_sysfs_string(port_path, "serial", cur_serial, sizeof(cur_serial));
+		if (!cur_serial[0])
+			get_serial_descriptor(devices[dev_i], dev_desc.iSerialNumber,
+				cur_serial, sizeof(cur_serial));
+
+		if (!strcmp(cur_serial, serial)) {
+			handle = open_device(ctx, devices[dev_i], port_path);
+			break;
+		}
+	}
+
 	libusb_free_device_list(devices, 1);
-	return -1;
+	return handle;
+}
+
+ssize_t hid_ctx_find_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_handle_t **dest, size_t dest_len)
+{
+	hid_device_info_t *info = malloc(sizeof(hid_device_info_t) * (dest_len + 1));
+	if (!info)
+		return -1;
+
+	ssize_t device_count = hid_ctx_enumerate(ctx, vid, pid, info, dest_len);
+	for (ssize_t i = 0; i < device_count; ++i) {
+		dest[i] = hid_ctx_open(ctx, &info[i]);
+		if (!dest[i]) {
+			while (i--)
+				hid_cleanup_device(dest[i]);
+			device_count = -1;
+			break;
+		}
+	}
+
+	free(info);
+	return device_count;
 }
 
 const char *hid_device_desc(hid_handle_t *handle)
@@ -135,41 +385,247 @@ const char *hid_device_desc(hid_handle_t *handle)
 	return handle->text;
 }
 
-ssize_t hid_write(hid_handle_t *handle, void *data, size_t data_len)
+// errno value for the outcome of a transfer
+static int transfer_errno(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length == transfer->length ? 0 : EINVAL;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return ECANCELED;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return ENODEV;
+	case LIBUSB_TRANSFER_STALL:
+		return EPIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return EOVERFLOW;
+	default:
+		return EIO;
+	}
+}
+
+static void LIBUSB_CALL sync_done(struct libusb_transfer *transfer)
 {
-	int transferred;
-	if (libusb_interrupt_transfer(handle->libusb_handle, handle->endpoint_out,
-			data, data_len, &transferred, 0) < 0)
+	*(int *) transfer->user_data = 1;
+}
+
+// What libusb_interrupt_transfer does, but with the transfer of the handle
+// instead of allocating one for every report
+static ssize_t sync_transfer(hid_handle_t *handle, uint8_t endpoint,
+	void *data, size_t data_len)
+{
+	int done = 0;
+	libusb_fill_interrupt_transfer(handle->transfer_sync, handle->libusb_handle,
+		endpoint, data, data_len, sync_done, &done, 0);
+
+	int status = libusb_submit_transfer(handle->transfer_sync);
+	if (status < 0) {
+		errno = status == LIBUSB_ERROR_NO_DEVICE ? ENODEV : EIO;
 		return -1;
-	if ((size_t) transferred != data_len) {
-		errno = EINVAL;
+	}
+
+	// In low latency mode libusb is polled without waiting at first
+	libusb_context *usb = handle->ctx->usb;
+	uint64_t deadline = handle->spin_us ? mcp2210_now_us() + handle->spin_us : 0;
+	while (!done) {
+		if (deadline && mcp2210_now_us() < deadline) {
+			struct timeval poll = { 0, 0 };
+			status = libusb_handle_events_timeout_completed(usb, &poll, &done);
+		} else {
+			status = libusb_handle_events_completed(usb, &done);
+		}
+		// The transfer still has to finish before it can be reused
+		if (status < 0 && status != LIBUSB_ERROR_INTERRUPTED)
+			libusb_cancel_transfer(handle->transfer_sync);
+	}
+
+	int error = transfer_errno(handle->transfer_sync);
+	if (error) {
+		errno = error;
 		return -1;
 	}
-	return 0;
+	return data_len;
+}
+
+ssize_t hid_write(hid_handle_t *handle, void *data, size_t data_len)
+{
+	MCP2210_TRACE2(hid_write_entry, handle, data_len);
+	ssize_t result = sync_transfer(handle, handle->endpoint_out, data, data_len);
+	MCP2210_TRACE2(hid_write_return, handle, result);
+	return result;
 }
 
 ssize_t hid_read(hid_handle_t *handle, void *buffer, size_t buffer_len)
 {
-	int read;
-	if (libusb_interrupt_transfer(handle->libusb_handle, handle->endpoint_in,
-			buffer, buffer_len, &read, 0) < 0)
+	MCP2210_TRACE2(hid_read_entry, handle, buffer_len);
+	ssize_t result = sync_transfer(handle, handle->endpoint_in, buffer, buffer_len);
+	MCP2210_TRACE2(hid_read_return, handle, result);
+	return result;
+}
+
+// Nothing reads the interrupt IN endpoint between transfers, so the chip
+// can't hand over a response before the next command is written
+size_t hid_pipeline_depth(hid_handle_t *handle)
+{
+	(void) handle;
+	return 1;
+}
+
+static void LIBUSB_CALL exchange_done(struct libusb_transfer *transfer)
+{
+	hid_handle_t *handle = transfer->user_data;
+
+	int error = transfer_errno(transfer);
+	if (error && !handle->error)
+		handle->error = error;
+
+	// Both halves have to be done before the buffers are released
+	if (__atomic_sub_fetch(&handle->transfers_left, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (__atomic_load_n(&handle->abandoned, __ATOMIC_ACQUIRE))
+		return;
+	// Sync transfers of other threads handle events too
+	__atomic_add_fetch(&handle->ctx->completed, 1, __ATOMIC_RELAXED);
+	handle->callback(handle, handle->error, handle->arg);
+}
+
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg)
+{
+	libusb_fill_interrupt_transfer(handle->transfer_in, handle->libusb_handle,
+		handle->endpoint_in, in, in_len, exchange_done, handle, 0);
+	libusb_fill_interrupt_transfer(handle->transfer_out, handle->libusb_handle,
+		handle->endpoint_out, out, out_len, exchange_done, handle, 0);
+	handle->callback = callback;
+	handle->arg = arg;
+	handle->error = 0;
+	handle->abandoned = 0;
+	// Another thread may complete a half as soon as it is submitted
+	__atomic_store_n(&handle->transfers_left, 2, __ATOMIC_RELEASE);
+
+	int status = libusb_submit_transfer(handle->transfer_in);
+	if (status < 0)
+		goto err;
+
+	status = libusb_submit_transfer(handle->transfer_out);
+	if (status < 0) {
+		// The IN transfer completes as cancelled, nobody is told
+		__atomic_store_n(&handle->abandoned, 1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&handle->transfers_left, 1, __ATOMIC_ACQ_REL);
+		libusb_cancel_transfer(handle->transfer_in);
+		goto err;
+	}
+	return 0;
+
+err:
+	errno = status == LIBUSB_ERROR_NO_DEVICE ? ENODEV : EIO;
+	return -1;
+}
+
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	int before = __atomic_load_n(&ctx->completed, __ATOMIC_RELAXED);
+	int status;
+
+	if (timeout_ms < 0) {
+		status = libusb_handle_events(ctx->usb);
+	} else {
+		struct timeval tv = { timeout_ms / 1000, timeout_ms % 1000 * 1000 };
+		status = libusb_handle_events_timeout_completed(ctx->usb, &tv, NULL);
+	}
+	if (status < 0) {
+		errno = status == LIBUSB_ERROR_INTERRUPTED ? EINTR : EIO;
 		return -1;
-	if ((size_t) read != buffer_len) {
-		errno = EINVAL;
+	}
+	return __atomic_load_n(&ctx->completed, __ATOMIC_RELAXED) - before;
+}
+
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
+{
+	const struct libusb_pollfd **usb_fds = libusb_get_pollfds(ctx->usb);
+	if (!usb_fds) {
+		errno = ENOTSUP;
 		return -1;
 	}
 
+	size_t n = 0;
+	for (; usb_fds[n]; ++n) {
+		if (n >= fds_len) {
+			libusb_free_pollfds(usb_fds);
+			errno = ENOMEM;
+			return -1;
+		}
+		fds[n].fd = usb_fds[n]->fd;
+		fds[n].events = usb_fds[n]->events;
+		fds[n].revents = 0;
+	}
+	libusb_free_pollfds(usb_fds);
+
+	// Timeouts of libusb itself
+	struct timeval tv;
+	if (1 == libusb_get_next_timeout(ctx->usb, &tv)) {
+		int64_t ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		if (*timeout_ms < 0 || ms < *timeout_ms)
+			*timeout_ms = ms;
+	}
+	return n;
+}
+
+int hid_set_low_latency(hid_handle_t *handle, uint32_t spin_us)
+{
+#ifdef __linux__
+	if (spin_us && !handle->spin_us) {
+		char port_path[HID_INFO_STRLEN];
+		get_port_path(libusb_get_device(handle->libusb_handle),
+			port_path, sizeof(port_path));
+		snprintf(handle->power.control, sizeof(handle->power.control),
+			"/sys/bus/usb/devices/%s/power/control", port_path);
+		if (-1 == hid_power_keep_on(&handle->power))
+			return -1;
+	} else if (!spin_us && handle->spin_us) {
+		hid_power_restore(&handle->power);
+	}
+#endif
+	handle->spin_us = spin_us;
 	return 0;
 }
 
 void hid_cleanup_device(hid_handle_t *handle)
 {
+#ifdef __linux__
+	if (handle->spin_us)
+		hid_power_restore(&handle->power);
+#endif
+	libusb_free_transfer(handle->transfer_in);
+	libusb_free_transfer(handle->transfer_out);
+	libusb_free_transfer(handle->transfer_sync);
 	libusb_release_interface(handle->libusb_handle, 0);
 	libusb_close(handle->libusb_handle);
-	free(handle);
+	mcp2210_state_fini(&handle->state);
+	hid_free_handle(handle);
+}
+
+struct mcp2210_state *hid_state(hid_handle_t *handle)
+{
+	return &handle->state;
+}
+
+hid_context_t *hid_context(hid_handle_t *handle)
+{
+	return handle->ctx;
+}
+
+struct mcp2210_loop *hid_loop(hid_context_t *ctx)
+{
+	return &ctx->loop;
 }
 
-void hid_fini()
+size_t hid_arena_size(size_t handles)
 {
-	libusb_exit(NULL);
+	// Slack for aligning the start of the arena
+	return hid_arena_cost(sizeof(hid_context_t)) +
+		handles * hid_arena_cost(sizeof(hid_handle_t)) + hid_arena_cost(1);
 }
@@ -6,40 +6,155 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <libudev.h>
+#ifdef HID_IO_URING
+#include <time.h>
+#include <pthread.h>
+#include <liburing.h>
+#endif
 #include "hid.h"
+#include "mcp2210_priv.h"
+
+#ifdef HID_IO_URING
+// Devices that can be open at once
+#define URING_FILES   256
+// Two entries per command
+#define URING_ENTRIES 512
+#define URING_REPORT  64
+
+// Report buffers of a slot, all slots are registered as one region
+struct uring_buffers {
+	uint8_t out[URING_REPORT];
+	uint8_t in[URING_REPORT];
+};
+#endif
+
+// HID context
+struct hid_context {
+	struct udev *udev;
+	// Handles waiting for the response of an asynchronous exchange
+#ifndef HID_IO_URING
+	struct hid_handle *pending;
+	// Owned by the thread handling events, grown as needed
+	struct pollfd *fds;
+	size_t fds_len;
+#endif
+	size_t pending_count;
+
+#ifdef HID_IO_URING
+	struct io_uring ring;
+	struct uring_buffers *buffers;
+	struct hid_handle *slots[URING_FILES];
+	// Protects the ring and the handle fields of the ring. One thread at a
+	// time reaps completions for everyone, the others wait on ring_cond.
+	pthread_mutex_t ring_lock;
+	pthread_cond_t ring_cond;
+	bool reaping;
+	// Threads inside the I/O functions or waiting for the lock, atomic. A
+	// lone thread may submit and wait at once, holding the lock.
+	unsigned ring_users;
+	// Asynchronous commands that completed, their callbacks are still due
+	struct hid_handle *completed;
+#endif
+
+	// Protocol layer event loop
+	struct mcp2210_loop loop;
+};
 
 // HID handle
 struct hid_handle {
-	char *devpath;
+	hid_context_t *ctx;
+	char devpath[HID_INFO_STRLEN];
 	int fd;
+
+	// Asynchronous exchange in flight
+	void *in;
+	size_t in_len;
+	hid_callback_t callback;
+	void *arg;
+	struct hid_handle *pending_next;
+
+	// Low latency mode, 0 -> off
+	uint32_t spin_us;
+	struct hid_power power;
+
+#ifdef HID_IO_URING
+	// Index into the registered files and buffers
+	int slot;
+	// Length of a report written by hid_write, sent with the next read
+	size_t staged;
+	// Completions still expected for the command in the ring
+	int cqes_left;
+	// First error of the command and result of its read
+	int error;
+	ssize_t result;
+	bool async;
+#endif
+
+	// Protocol layer state
+	struct mcp2210_state state;
 };
 
-// udev handle
-static struct udev* udev = NULL;
+#ifdef HID_IO_URING
+static int uring_init(hid_context_t *ctx);
+static void uring_fini(hid_context_t *ctx);
+static int uring_register(struct hid_handle *handle);
+static void uring_unregister(struct hid_handle *handle);
+#endif
 
-int hid_init()
+hid_context_t *hid_context_create(void)
 {
-	if (!udev) {
-		if (!(udev = udev_new()))
-			return -1;
-	}
-	return 0;
+	hid_context_t *ctx = hid_arena_alloc(sizeof(hid_context_t));
+	if (!ctx)
+		return NULL;
+	if (!(ctx->udev = udev_new()))
+		goto err1;
+#ifdef HID_IO_URING
+	if (-1 == uring_init(ctx))
+		goto err2;
+#endif
+	if (-1 == mcp2210_loop_init(&ctx->loop))
+		goto err3;
+	return ctx;
+
+err3:
+#ifdef HID_IO_URING
+	uring_fini(ctx);
+err2:
+#endif
+	udev_unref(ctx->udev);
+err1:
+	hid_arena_free(ctx, sizeof(hid_context_t));
+	return NULL;
 }
 
-ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t dest_len)
+void hid_context_free(hid_context_t *ctx)
 {
-	if (!udev) {
-		errno = EINVAL;
-		return -1;
-	}
+	mcp2210_loop_fini(&ctx->loop);
+#ifdef HID_IO_URING
+	uring_fini(ctx);
+#else
+	free(ctx->fds);
+#endif
+	udev_unref(ctx->udev);
+	hid_arena_free(ctx, sizeof(hid_context_t));
+}
 
-	if (!dest_len) {
-		errno = ENOMEM;
-		return -1;
-	}
+// Copy a sysfs attribute, empty if it does not exist
+static void copy_sysattr(struct udev_device *device, const char *attr,
+	char *dest, size_t dest_len)
+{
+	const char *value = udev_device_get_sysattr_value(device, attr);
+	snprintf(dest, dest_len, "%s", value ? value : "");
+}
 
-	struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+ssize_t hid_ctx_enumerate(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_device_info_t *dest, size_t dest_len)
+{
+	MCP2210_TRACE2(enumerate_entry, vid, pid);
+
+	struct udev_enumerate *enumerate = udev_enumerate_new(ctx->udev);
 	if (!enumerate)
 		goto err1;
 
@@ -47,13 +162,11 @@ ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t
 	udev_enumerate_scan_devices(enumerate);
 
 	struct udev_list_entry *cur, *all = udev_enumerate_get_list_entry(enumerate);
-	if (!all)
-		goto err2;
 
 	size_t i = 0;
 	udev_list_entry_foreach(cur, all) {
 		struct udev_device *device =
-			udev_device_new_from_syspath(udev, udev_list_entry_get_name(cur));
+			udev_device_new_from_syspath(ctx->udev, udev_list_entry_get_name(cur));
 		if (!device)
 			goto err2;
 
@@ -64,68 +177,905 @@ ssize_t hid_find_devices(uint16_t vid, uint16_t pid, hid_handle_t **dest, size_t
 		if (!parent) // Ignore non-usb HID devices
 			goto loop_cleanup;
 
-		uint16_t cur_vid = (uint16_t) strtol(udev_device_get_sysattr_value(parent, "idVendor"), NULL, 16);
-		uint16_t cur_pid = (uint16_t) strtol(udev_device_get_sysattr_value(parent, "idProduct"), NULL, 16);
-		if (cur_vid == vid && cur_pid == pid) {
-			struct hid_handle *handle = malloc(sizeof(struct hid_handle));
-			handle->devpath = strdup(udev_device_get_devnode(device));
-			handle->fd = -1;
-			dest[i++] = handle;
-		}
+		const char *vid_str = udev_device_get_sysattr_value(parent, "idVendor");
+		const char *pid_str = udev_device_get_sysattr_value(parent, "idProduct");
+		if (!vid_str || !pid_str ||
+				(uint16_t) strtol(vid_str, NULL, 16) != vid ||
+				(uint16_t) strtol(pid_str, NULL, 16) != pid)
+			goto loop_cleanup;
 
-loop_cleanup:
-		udev_device_unref(device);
 		if (i >= dest_len) {
+			udev_device_unref(device);
 			errno = ENOMEM;
 			goto err2;
 		}
+
+		hid_device_info_t *info = &dest[i++];
+		const char *busnum = udev_device_get_sysattr_value(parent, "busnum");
+		info->vid = vid;
+		info->pid = pid;
+		info->bus = busnum ? strtol(busnum, NULL, 10) : 0;
+		snprintf(info->port_path, sizeof(info->port_path), "%s",
+			udev_device_get_sysname(parent));
+		snprintf(info->path, sizeof(info->path), "%s",
+			udev_device_get_devnode(device));
+		copy_sysattr(parent, "serial", info->serial, sizeof(info->serial));
+		copy_sysattr(parent, "manufacturer",
+			info->manufacturer, sizeof(info->manufacturer));
+		copy_sysattr(parent, "product", info->product, sizeof(info->product));
+
+loop_cleanup:
+		udev_device_unref(device);
 	}
 
 	udev_enumerate_unref(enumerate);
+	MCP2210_TRACE1(enumerate_return, (ssize_t) i);
 	return (ssize_t) i;
 err2:
 	udev_enumerate_unref(enumerate);
 err1:
+	MCP2210_TRACE1(enumerate_return, (ssize_t) -1);
 	return -1;
 }
 
+hid_handle_t *hid_ctx_open_path(hid_context_t *ctx, const char *path)
+{
+	if (strlen(path) >= HID_INFO_STRLEN) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	struct hid_handle *handle = hid_alloc_handle(sizeof(struct hid_handle));
+	if (!handle)
+		return NULL;
+
+	handle->ctx = ctx;
+	strcpy(handle->devpath, path);
+	handle->fd = open(handle->devpath, O_RDWR | O_CLOEXEC);
+	if (handle->fd == -1) {
+		if (errno == ENOENT)
+			errno = ENODEV;
+		goto err1;
+	}
+#ifdef HID_IO_URING
+	if (-1 == uring_register(handle))
+		goto err2;
+#endif
+
+	mcp2210_state_init(&handle->state);
+	return handle;
+
+#ifdef HID_IO_URING
+err2:
+	close(handle->fd);
+#endif
+err1:
+	hid_free_handle(handle);
+	return NULL;
+}
+
+// Find the power/control attribute of the USB device behind a hidraw node
+static int find_power_control(struct hid_handle *handle)
+{
+	const char *name = strrchr(handle->devpath, '/');
+	name = name ? name + 1 : handle->devpath;
+	struct udev_device *hidraw =
+		udev_device_new_from_subsystem_sysname(handle->ctx->udev, "hidraw", name);
+	if (!hidraw) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	int result = 0;
+	// Owned by the hidraw device
+	struct udev_device *usb_device =
+		udev_device_get_parent_with_subsystem_devtype(hidraw, "usb", "usb_device");
+	if (usb_device) {
+		snprintf(handle->power.control, sizeof(handle->power.control),
+			"%s/power/control", udev_device_get_syspath(usb_device));
+	} else {
+		errno = ENODEV;
+		result = -1;
+	}
+	udev_device_unref(hidraw);
+	return result;
+}
+
+int hid_set_low_latency(struct hid_handle *handle, uint32_t spin_us)
+{
+	if (spin_us && !handle->spin_us) {
+		if (-1 == find_power_control(handle))
+			return -1;
+		if (-1 == hid_power_keep_on(&handle->power))
+			return -1;
+	} else if (!spin_us && handle->spin_us) {
+		hid_power_restore(&handle->power);
+	}
+	handle->spin_us = spin_us;
+	return 0;
+}
+
+hid_handle_t *hid_ctx_open(hid_context_t *ctx, const hid_device_info_t *info)
+{
+	return hid_ctx_open_path(ctx, info->path);
+}
+
+// Open the hidraw node below a USB device
+static hid_handle_t *open_child(hid_context_t *ctx, struct udev_device *usb_device)
+{
+	struct udev_enumerate *enumerate = udev_enumerate_new(ctx->udev);
+	if (!enumerate)
+		return NULL;
+
+	// Only scans the subtree of the USB device
+	udev_enumerate_add_match_parent(enumerate, usb_device);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+
+	hid_handle_t *handle = NULL;
+	errno = ENODEV;
+
+	struct udev_list_entry *first = udev_enumerate_get_list_entry(enumerate);
+	if (first) {
+		struct udev_device *device =
+			udev_device_new_from_syspath(ctx->udev, udev_list_entry_get_name(first));
+		if (device) {
+			const char *devnode = udev_device_get_devnode(device);
+			if (devnode)
+				handle = hid_ctx_open_path(ctx, devnode);
+			udev_device_unref(device);
+		}
+	}
+
+	udev_enumerate_unref(enumerate);
+	return handle;
+}
+
+// Whether the USB device is an MCP2210, other devices may sit at the port
+static bool is_mcp2210(struct udev_device *usb_device)
+{
+	const char *vid_str = udev_device_get_sysattr_value(usb_device, "idVendor");
+	const char *pid_str = udev_device_get_sysattr_value(usb_device, "idProduct");
+	return vid_str && pid_str &&
+		(uint16_t) strtol(vid_str, NULL, 16) == MCP2210_VID &&
+		(uint16_t) strtol(pid_str, NULL, 16) == MCP2210_PID;
+}
+
+hid_handle_t *hid_ctx_open_port(hid_context_t *ctx, const char *port_path)
+{
+	// USB devices are named after their port path in sysfs
+	struct udev_device *usb_device =
+		udev_device_new_from_subsystem_sysname(ctx->udev, "usb", port_path);
+	if (!usb_device) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	hid_handle_t *handle = NULL;
+	if (is_mcp2210(usb_device))
+		handle = open_child(ctx, usb_device);
+	else
+		errno = ENODEV;
+	udev_device_unref(usb_device);
+	return handle;
+}
+
+hid_handle_t *hid_ctx_open_serial(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *serial)
+{
+	struct udev_enumerate *enumerate = udev_enumerate_new(ctx->udev);
+	if (!enumerate)
+		return NULL;
+
+	// Let udev filter the USB devices by their attributes
+	char vid_str[5], pid_str[5];
+	snprintf(vid_str, sizeof(vid_str), "%04x", vid);
+	snprintf(pid_str, sizeof(pid_str), "%04x", pid);
+	udev_enumerate_add_match_subsystem(enumerate, "usb");
+	udev_enumerate_add_match_sysattr(enumerate, "idVendor", vid_str);
+	udev_enumerate_add_match_sysattr(enumerate, "idProduct", pid_str);
+	udev_enumerate_add_match_sysattr(enumerate, "serial", serial);
+	udev_enumerate_scan_devices(enumerate);
+
+	hid_handle_t *handle = NULL;
+	errno = ENODEV;
+
+	struct udev_list_entry *cur, *all = udev_enumerate_get_list_entry(enumerate);
+	udev_list_entry_foreach(cur, all) {
+		struct udev_device *usb_device =
+			udev_device_new_from_syspath(ctx->udev, udev_list_entry_get_name(cur));
+		if (!usb_device)
+			continue;
+		handle = open_child(ctx, usb_device);
+		udev_device_unref(usb_device);
+		if (handle)
+			break;
+	}
+
+	udev_enumerate_unref(enumerate);
+	return handle;
+}
+
+ssize_t hid_ctx_find_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_handle_t **dest, size_t dest_len)
+{
+	hid_device_info_t *info = malloc(sizeof(hid_device_info_t) * (dest_len + 1));
+	if (!info)
+		return -1;
+
+	ssize_t device_count = hid_ctx_enumerate(ctx, vid, pid, info, dest_len);
+	for (ssize_t i = 0; i < device_count; ++i) {
+		dest[i] = hid_ctx_open(ctx, &info[i]);
+		if (!dest[i]) {
+			while (i--)
+				hid_cleanup_device(dest[i]);
+			device_count = -1;
+			break;
+		}
+	}
+
+	free(info);
+	return device_count;
+}
+
 const char *hid_device_desc(hid_handle_t *handle)
 {
 	return handle->devpath;
 }
 
-ssize_t hid_write(struct hid_handle *handle, void *data, size_t data_len)
+// The MCP2210 answers one command at a time, the responses wait on the host:
+// usbhid keeps reading the IN endpoint and hidraw queues the reports of an
+// open file in a ring of HIDRAW_BUFFER_SIZE (64) slots. The ring holds one
+// less than that and drops new reports when it is full.
+#define HIDRAW_QUEUED_REPORTS 63
+
+size_t hid_pipeline_depth(hid_handle_t *handle)
 {
-	if (handle->fd == -1) {
-		handle->fd = open(handle->devpath, O_RDWR);
-		if (handle->fd == -1)
+	(void) handle;
+	return HIDRAW_QUEUED_REPORTS;
+}
+
+#ifdef HID_IO_URING
+
+////
+// io_uring: every command is a write and a read linked in the ring, with
+// the hidraw fds and report buffers registered once. Asynchronous commands
+// are only queued and go to the kernel in one batch with the next wait.
+// Every context has a ring of its own.
+////
+
+static int uring_init(hid_context_t *ctx)
+{
+	int ret = io_uring_queue_init(URING_ENTRIES, &ctx->ring, 0);
+	if (ret < 0)
+		goto err1;
+
+	ctx->buffers = hid_arena_alloc(URING_FILES * sizeof(struct uring_buffers));
+	if (!ctx->buffers) {
+		ret = -ENOMEM;
+		goto err2;
+	}
+
+	struct iovec region = { ctx->buffers, URING_FILES * sizeof(struct uring_buffers) };
+	ret = io_uring_register_buffers(&ctx->ring, &region, 1);
+	if (ret < 0)
+		goto err3;
+	ret = io_uring_register_files_sparse(&ctx->ring, URING_FILES);
+	if (ret < 0)
+		goto err3;
+
+	pthread_mutex_init(&ctx->ring_lock, NULL);
+	pthread_cond_init(&ctx->ring_cond, NULL);
+	return 0;
+
+err3:
+	hid_arena_free(ctx->buffers, URING_FILES * sizeof(struct uring_buffers));
+err2:
+	io_uring_queue_exit(&ctx->ring);
+err1:
+	errno = -ret;
+	return -1;
+}
+
+static void uring_fini(hid_context_t *ctx)
+{
+	io_uring_queue_exit(&ctx->ring);
+	hid_arena_free(ctx->buffers, URING_FILES * sizeof(struct uring_buffers));
+	pthread_mutex_destroy(&ctx->ring_lock);
+	pthread_cond_destroy(&ctx->ring_cond);
+}
+
+// Take the ring lock, counted before waiting for it, so a thread about to
+// sleep in the kernel with the lock held knows it isn't alone
+static void ring_enter(hid_context_t *ctx)
+{
+	__atomic_add_fetch(&ctx->ring_users, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&ctx->ring_lock);
+}
+
+static void ring_exit(hid_context_t *ctx)
+{
+	pthread_mutex_unlock(&ctx->ring_lock);
+	__atomic_sub_fetch(&ctx->ring_users, 1, __ATOMIC_ACQ_REL);
+}
+
+// No other thread uses the ring or waits for it
+static bool ring_alone(hid_context_t *ctx)
+{
+	return __atomic_load_n(&ctx->ring_users, __ATOMIC_ACQUIRE) == 1;
+}
+
+static int uring_register(struct hid_handle *handle)
+{
+	hid_context_t *ctx = handle->ctx;
+	ring_enter(ctx);
+
+	int slot = 0;
+	while (slot < URING_FILES && ctx->slots[slot])
+		slot++;
+	if (slot == URING_FILES) {
+		ring_exit(ctx);
+		errno = EMFILE;
+		return -1;
+	}
+
+	int ret = io_uring_register_files_update(&ctx->ring, slot, &handle->fd, 1);
+	if (ret < 0) {
+		ring_exit(ctx);
+		errno = -ret;
+		return -1;
+	}
+
+	ctx->slots[slot] = handle;
+	handle->slot = slot;
+	handle->staged = 0;
+	handle->cqes_left = 0;
+	ring_exit(ctx);
+	return 0;
+}
+
+// Entries for one command, submitting what is queued if the ring is full
+static int reserve_sqes(hid_context_t *ctx, unsigned count)
+{
+	if (io_uring_sq_space_left(&ctx->ring) < count) {
+		int ret = io_uring_submit(&ctx->ring);
+		if (ret < 0) {
+			errno = -ret;
 			return -1;
+		}
 	}
-	return write(handle->fd, data, data_len);
+	return 0;
+}
+
+// Queue a write of the staged report, an entry must be reserved
+static void prep_staged(struct hid_handle *handle, unsigned flags)
+{
+	hid_context_t *ctx = handle->ctx;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+	io_uring_prep_write_fixed(sqe, handle->slot, ctx->buffers[handle->slot].out,
+		handle->staged, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | flags;
+	io_uring_sqe_set_data64(sqe, (uintptr_t) handle);
+	handle->cqes_left++;
+	handle->staged = 0;
+}
+
+// Queue the staged write, if any, linked to a read of the response
+static int prep_command(struct hid_handle *handle, size_t in_len)
+{
+	hid_context_t *ctx = handle->ctx;
+	struct uring_buffers *buf = &ctx->buffers[handle->slot];
+	struct io_uring_sqe *sqe;
+
+	if (-1 == reserve_sqes(ctx, 2))
+		return -1;
+
+	handle->error = 0;
+	handle->result = 0;
+	handle->cqes_left = 0;
+
+	if (handle->staged)
+		prep_staged(handle, IOSQE_IO_LINK);
+
+	sqe = io_uring_get_sqe(&ctx->ring);
+	io_uring_prep_read_fixed(sqe, handle->slot, buf->in, in_len, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	// The low bit tells the read from the write
+	io_uring_sqe_set_data64(sqe, (uintptr_t) handle | 1);
+	handle->cqes_left++;
+	return 0;
+}
+
+// Account all available completions, called with the lock held
+static void reap(hid_context_t *ctx)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, count = 0;
+
+	io_uring_for_each_cqe(&ctx->ring, head, cqe) {
+		uint64_t data = io_uring_cqe_get_data64(cqe);
+		struct hid_handle *handle = (struct hid_handle *) (uintptr_t) (data & ~1ULL);
+		count++;
+		// Cancel requests carry no handle
+		if (!handle)
+			continue;
+
+		// A failed write cancels its read, keep the cause
+		if (cqe->res < 0 && !handle->error)
+			handle->error = -cqe->res;
+		if (data & 1)
+			handle->result = cqe->res;
+
+		if (--handle->cqes_left)
+			continue;
+		if (handle->async) {
+			handle->pending_next = ctx->completed;
+			ctx->completed = handle;
+			ctx->pending_count--;
+		}
+	}
+	io_uring_cq_advance(&ctx->ring, count);
+}
+
+// Become the thread that reaps, or wait for the current one to make
+// progress. With the lock held, returns with it held. Only a thread that
+// is alone keeps the lock while it sleeps in the kernel, a thread arriving
+// meanwhile waits for one round trip at most and is counted from then on.
+// Returns: 0 -> progress was made or timed out; -1 -> error, errno is set
+static int wait_ring(hid_context_t *ctx, struct __kernel_timespec *timeout, bool alone)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	if (ctx->reaping) {
+		// The reaper is blocked in the kernel, hand it our entries
+		ret = io_uring_submit(&ctx->ring);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		if (timeout) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += timeout->tv_sec;
+			until.tv_nsec += timeout->tv_nsec;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&ctx->ring_cond, &ctx->ring_lock, &until);
+		} else {
+			pthread_cond_wait(&ctx->ring_cond, &ctx->ring_lock);
+		}
+		return 0;
+	}
+
+	ctx->reaping = true;
+	if (alone) {
+		// Nobody else needs the ring meanwhile, one syscall does both
+		ret = io_uring_submit_and_wait(&ctx->ring, 1);
+	} else {
+		ret = io_uring_submit(&ctx->ring);
+		if (ret >= 0) {
+			pthread_mutex_unlock(&ctx->ring_lock);
+			ret = timeout ? io_uring_wait_cqe_timeout(&ctx->ring, &cqe, timeout)
+				: io_uring_wait_cqe(&ctx->ring, &cqe);
+			pthread_mutex_lock(&ctx->ring_lock);
+		}
+	}
+	ctx->reaping = false;
+	reap(ctx);
+	pthread_cond_broadcast(&ctx->ring_cond);
+
+	if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+// Submit the command, then poll the completion queue for up to spin_us
+// instead of sleeping in io_uring_submit_and_wait
+static void spin_ring(struct hid_handle *handle)
+{
+	hid_context_t *ctx = handle->ctx;
+	if (io_uring_submit(&ctx->ring) < 0)
+		return;
+
+	uint64_t deadline = mcp2210_now_us() + handle->spin_us;
+	while (handle->cqes_left && mcp2210_now_us() < deadline) {
+		struct io_uring_cqe *cqe;
+		if (0 == io_uring_peek_cqe(&ctx->ring, &cqe))
+			reap(ctx);
+	}
+}
+
+// Send the staged report on its own and wait for it, so its buffer can be
+// reused. Called with the lock held.
+static int flush_staged(struct hid_handle *handle)
+{
+	hid_context_t *ctx = handle->ctx;
+	if (-1 == reserve_sqes(ctx, 1))
+		return -1;
+
+	handle->async = false;
+	handle->error = 0;
+	handle->result = 0;
+	handle->cqes_left = 0;
+	prep_staged(handle, 0);
+	while (handle->cqes_left) {
+		if (-1 == wait_ring(ctx, NULL, ring_alone(ctx)))
+			return -1;
+	}
+
+	if (handle->error) {
+		errno = handle->error;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t hid_write(struct hid_handle *handle, void *data, size_t data_len)
+{
+	MCP2210_TRACE2(hid_write_entry, handle, data_len);
+	hid_context_t *ctx = handle->ctx;
+	ssize_t result = data_len;
+
+	if (data_len > URING_REPORT) {
+		errno = EINVAL;
+		result = -1;
+		goto out;
+	}
+
+	ring_enter(ctx);
+	// A write without a read in between goes out on its own
+	if (handle->staged && -1 == flush_staged(handle)) {
+		result = -1;
+	} else {
+		// Sent together with the read of the response
+		memcpy(ctx->buffers[handle->slot].out, data, data_len);
+		handle->staged = data_len;
+	}
+	ring_exit(ctx);
+
+out:
+	MCP2210_TRACE2(hid_write_return, handle, result);
+	return result;
 }
 
 ssize_t hid_read(struct hid_handle *handle, void *buffer, size_t buffer_len)
 {
-	if (handle->fd == -1) {
-		handle->fd = open(handle->devpath, O_RDWR);
-		if (handle->fd == -1)
+	MCP2210_TRACE2(hid_read_entry, handle, buffer_len);
+	hid_context_t *ctx = handle->ctx;
+	ssize_t result = -1;
+
+	if (buffer_len > URING_REPORT)
+		buffer_len = URING_REPORT;
+
+	ring_enter(ctx);
+	handle->async = false;
+	if (-1 == prep_command(handle, buffer_len))
+		goto out;
+
+	// Nobody else is waiting on the ring, so polling it can't starve them
+	if (handle->spin_us && ring_alone(ctx) && !ctx->reaping)
+		spin_ring(handle);
+	while (handle->cqes_left) {
+		if (-1 == wait_ring(ctx, NULL, ring_alone(ctx)))
+			goto out;
+	}
+
+	if (handle->error) {
+		errno = handle->error;
+		goto out;
+	}
+	result = handle->result;
+	memcpy(buffer, ctx->buffers[handle->slot].in, result);
+
+out:
+	ring_exit(ctx);
+	MCP2210_TRACE2(hid_read_return, handle, result);
+	return result;
+}
+
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg)
+{
+	if (out_len > URING_REPORT || in_len > URING_REPORT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hid_context_t *ctx = handle->ctx;
+	ring_enter(ctx);
+	memcpy(ctx->buffers[handle->slot].out, out, out_len);
+	handle->staged = out_len;
+	if (-1 == prep_command(handle, in_len)) {
+		ring_exit(ctx);
+		return -1;
+	}
+	handle->async = true;
+	handle->in = in;
+	handle->in_len = in_len;
+	handle->callback = callback;
+	handle->arg = arg;
+	ctx->pending_count++;
+	ring_exit(ctx);
+	return 0;
+}
+
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	ring_enter(ctx);
+
+	int result = 0;
+	reap(ctx);
+	if (!ctx->completed && ctx->pending_count && timeout_ms) {
+		struct __kernel_timespec ts = { timeout_ms / 1000, timeout_ms % 1000 * 1000000 };
+		result = wait_ring(ctx, timeout_ms < 0 ? NULL : &ts, false);
+	} else {
+		int ret = io_uring_submit(&ctx->ring);
+		if (ret < 0) {
+			errno = -ret;
+			result = -1;
+		}
+	}
+
+	struct hid_handle *done = ctx->completed;
+	ctx->completed = NULL;
+	ring_exit(ctx);
+
+	if (result == -1)
+		return -1;
+
+	// Restore the completion order
+	struct hid_handle *ordered = NULL;
+	while (done) {
+		struct hid_handle *next = done->pending_next;
+		done->pending_next = ordered;
+		ordered = done;
+		done = next;
+	}
+
+	int count = 0;
+	while (ordered) {
+		struct hid_handle *handle = ordered;
+		ordered = handle->pending_next;
+		int error = handle->error;
+		if (!error)
+			memcpy(handle->in, ctx->buffers[handle->slot].in, handle->in_len);
+		handle->callback(handle, error, handle->arg);
+		count++;
+	}
+	return count;
+}
+
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
+{
+	if (!fds_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ring_enter(ctx);
+	// The ring fd becomes readable once completions are posted
+	int ret = io_uring_submit(&ctx->ring);
+	if (ctx->completed || io_uring_cq_ready(&ctx->ring))
+		*timeout_ms = 0;
+	ring_exit(ctx);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	fds[0].fd = ctx->ring.ring_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	return 1;
+}
+
+static void uring_unregister(struct hid_handle *handle)
+{
+	hid_context_t *ctx = handle->ctx;
+	ring_enter(ctx);
+
+	// Cancel a command still in the ring and wait until the kernel let go
+	// of the buffers
+	if (handle->cqes_left && 0 == reserve_sqes(ctx, 1)) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+		io_uring_prep_cancel64(sqe, (uintptr_t) handle | 1, 0);
+		io_uring_sqe_set_data64(sqe, 0);
+	}
+	while (handle->cqes_left)
+		if (-1 == wait_ring(ctx, NULL, false))
+			break;
+
+	for (struct hid_handle **cur = &ctx->completed; *cur; cur = &(*cur)->pending_next) {
+		if (*cur == handle) {
+			*cur = handle->pending_next;
+			break;
+		}
+	}
+
+	int none = -1;
+	io_uring_register_files_update(&ctx->ring, handle->slot, &none, 1);
+	ctx->slots[handle->slot] = NULL;
+	ring_exit(ctx);
+}
+
+#else
+
+ssize_t hid_write(struct hid_handle *handle, void *data, size_t data_len)
+{
+	MCP2210_TRACE2(hid_write_entry, handle, data_len);
+	ssize_t result = write(handle->fd, data, data_len);
+	MCP2210_TRACE2(hid_write_return, handle, result);
+	return result;
+}
+
+// Poll the device for up to spin_us instead of sleeping in read
+static void spin_readable(struct hid_handle *handle)
+{
+	uint64_t deadline = mcp2210_now_us() + handle->spin_us;
+	do {
+		struct pollfd fd = { handle->fd, POLLIN, 0 };
+		int ready = poll(&fd, 1, 0);
+		// read reports errors
+		if (ready > 0 || (ready < 0 && errno != EINTR))
+			return;
+	} while (mcp2210_now_us() < deadline);
+}
+
+ssize_t hid_read(struct hid_handle *handle, void *buffer, size_t buffer_len)
+{
+	MCP2210_TRACE2(hid_read_entry, handle, buffer_len);
+	if (handle->spin_us)
+		spin_readable(handle);
+	ssize_t result = read(handle->fd, buffer, buffer_len);
+	MCP2210_TRACE2(hid_read_return, handle, result);
+	return result;
+}
+
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg)
+{
+	// hidraw writes block in the kernel until the report was sent, only
+	// waiting for the response happens in the background
+	if (-1 == write(handle->fd, out, out_len))
+		return -1;
+
+	handle->in = in;
+	handle->in_len = in_len;
+	handle->callback = callback;
+	handle->arg = arg;
+	hid_context_t *ctx = handle->ctx;
+	handle->pending_next = ctx->pending;
+	ctx->pending = handle;
+	ctx->pending_count++;
+	return 0;
+}
+
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	if (!ctx->pending_count)
+		return 0;
+
+	if (ctx->pending_count > ctx->fds_len) {
+		size_t len = ctx->fds_len ? ctx->fds_len * 2 : 16;
+		while (len < ctx->pending_count)
+			len *= 2;
+		struct pollfd *fds = realloc(ctx->fds, len * sizeof(*fds));
+		if (!fds)
 			return -1;
+		ctx->fds = fds;
+		ctx->fds_len = len;
+	}
+
+	struct pollfd *fds = ctx->fds;
+	size_t n = 0;
+	for (struct hid_handle *cur = ctx->pending; cur; cur = cur->pending_next) {
+		fds[n].fd = cur->fd;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+
+	if (-1 == poll(fds, n, timeout_ms))
+		return -1;
+
+	// Unlink the finished handles first, callbacks may submit again
+	struct hid_handle *done = NULL, **cur = &ctx->pending;
+	for (size_t i = 0; i < n; ++i) {
+		struct hid_handle *handle = *cur;
+		if (fds[i].revents) {
+			*cur = handle->pending_next;
+			handle->pending_next = done;
+			done = handle;
+			ctx->pending_count--;
+		} else {
+			cur = &handle->pending_next;
+		}
+	}
+
+	int count = 0;
+	while (done) {
+		struct hid_handle *handle = done;
+		done = handle->pending_next;
+		int error = 0;
+		if (-1 == read(handle->fd, handle->in, handle->in_len))
+			error = errno;
+		handle->callback(handle, error, handle->arg);
+		count++;
 	}
-	return read(handle->fd, buffer, buffer_len);
+	return count;
 }
 
-void hid_cleanup_device(struct hid_handle *handle)
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
 {
-	if (handle->fd != -1)
-		close(handle->fd);
-	free(handle->devpath);
-	free(handle);
+	(void) timeout_ms;
+	if (ctx->pending_count > fds_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t n = 0;
+	for (struct hid_handle *cur = ctx->pending; cur; cur = cur->pending_next) {
+		fds[n].fd = cur->fd;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		n++;
+	}
+	return n;
 }
 
-void hid_fini()
+#endif
+
+void hid_cleanup_device(struct hid_handle *handle)
 {
-	if (udev) {
-		udev_unref(udev);
-		udev = NULL;
+#ifdef HID_IO_URING
+	uring_unregister(handle);
+#else
+	// Drop an exchange that never completed
+	hid_context_t *ctx = handle->ctx;
+	for (struct hid_handle **cur = &ctx->pending; *cur; cur = &(*cur)->pending_next) {
+		if (*cur == handle) {
+			*cur = handle->pending_next;
+			ctx->pending_count--;
+			break;
+		}
 	}
+#endif
+
+	if (handle->spin_us)
+		hid_power_restore(&handle->power);
+	close(handle->fd);
+	mcp2210_state_fini(&handle->state);
+	hid_free_handle(handle);
+}
+
+struct mcp2210_state *hid_state(struct hid_handle *handle)
+{
+	return &handle->state;
+}
+
+hid_context_t *hid_context(struct hid_handle *handle)
+{
+	return handle->ctx;
+}
+
+struct mcp2210_loop *hid_loop(hid_context_t *ctx)
+{
+	return &ctx->loop;
+}
+
+size_t hid_arena_size(size_t handles)
+{
+	// Slack for aligning the start of the arena
+	size_t size = hid_arena_cost(sizeof(hid_context_t)) +
+		handles * hid_arena_cost(sizeof(struct hid_handle)) + hid_arena_cost(1);
+#ifdef HID_IO_URING
+	size += hid_arena_cost(URING_FILES * sizeof(struct uring_buffers));
+#endif
+	return size;
 }
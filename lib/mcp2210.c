@@ -5,28 +5,8 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include "mcp2210.h"
-
-// NVRAM
-#define MCP2210_CMD_SET_NVRAM      0x60
-#define MCP2210_CMD_GET_NVRAM      0x61
-
-// NVRAM sub commands
-#define MCP2210_SUB_SPI_SETTINGS      0x10
-#define MCP2210_SUB_CHIP_SETTINGS     0x20
-#define MCP2210_SUB_KEY_PARAMETERS    0x30
-#define MCP2210_SUB_PRODUCT_NAME      0x40
-#define MCP2210_SUB_MANUFACTURER_NAME 0x50
-
-// Volatile RAM
-#define MCP2210_CMD_GET_SPI_SETTINGS 0x41
-#define MCP2210_CMD_SET_SPI_SETTINGS 0x40
-
-#define MCP2210_CMD_GET_CHIP_SETTINGS 0x20
-#define MCP2210_CMD_SET_CHIP_SETTINGS 0x21
-
-// Transfer SPI data
-#define MCP2210_CMD_TRANSFER_SPI_DATA 0x42
+#include <time.h>
+#include "mcp2210_priv.h"
 
 // NOTE: different format in responses then in requests
 // This is NOT exposed to the library user so, this
@@ -46,6 +26,7 @@ typedef union mcp2210_data {
 	mcp2210_chip_settings_t chip_settings;
 	mcp2210_key_parameters_t key_parameters;
 	mcp2210_key_parameters_resp_t key_parameters_resp;
+	mcp2210_chip_status_t chip_status;
 	uint8_t raw[60];
 } __attribute__((packed)) mcp2210_data_t;
 
@@ -61,10 +42,15 @@ typedef struct mcp2210_resp {
 
 static inline int do_usb_cmd(hid_handle_t *handle, mcp2210_cmd_t *cmd, mcp2210_resp_t *resp)
 {
+	uint64_t seq = mcp2210_trace_seq(hid_state(handle));
+	MCP2210_TRACE4(cmd_submit, handle, seq, cmd->hdr[0], cmd->hdr[1]);
+	uint64_t start = mcp2210_now_us();
 	if (-1 == hid_write(handle, cmd, sizeof(*cmd)))
 		return -1;
 	if (-1 == hid_read(handle, resp, sizeof(*resp)))
 		return -1;
+	mcp2210_record_rtt(hid_state(handle), mcp2210_now_us() - start);
+	MCP2210_TRACE5(cmd_response, handle, seq, resp->hdr[0], resp->hdr[1], resp->hdr[2]);
 	return 0;
 }
 
@@ -75,6 +61,359 @@ static inline void prepare_cmd(mcp2210_cmd_t *cmd, uint8_t hdr_0, uint8_t hdr_1)
 	cmd->hdr[1] = hdr_1;
 }
 
+// Bounds for the wait between retries of a busy command in microseconds
+#define RETRY_MIN_WAIT_US 20
+#define RETRY_MAX_WAIT_US 5000
+// Initial guess for the time a busy chip needs
+#define BUSY_ESTIMATE_US 1000
+
+void mcp2210_state_init(struct mcp2210_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->stats.busy_estimate_us = BUSY_ESTIMATE_US;
+	state->retry_timeout_us = MCP2210_DEFAULT_RETRY_TIMEOUT_US;
+	mcp2210_queue_init(&state->queue);
+	pthread_cond_init(&state->capture_idle, NULL);
+}
+
+void mcp2210_state_fini(struct mcp2210_state *state)
+{
+	pthread_cond_destroy(&state->capture_idle);
+	mcp2210_queue_fini(&state->queue);
+}
+
+
+// The statistics are kept under the queue lock, as are the watchdog timeout
+// and the transfer tracking, any thread may be sending commands
+static void lock_stats(struct mcp2210_state *state)
+{
+	pthread_mutex_lock(&state->queue.lock);
+}
+
+static void unlock_stats(struct mcp2210_state *state)
+{
+	pthread_mutex_unlock(&state->queue.lock);
+}
+
+void mcp2210_set_retry_timeout(hid_handle_t *handle, uint32_t timeout_us)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	lock_stats(state);
+	state->retry_timeout_us = timeout_us;
+	unlock_stats(state);
+}
+
+void mcp2210_get_stats(hid_handle_t *handle, mcp2210_stats_t *stats)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	lock_stats(state);
+	*stats = state->stats;
+	unlock_stats(state);
+}
+
+void mcp2210_reset_stats(hid_handle_t *handle)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	lock_stats(state);
+	uint32_t busy_estimate_us = state->stats.busy_estimate_us;
+	uint32_t poll_estimate_us[MCP2210_POLL_SLOTS];
+	memcpy(poll_estimate_us, state->stats.poll_estimate_us, sizeof(poll_estimate_us));
+	memset(&state->stats, 0, sizeof(state->stats));
+	state->stats.busy_estimate_us = busy_estimate_us;
+	memcpy(state->stats.poll_estimate_us, poll_estimate_us, sizeof(poll_estimate_us));
+	unlock_stats(state);
+}
+
+void mcp2210_record_rtt(struct mcp2210_state *state, uint64_t rtt_us)
+{
+	size_t bucket = 0;
+	while (rtt_us && bucket < MCP2210_RTT_BUCKETS - 1) {
+		rtt_us >>= 1;
+		bucket++;
+	}
+	lock_stats(state);
+	state->stats.rtt[state->low_latency][bucket]++;
+	unlock_stats(state);
+}
+
+uint64_t mcp2210_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void mcp2210_sleep_us(uint32_t us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+	while (-1 == nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+// Translate a failure status of the chip to errno
+static int status_errno(uint8_t status)
+{
+	switch (status) {
+	case MCP2210_STATUS_BUS_NOT_AVAILABLE:
+	case MCP2210_STATUS_IN_PROGRESS:
+		return EBUSY;
+	case MCP2210_STATUS_UNKNOWN_COMMAND:
+		return ENOTSUP;
+	case MCP2210_STATUS_BLOCKED:
+	case MCP2210_STATUS_REJECTED:
+		return EACCES;
+	default:
+		return EPROTO;
+	}
+}
+
+int mcp2210_check_resp(struct mcp2210_state *state, const uint8_t *cmd, const uint8_t *resp)
+{
+	lock_stats(state);
+	state->stats.commands++;
+	if (resp[0] == cmd[0] && resp[1] == MCP2210_STATUS_BUS_NOT_AVAILABLE)
+		state->stats.bus_not_available++;
+	else if (resp[0] == cmd[0] && resp[1] == MCP2210_STATUS_IN_PROGRESS)
+		state->stats.in_progress++;
+	unlock_stats(state);
+
+	if (resp[0] != cmd[0]) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	switch (resp[1]) {
+	case MCP2210_STATUS_SUCCESS:
+		// NVRAM responses echo the sub command
+		if ((cmd[0] == MCP2210_CMD_GET_NVRAM || cmd[0] == MCP2210_CMD_SET_NVRAM) &&
+				resp[2] != cmd[1]) {
+			errno = EPROTO;
+			return -1;
+		}
+		return MCP2210_RESP_OK;
+	case MCP2210_STATUS_BUS_NOT_AVAILABLE:
+	case MCP2210_STATUS_IN_PROGRESS:
+		return MCP2210_RESP_BUSY;
+	default:
+		errno = status_errno(resp[1]);
+		return -1;
+	}
+}
+
+// The backoff starts at half of the learned busy time and doubles on every
+// attempt, until the retry deadline expires
+int64_t mcp2210_retry_next(struct mcp2210_state *state, mcp2210_retry_t *retry)
+{
+	uint64_t now = mcp2210_now_us();
+	lock_stats(state);
+	if (!retry->start) {
+		retry->start = now;
+		retry->deadline = now + state->retry_timeout_us;
+		retry->wait = state->stats.busy_estimate_us / 2;
+	}
+
+	if (now >= retry->deadline) {
+		state->stats.timeouts++;
+		unlock_stats(state);
+		errno = EBUSY;
+		return -1;
+	}
+
+	uint32_t wait = retry->wait;
+	if (wait < RETRY_MIN_WAIT_US)
+		wait = RETRY_MIN_WAIT_US;
+	if (wait > RETRY_MAX_WAIT_US)
+		wait = RETRY_MAX_WAIT_US;
+	if (wait > retry->deadline - now)
+		wait = retry->deadline - now;
+	retry->wait = wait * 2;
+
+	state->stats.backoff_us += wait;
+	state->stats.retries++;
+	unlock_stats(state);
+	return wait;
+}
+
+void mcp2210_retry_done(struct mcp2210_state *state, mcp2210_retry_t *retry)
+{
+	// Learn how long the chip stayed busy
+	if (retry->start) {
+		int64_t busy = mcp2210_now_us() - retry->start;
+		lock_stats(state);
+		int64_t estimate = state->stats.busy_estimate_us;
+		state->stats.busy_estimate_us = estimate + (busy - estimate) / 8;
+		unlock_stats(state);
+	}
+}
+
+void mcp2210_track_transfer(struct mcp2210_state *state, const uint8_t *resp)
+{
+	uint64_t now = resp[3] == MCP2210_SPI_STATUS_FINISHED ? 0 : mcp2210_now_us();
+	lock_stats(state);
+	state->transfer_active = now;
+	unlock_stats(state);
+}
+
+void mcp2210_clear_transfer(struct mcp2210_state *state)
+{
+	lock_stats(state);
+	state->transfer_active = 0;
+	unlock_stats(state);
+}
+
+// A transfer of this process is unfinished
+static bool transfer_pending(struct mcp2210_state *state)
+{
+	lock_stats(state);
+	bool pending = state->transfer_active != 0;
+	unlock_stats(state);
+	return pending;
+}
+
+// The unfinished transfer got no new data within the watchdog timeout
+static bool transfer_stuck(struct mcp2210_state *state)
+{
+	lock_stats(state);
+	bool stuck = state->watchdog_us && state->transfer_active &&
+		mcp2210_now_us() - state->transfer_active >= state->watchdog_us;
+	unlock_stats(state);
+	return stuck;
+}
+
+// A command busy since start has been retried past the watchdog timeout
+static bool watchdog_due(struct mcp2210_state *state, uint64_t start)
+{
+	lock_stats(state);
+	bool due = state->watchdog_us && start &&
+		mcp2210_now_us() - start >= state->watchdog_us;
+	unlock_stats(state);
+	return due;
+}
+
+// Cancel a stuck transfer on behalf of the watchdog
+static int watchdog_cancel(hid_handle_t *handle)
+{
+	mcp2210_cmd_t cmd;
+	prepare_cmd(&cmd, MCP2210_CMD_CANCEL_SPI_TRANSFER, 0);
+
+	mcp2210_resp_t resp;
+	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+		return -1;
+
+	struct mcp2210_state *state = hid_state(handle);
+	lock_stats(state);
+	state->stats.commands++;
+	state->stats.watchdog_cancels++;
+	state->transfer_active = 0;
+	unlock_stats(state);
+	mcp2210_queue_release_async_spi(state);
+	return 0;
+}
+
+int mcp2210_cmd_priority(uint8_t opcode)
+{
+	switch (opcode) {
+	case MCP2210_CMD_SET_GPIO_VALUE:
+	case MCP2210_CMD_GET_GPIO_VALUE:
+	case MCP2210_CMD_SET_GPIO_DIRECTION:
+	case MCP2210_CMD_GET_GPIO_DIRECTION:
+	case MCP2210_CMD_GET_CHIP_STATUS:
+	case MCP2210_CMD_CANCEL_SPI_TRANSFER:
+	case MCP2210_CMD_RELEASE_SPI_BUS:
+		return MCP2210_CLASS_CONTROL;
+	default:
+		return MCP2210_CLASS_NORMAL;
+	}
+}
+
+// Cancel outside of a command, in turn with other threads
+static int queued_watchdog_cancel(hid_handle_t *handle)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	mcp2210_queue_enter(state, MCP2210_CLASS_CONTROL, false, NULL);
+	int result = watchdog_cancel(handle);
+	mcp2210_queue_leave(state);
+	return result;
+}
+
+// Outcome of queued_cmd after the watchdog cancelled a stuck transfer
+#define RESP_RESEND 2
+
+// Cancel a transfer that kept the chip busy past the watchdog timeout. The
+// command may be resent if the transfer was left behind by someone else, a
+// transfer of this process lost its data and fails with ETIMEDOUT.
+static int watchdog_expired(hid_handle_t *handle, mcp2210_retry_t *retry)
+{
+	bool own = transfer_pending(hid_state(handle));
+	if (-1 == watchdog_cancel(handle))
+		return -1;
+	if (own) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	memset(retry, 0, sizeof(*retry));
+	return RESP_RESEND;
+}
+
+// Send one report in its turn and check the response
+static int queued_cmd(hid_handle_t *handle, int priority, const void *spi_owner,
+	mcp2210_cmd_t *cmd, mcp2210_resp_t *resp, mcp2210_retry_t *retry)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	int result;
+
+	mcp2210_queue_enter(state, priority,
+		cmd->hdr[0] == MCP2210_CMD_TRANSFER_SPI_DATA, spi_owner);
+
+	if (-1 == do_usb_cmd(handle, cmd, resp)) {
+		result = -1;
+		goto out;
+	}
+	result = mcp2210_check_resp(state, (uint8_t *) cmd, (uint8_t *) resp);
+
+	// A transfer that keeps the chip busy for too long is stuck
+	if (result == MCP2210_RESP_BUSY && resp->hdr[1] == MCP2210_STATUS_IN_PROGRESS &&
+			watchdog_due(state, retry->start))
+		result = watchdog_expired(handle, retry);
+
+out:
+	mcp2210_queue_leave(state);
+	return result;
+}
+
+// Send a command and check its response, resending it while the chip is busy.
+// Other threads' reports may run while this one waits for a retry.
+static int do_cmd_class(hid_handle_t *handle, int priority, const void *spi_owner,
+	mcp2210_cmd_t *cmd, mcp2210_resp_t *resp)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	mcp2210_retry_t retry = { 0, 0, 0 };
+
+	for (;;) {
+		switch (queued_cmd(handle, priority, spi_owner, cmd, resp, &retry)) {
+		case MCP2210_RESP_OK:
+			mcp2210_retry_done(state, &retry);
+			return 0;
+		case MCP2210_RESP_BUSY:
+			break;
+		case RESP_RESEND:
+			continue;
+		default:
+			return -1;
+		}
+
+		int64_t wait = mcp2210_retry_next(state, &retry);
+		if (wait < 0)
+			return -1;
+		mcp2210_sleep_us(wait);
+	}
+}
+
+static int do_cmd(hid_handle_t *handle, mcp2210_cmd_t *cmd, mcp2210_resp_t *resp)
+{
+	return do_cmd_class(handle, mcp2210_cmd_priority(cmd->hdr[0]), NULL, cmd, resp);
+}
+
 // Read SPI settings
 int read_spi_settings(hid_handle_t *handle, mcp2210_spi_settings_t *spi_settings, bool nv)
 {
@@ -85,15 +424,9 @@ int read_spi_settings(hid_handle_t *handle, mcp2210_spi_settings_t *spi_settings
 		prepare_cmd(&cmd, MCP2210_CMD_GET_SPI_SETTINGS, 0);
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-            (nv && resp.hdr[2] != MCP2210_SUB_SPI_SETTINGS)) {
-		errno = EACCES;
-		return -1;
-	}
-
 	*spi_settings = resp.data.spi_settings;
 	return 0;
 }
@@ -108,14 +441,8 @@ int write_spi_settings(hid_handle_t *handle, mcp2210_spi_settings_t *spi_setting
 	cmd.data.spi_settings = *spi_settings;
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
-		return -1;
-
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			(nv && resp.hdr[2] != MCP2210_SUB_SPI_SETTINGS)) {
-		errno = EACCES;
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
-	}
 
 	return 0;
 }
@@ -129,15 +456,9 @@ int read_chip_settings(hid_handle_t *handle, mcp2210_chip_settings_t *chip_setti
 		prepare_cmd(&cmd, MCP2210_CMD_GET_CHIP_SETTINGS, 0);
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			(nv && resp.hdr[2] != MCP2210_SUB_CHIP_SETTINGS)) {
-		errno = EACCES;
-		return -1;
-	}
-
 	*chip_settings = resp.data.chip_settings;
 	return 0;
 }
@@ -152,18 +473,22 @@ int write_chip_settings(hid_handle_t *handle, mcp2210_chip_settings_t *chip_sett
 	cmd.data.chip_settings = *chip_settings;
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			(nv && resp.hdr[2] != MCP2210_SUB_CHIP_SETTINGS)) {
-		errno = EACCES;
-		return -1;
-	}
-
 	return 0;
 }
 
+// Key parameters come back in a different layout than they are written
+static void decode_key_parameters(const mcp2210_resp_t *resp,
+	mcp2210_key_parameters_t *key_parameters)
+{
+	key_parameters->vid = resp->data.key_parameters_resp.vid;
+	key_parameters->pid = resp->data.key_parameters_resp.pid;
+	key_parameters->power_options = resp->data.key_parameters_resp.power_options;
+	key_parameters->current_amount = resp->data.key_parameters_resp.current_amount;
+}
+
 // Read key parameters
 int read_key_parameters(hid_handle_t *handle, mcp2210_key_parameters_t *key_parameters)
 {
@@ -171,20 +496,10 @@ int read_key_parameters(hid_handle_t *handle, mcp2210_key_parameters_t *key_para
 	prepare_cmd(&cmd, MCP2210_CMD_GET_NVRAM, MCP2210_SUB_KEY_PARAMETERS);
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
-		return -1;
-
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
-	}
-
-	key_parameters->vid = resp.data.key_parameters_resp.vid;
-	key_parameters->pid = resp.data.key_parameters_resp.pid;
-	key_parameters->power_options = resp.data.key_parameters_resp.power_options;
-	key_parameters->current_amount = resp.data.key_parameters_resp.current_amount;
 
+	decode_key_parameters(&resp, key_parameters);
 	return 0;
 }
 // Write key parameters
@@ -195,14 +510,8 @@ int write_key_parameters(hid_handle_t *handle, mcp2210_key_parameters_t *key_par
 	cmd.data.key_parameters = *key_parameters;
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
-		return -1;
-
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
-	}
 
 	return 0;
 }
@@ -222,6 +531,19 @@ static void to_wide(char *s, uint16_t *d)
 	}
 }
 
+// Names are stored as a USB string descriptor
+static int decode_name(mcp2210_resp_t *resp, char *buffer, size_t buffer_len)
+{
+	size_t char_count = (resp->data.raw[0] - 2) / 2;
+	if (char_count > buffer_len - 1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	to_ascii((uint16_t *) (resp->data.raw + 2), char_count, buffer);
+	return 0;
+}
+
 // Read product name
 int read_product_name(hid_handle_t *handle, char *buffer, size_t buffer_len)
 {
@@ -229,23 +551,10 @@ int read_product_name(hid_handle_t *handle, char *buffer, size_t buffer_len)
 	prepare_cmd(&cmd, MCP2210_CMD_GET_NVRAM, MCP2210_SUB_PRODUCT_NAME);
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
-		return -1;
-	}
-
-	size_t char_count = (resp.data.raw[0] - 2) / 2;
-	if (char_count > buffer_len - 1) {
-		errno = ENOMEM;
-		return -1;
-	}
-
-	to_ascii((uint16_t *) (resp.data.raw + 2), char_count, buffer);
-	return 0;
+	return decode_name(&resp, buffer, buffer_len);
 }
 // Write product name
 int write_product_name(hid_handle_t *handle, char *str)
@@ -257,15 +566,9 @@ int write_product_name(hid_handle_t *handle, char *str)
 	to_wide(str, (uint16_t *) (cmd.data.raw + 2));
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
-		return -1;
-	}
-
 	return 0;
 }
 
@@ -276,22 +579,10 @@ int read_manufacturer_name(hid_handle_t *handle, char *buffer, size_t buffer_len
 	prepare_cmd(&cmd, MCP2210_CMD_GET_NVRAM, MCP2210_SUB_MANUFACTURER_NAME);
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 || resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
-		return -1;
-	}
-
-	size_t char_count = (resp.data.raw[0] - 2) / 2;
-	if (char_count > buffer_len - 1) {
-		errno = ENOMEM;
-		return -1;
-	}
-
-	to_ascii((uint16_t *) (resp.data.raw + 2), char_count, buffer);
-	return 0;
+	return decode_name(&resp, buffer, buffer_len);
 }
 // Write manufacturer name
 int write_manufacturer_name(hid_handle_t *handle, char *str)
@@ -303,14 +594,8 @@ int write_manufacturer_name(hid_handle_t *handle, char *str)
 	to_wide(str, (uint16_t *) (cmd.data.raw + 2));
 
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
-		return -1;
-
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0 ||
-			resp.hdr[2] != cmd.hdr[1]) {
-		errno = EACCES;
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
-	}
 
 	return 0;
 }
@@ -320,19 +605,23 @@ int mcp2210_spi_transfer(hid_handle_t *handle,
     void *send, size_t send_len,
     void *recv, size_t *recv_len)
 {
+	struct mcp2210_state *state = hid_state(handle);
+
+	// The previous transfer got no new data for too long, start over
+	if (transfer_stuck(state)) {
+		if (-1 == queued_watchdog_cancel(handle))
+			return -1;
+	}
+
 	mcp2210_cmd_t cmd;
 	prepare_cmd(&cmd, MCP2210_CMD_TRANSFER_SPI_DATA, send_len);
 	memcpy(cmd.data.raw, send, send_len);
 
-
 	mcp2210_resp_t resp;
-	if (-1 == do_usb_cmd(handle, &cmd, &resp))
+	if (-1 == do_cmd(handle, &cmd, &resp))
 		return -1;
 
-	if (resp.hdr[0] != cmd.hdr[0] || resp.hdr[1] != 0) {
-		errno = EBUSY;
-		return -1;
-	}
+	mcp2210_track_transfer(state, (uint8_t *) &resp);
 
 	// Check buffer size
 	if (resp.hdr[2] > *recv_len) {
@@ -344,7 +633,456 @@ int mcp2210_spi_transfer(hid_handle_t *handle,
 	*recv_len = resp.hdr[2];
 	if (*recv_len)
 		memcpy(recv, resp.data.raw, *recv_len);
+	mcp2210_capture_transfer(state, resp.hdr[3], send, send_len, recv, *recv_len);
 
 	// Return status code
 	return resp.hdr[3];
 }
+
+// Read the chip status
+int mcp2210_get_chip_status(hid_handle_t *handle, mcp2210_chip_status_t *chip_status)
+{
+	mcp2210_cmd_t cmd;
+	prepare_cmd(&cmd, MCP2210_CMD_GET_CHIP_STATUS, 0);
+
+	mcp2210_resp_t resp;
+	if (-1 == do_cmd(handle, &cmd, &resp))
+		return -1;
+
+	// The status starts right after the status code
+	memcpy(chip_status, resp.hdr + 2, sizeof(*chip_status));
+	return 0;
+}
+
+// Cancel the SPI transfer in progress
+int mcp2210_cancel_spi_transfer(hid_handle_t *handle, mcp2210_chip_status_t *chip_status)
+{
+	mcp2210_cmd_t cmd;
+	prepare_cmd(&cmd, MCP2210_CMD_CANCEL_SPI_TRANSFER, 0);
+
+	mcp2210_resp_t resp;
+	if (-1 == do_cmd(handle, &cmd, &resp))
+		return -1;
+
+	struct mcp2210_state *state = hid_state(handle);
+	mcp2210_clear_transfer(state);
+	// An asynchronous transfer is over as well
+	mcp2210_queue_release_async_spi(state);
+	if (chip_status)
+		memcpy(chip_status, resp.hdr + 2, sizeof(*chip_status));
+	return 0;
+}
+
+// Release the SPI bus
+int mcp2210_release_spi_bus(hid_handle_t *handle, bool ack_value)
+{
+	mcp2210_cmd_t cmd;
+	prepare_cmd(&cmd, MCP2210_CMD_RELEASE_SPI_BUS, ack_value);
+
+	mcp2210_resp_t resp;
+	return do_cmd(handle, &cmd, &resp);
+}
+
+// Recover from a stuck transfer and watch for new ones
+int mcp2210_set_watchdog(hid_handle_t *handle, uint32_t timeout_us)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	lock_stats(state);
+	state->watchdog_us = timeout_us;
+	unlock_stats(state);
+	if (!timeout_us)
+		return 0;
+
+	mcp2210_chip_status_t chip_status;
+	if (-1 == mcp2210_get_chip_status(handle, &chip_status))
+		return -1;
+
+	// A transaction of this process may be holding the bus
+	lock_stats(state);
+	bool idle = !state->queue.spi_owner && !state->transfer_active;
+	unlock_stats(state);
+
+	// Nobody in this process has a transfer going, so it was left behind
+	if (idle && chip_status.bus_owner == MCP2210_BUS_OWNER_USB) {
+		if (-1 == queued_watchdog_cancel(handle))
+			return -1;
+		if (-1 == mcp2210_get_chip_status(handle, &chip_status))
+			return -1;
+		if (chip_status.bus_owner == MCP2210_BUS_OWNER_USB)
+			return mcp2210_release_spi_bus(handle, true);
+	}
+	return 0;
+}
+
+// GPIO values and directions travel in the first two data bytes
+static int gpio_cmd(hid_handle_t *handle, uint8_t opcode, uint16_t *value)
+{
+	mcp2210_cmd_t cmd;
+	prepare_cmd(&cmd, opcode, 0);
+	cmd.data.raw[0] = *value & 0xff;
+	cmd.data.raw[1] = *value >> 8;
+
+	mcp2210_resp_t resp;
+	if (-1 == do_cmd(handle, &cmd, &resp))
+		return -1;
+
+	*value = resp.data.raw[0] | resp.data.raw[1] << 8;
+	return 0;
+}
+
+int mcp2210_get_gpio(hid_handle_t *handle, uint16_t *value)
+{
+	*value = 0;
+	return gpio_cmd(handle, MCP2210_CMD_GET_GPIO_VALUE, value);
+}
+
+int mcp2210_set_gpio(hid_handle_t *handle, uint16_t value)
+{
+	return gpio_cmd(handle, MCP2210_CMD_SET_GPIO_VALUE, &value);
+}
+
+int mcp2210_get_gpio_direction(hid_handle_t *handle, uint16_t *direction)
+{
+	*direction = 0;
+	return gpio_cmd(handle, MCP2210_CMD_GET_GPIO_DIRECTION, direction);
+}
+
+int mcp2210_set_gpio_direction(hid_handle_t *handle, uint16_t direction)
+{
+	return gpio_cmd(handle, MCP2210_CMD_SET_GPIO_DIRECTION, &direction);
+}
+
+// Run a whole SPI transaction, one report of the stream at a time
+ssize_t mcp2210_spi_stream(hid_handle_t *handle, int priority,
+	const struct mcp2210_spi_stream *stream)
+{
+	if (priority < 0 || priority >= MCP2210_CLASSES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct mcp2210_state *state = hid_state(handle);
+	// The address of a local identifies this transaction as the bus owner
+	const void *owner = &state;
+	size_t received = 0;
+	bool started = false;
+
+	for (;;) {
+		mcp2210_cmd_t cmd;
+		prepare_cmd(&cmd, MCP2210_CMD_TRANSFER_SPI_DATA, 0);
+		// Nothing left to send polls for the rest of the response
+		cmd.hdr[1] = stream->fill(stream->ctx, cmd.data.raw, sizeof(cmd.data.raw));
+
+		mcp2210_resp_t resp;
+		if (-1 == do_cmd_class(handle, priority, owner, &cmd, &resp))
+			goto err;
+		started = true;
+		mcp2210_track_transfer(state, (uint8_t *) &resp);
+
+		if (-1 == stream->drain(stream->ctx, resp.data.raw, resp.hdr[2]))
+			goto err;
+		received += resp.hdr[2];
+
+		if (resp.hdr[3] == MCP2210_SPI_STATUS_FINISHED)
+			break;
+	}
+
+	mcp2210_queue_release_spi(state, owner);
+	return received;
+
+err:
+	if (started) {
+		// Don't leave a half done transaction to the next SPI user
+		int error = errno;
+		mcp2210_cancel_spi_transfer(handle, NULL);
+		errno = error;
+	}
+	mcp2210_queue_release_spi(state, owner);
+	return -1;
+}
+
+// Plain buffers as the stream of a transaction
+struct buffer_stream {
+	const uint8_t *send;
+	size_t send_len, sent;
+	uint8_t *recv;
+	size_t recv_len, received;
+};
+
+static size_t buffer_fill(void *ctx, uint8_t *data, size_t len)
+{
+	struct buffer_stream *buf = ctx;
+	if (len > buf->send_len - buf->sent)
+		len = buf->send_len - buf->sent;
+	memcpy(data, buf->send + buf->sent, len);
+	buf->sent += len;
+	return len;
+}
+
+static int buffer_drain(void *ctx, const uint8_t *data, size_t len)
+{
+	struct buffer_stream *buf = ctx;
+	if (len > buf->recv_len - buf->received) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(buf->recv + buf->received, data, len);
+	buf->received += len;
+	return 0;
+}
+
+ssize_t mcp2210_spi_transaction(hid_handle_t *handle, int priority,
+    const void *send, size_t send_len,
+    void *recv, size_t recv_len)
+{
+	struct buffer_stream buf = { send, send_len, 0, recv, recv_len, 0 };
+	struct mcp2210_spi_stream stream = { buffer_fill, buffer_drain, &buf };
+
+	ssize_t received = mcp2210_spi_stream(handle, priority, &stream);
+	if (received != -1)
+		mcp2210_capture_transfer(hid_state(handle), MCP2210_SPI_STATUS_FINISHED,
+			send, send_len, recv, received);
+	return received;
+}
+
+// Send a prepared command report
+int mcp2210_command(hid_handle_t *handle, const void *cmd, void *resp)
+{
+	return mcp2210_command_class(handle,
+		mcp2210_cmd_priority(((const uint8_t *) cmd)[0]), cmd, resp);
+}
+
+int mcp2210_command_class(hid_handle_t *handle, int priority,
+    const void *cmd, void *resp)
+{
+	if (priority < 0 || priority >= MCP2210_CLASSES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mcp2210_cmd_t c;
+	memcpy(&c, cmd, sizeof(c));
+
+	if (-1 == do_cmd_class(handle, priority, NULL, &c, resp))
+		return -1;
+
+	if (c.hdr[0] == MCP2210_CMD_TRANSFER_SPI_DATA)
+		mcp2210_track_transfer(hid_state(handle), resp);
+	return 0;
+}
+
+// Window of a batch, no backend holds more responses than this
+#define BATCH_WINDOW 64
+
+// Finish the commands of a batch that are still to do
+static void batch_fail(mcp2210_batch_cmd_t *cmds, size_t count, int error)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (!cmds[i].done) {
+			cmds[i].done = true;
+			cmds[i].error = error;
+		}
+	}
+}
+
+// A response belongs to the command with the same opcode, successful NVRAM
+// responses also echo the sub command
+static bool batch_matches(const uint8_t *cmd, const uint8_t *resp)
+{
+	if (resp[0] != cmd[0])
+		return false;
+	if ((cmd[0] == MCP2210_CMD_GET_NVRAM || cmd[0] == MCP2210_CMD_SET_NVRAM) &&
+			resp[1] == MCP2210_STATUS_SUCCESS)
+		return resp[2] == cmd[1];
+	return true;
+}
+
+// Read the responses to reports written but not answered yet, so they can't
+// pass for the response of a later command on the device
+static void batch_drain(hid_handle_t *handle, size_t unread)
+{
+	int error = errno;
+	uint8_t resp[MCP2210_REPORT_SIZE];
+	while (unread-- && -1 != hid_read(handle, resp, sizeof(resp)))
+		;
+	errno = error;
+}
+
+// Send the commands still to do in one turn, a window at a time
+static int batch_round(hid_handle_t *handle, mcp2210_batch_cmd_t *cmds,
+	size_t count, mcp2210_retry_t *retry)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	size_t depth = hid_pipeline_depth(handle);
+	if (depth > BATCH_WINDOW)
+		depth = BATCH_WINDOW;
+	bool busy = false, in_progress = false;
+	int result = MCP2210_RESP_OK;
+	// Reports written whose response wasn't read yet
+	size_t unread = 0;
+
+	mcp2210_queue_enter(state, MCP2210_CLASS_NORMAL, false, NULL);
+
+	size_t next = 0;
+	while (next < count) {
+		// Commands written in this window and not answered yet
+		mcp2210_batch_cmd_t *window[BATCH_WINDOW];
+		uint64_t seqs[BATCH_WINDOW];
+		size_t written = 0;
+
+		for (; next < count && written < depth; ++next) {
+			mcp2210_batch_cmd_t *c = &cmds[next];
+			if (c->done)
+				continue;
+			seqs[written] = mcp2210_trace_seq(state);
+			MCP2210_TRACE4(cmd_submit, handle, seqs[written], c->cmd[0], c->cmd[1]);
+			if (-1 == hid_write(handle, c->cmd, sizeof(c->cmd)))
+				goto err;
+			window[written++] = c;
+			unread++;
+		}
+
+		for (size_t i = 0; i < written; ++i) {
+			uint8_t resp[MCP2210_REPORT_SIZE];
+			if (-1 == hid_read(handle, resp, sizeof(resp)))
+				goto err;
+			unread--;
+
+			// The chip answers in order, so this is the first unanswered one
+			// unless a response got lost
+			size_t j = 0;
+			while (j < written && (!window[j] || !batch_matches(window[j]->cmd, resp)))
+				++j;
+			if (j == written) {
+				// Not the response to any of them, theirs are still due
+				unread++;
+				errno = EPROTO;
+				goto err;
+			}
+			MCP2210_TRACE5(cmd_response, handle, seqs[j], resp[0], resp[1], resp[2]);
+			mcp2210_batch_cmd_t *c = window[j];
+			window[j] = NULL;
+			memcpy(c->resp, resp, sizeof(resp));
+
+			switch (mcp2210_check_resp(state, c->cmd, c->resp)) {
+			case MCP2210_RESP_OK:
+				c->done = true;
+				break;
+			case MCP2210_RESP_BUSY:
+				busy = true;
+				if (resp[1] == MCP2210_STATUS_IN_PROGRESS)
+					in_progress = true;
+				break;
+			default:
+				c->done = true;
+				c->error = errno;
+				break;
+			}
+		}
+	}
+
+	if (busy)
+		result = MCP2210_RESP_BUSY;
+
+	// A transfer that keeps the chip busy for too long is stuck
+	if (in_progress && watchdog_due(state, retry->start)) {
+		result = watchdog_expired(handle, retry);
+		if (result == -1)
+			batch_fail(cmds, count, errno);
+	}
+
+	mcp2210_queue_leave(state);
+	return result;
+
+err:
+	batch_drain(handle, unread);
+	batch_fail(cmds, count, errno);
+	mcp2210_queue_leave(state);
+	return -1;
+}
+
+// Run a batch of commands, resending the busy ones
+int mcp2210_command_batch(hid_handle_t *handle,
+    mcp2210_batch_cmd_t *cmds, size_t count)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	mcp2210_retry_t retry = { 0, 0, 0 };
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cmds[i].cmd[0] == MCP2210_CMD_TRANSFER_SPI_DATA) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		cmds[i].done = false;
+		cmds[i].error = 0;
+	}
+
+	for (;;) {
+		int result = batch_round(handle, cmds, count, &retry);
+		if (result == MCP2210_RESP_OK) {
+			mcp2210_retry_done(state, &retry);
+			break;
+		}
+		if (result == -1)
+			break;
+		if (result == RESP_RESEND)
+			continue;
+
+		int64_t wait = mcp2210_retry_next(state, &retry);
+		if (wait < 0) {
+			batch_fail(cmds, count, errno);
+			break;
+		}
+		mcp2210_sleep_us(wait);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cmds[i].error) {
+			errno = cmds[i].error;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Read the whole configuration of a chip in one batch
+int mcp2210_read_device_state(hid_handle_t *handle,
+    mcp2210_device_state_t *device_state)
+{
+	enum {
+		SPI, NV_SPI, CHIP, NV_CHIP, KEY, PRODUCT, MANUFACTURER, COMMANDS
+	};
+	static const uint8_t hdr[COMMANDS][2] = {
+		[SPI] = { MCP2210_CMD_GET_SPI_SETTINGS, 0 },
+		[NV_SPI] = { MCP2210_CMD_GET_NVRAM, MCP2210_SUB_SPI_SETTINGS },
+		[CHIP] = { MCP2210_CMD_GET_CHIP_SETTINGS, 0 },
+		[NV_CHIP] = { MCP2210_CMD_GET_NVRAM, MCP2210_SUB_CHIP_SETTINGS },
+		[KEY] = { MCP2210_CMD_GET_NVRAM, MCP2210_SUB_KEY_PARAMETERS },
+		[PRODUCT] = { MCP2210_CMD_GET_NVRAM, MCP2210_SUB_PRODUCT_NAME },
+		[MANUFACTURER] = { MCP2210_CMD_GET_NVRAM, MCP2210_SUB_MANUFACTURER_NAME },
+	};
+
+	mcp2210_batch_cmd_t cmds[COMMANDS];
+	for (size_t i = 0; i < COMMANDS; ++i)
+		prepare_cmd((mcp2210_cmd_t *) cmds[i].cmd, hdr[i][0], hdr[i][1]);
+
+	if (-1 == mcp2210_command_batch(handle, cmds, COMMANDS))
+		return -1;
+
+	mcp2210_resp_t *resp[COMMANDS];
+	for (size_t i = 0; i < COMMANDS; ++i)
+		resp[i] = (mcp2210_resp_t *) cmds[i].resp;
+
+	device_state->spi_settings = resp[SPI]->data.spi_settings;
+	device_state->nv_spi_settings = resp[NV_SPI]->data.spi_settings;
+	device_state->chip_settings = resp[CHIP]->data.chip_settings;
+	device_state->nv_chip_settings = resp[NV_CHIP]->data.chip_settings;
+	decode_key_parameters(resp[KEY], &device_state->key_parameters);
+	if (-1 == decode_name(resp[PRODUCT], device_state->product_name,
+			sizeof(device_state->product_name)))
+		return -1;
+	return decode_name(resp[MANUFACTURER], device_state->manufacturer_name,
+		sizeof(device_state->manufacturer_name));
+}
@@ -5,6 +5,10 @@
 // The HID API is part of libmcp
 #include "hid.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // VID and PID of the MCP2210
 #define MCP2210_VID 0x04d8
 #define MCP2210_PID 0x00de
@@ -13,7 +17,7 @@
 // NOTE: every multi byte value is little endian
 ////
 
-#ifdef LITTLE_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define b16(x) x
 #define b32(x) x
 #else
@@ -21,6 +25,154 @@
 #define b32(x) __builtin_bswap32(x)
 #endif
 
+////
+// Command codes, the first byte of every report
+////
+
+// NVRAM
+#define MCP2210_CMD_SET_NVRAM      0x60
+#define MCP2210_CMD_GET_NVRAM      0x61
+
+// NVRAM sub commands
+#define MCP2210_SUB_SPI_SETTINGS      0x10
+#define MCP2210_SUB_CHIP_SETTINGS     0x20
+#define MCP2210_SUB_KEY_PARAMETERS    0x30
+#define MCP2210_SUB_PRODUCT_NAME      0x40
+#define MCP2210_SUB_MANUFACTURER_NAME 0x50
+
+// Volatile RAM
+#define MCP2210_CMD_GET_SPI_SETTINGS 0x41
+#define MCP2210_CMD_SET_SPI_SETTINGS 0x40
+
+#define MCP2210_CMD_GET_CHIP_SETTINGS 0x20
+#define MCP2210_CMD_SET_CHIP_SETTINGS 0x21
+
+// Transfer SPI data
+#define MCP2210_CMD_TRANSFER_SPI_DATA 0x42
+
+// GPIO pins
+#define MCP2210_CMD_SET_GPIO_VALUE     0x30
+#define MCP2210_CMD_GET_GPIO_VALUE     0x31
+#define MCP2210_CMD_SET_GPIO_DIRECTION 0x32
+#define MCP2210_CMD_GET_GPIO_DIRECTION 0x33
+
+// Chip status and SPI bus control
+#define MCP2210_CMD_GET_CHIP_STATUS     0x10
+#define MCP2210_CMD_CANCEL_SPI_TRANSFER 0x11
+#define MCP2210_CMD_RELEASE_SPI_BUS     0x80
+
+// Size of every command and response report
+#define MCP2210_REPORT_SIZE 64
+
+// Status codes reported by the chip in every response
+#define MCP2210_STATUS_SUCCESS           0x00
+// The SPI bus is owned by an external master
+#define MCP2210_STATUS_BUS_NOT_AVAILABLE 0xf7
+// An SPI transfer is in progress, the command was not accepted
+#define MCP2210_STATUS_IN_PROGRESS       0xf8
+#define MCP2210_STATUS_UNKNOWN_COMMAND   0xf9
+// The NVRAM is locked or the password is wrong
+#define MCP2210_STATUS_BLOCKED           0xfb
+#define MCP2210_STATUS_REJECTED          0xfc
+
+// Every call on a handle may come from any thread, blocking and asynchronous
+// commands on one device take turns one report at a time. Waiting reports
+// run by priority class, lower first, unless one waited longer than the
+// aging limit.
+// Priority classes of the per-device command queue
+// GPIO and bus control commands
+#define MCP2210_CLASS_CONTROL 0
+// Settings and single SPI reports
+#define MCP2210_CLASS_NORMAL  1
+// Long SPI transactions
+#define MCP2210_CLASS_BULK    2
+#define MCP2210_CLASSES       3
+
+#define MCP2210_RTT_BUCKETS 16
+#define MCP2210_POLL_SLOTS 8
+
+// Per-device statistics of the retry engine and command queue
+typedef struct mcp2210_stats {
+    // Commands sent to the chip, including retries
+    uint64_t commands;
+    // Commands resent because the chip reported busy
+    uint64_t retries;
+    // Busy responses by cause
+    uint64_t bus_not_available;
+    uint64_t in_progress;
+    // Commands that were still busy when the deadline expired
+    uint64_t timeouts;
+    // Total time slept between retries in microseconds
+    uint64_t backoff_us;
+    // Stuck transfers cancelled by the watchdog
+    uint64_t watchdog_cancels;
+    // Learned time for a busy chip to accept commands again in microseconds
+    uint32_t busy_estimate_us;
+    // Reports sent per priority class
+    uint64_t queued[MCP2210_CLASSES];
+    // Time reports waited for the device per class, total and worst
+    uint64_t queue_wait_us[MCP2210_CLASSES];
+    uint64_t queue_wait_max_us[MCP2210_CLASSES];
+    // Reports of lower classes that ran first because they waited too long
+    uint64_t queue_aged;
+    // Reports per class that found the device taken and had to wait
+    uint64_t contended[MCP2210_CLASSES];
+    // Most reports waiting for the device at once
+    uint64_t queue_depth_max;
+    // Transfers that couldn't be written to the capture file
+    uint64_t capture_errors;
+    // Round trips of blocking commands without and with the low latency
+    // mode. Bucket 0 counts those under 1us, bucket n those from 2^(n-1) up
+    // to 2^n microseconds and the last one everything longer.
+    uint64_t rtt[2][MCP2210_RTT_BUCKETS];
+    // Status transactions run by mcp2210_spi_poll, and polls that gave up
+    uint64_t polls;
+    uint64_t poll_timeouts;
+    // Learned completion time per poll slot in microseconds, 0 -> none yet
+    uint32_t poll_estimate_us[MCP2210_POLL_SLOTS];
+} mcp2210_stats_t;
+
+// Default deadline for retrying busy commands
+#define MCP2210_DEFAULT_RETRY_TIMEOUT_US 100000
+
+// Set how long commands are retried while the chip is busy, 0 disables retries
+void mcp2210_set_retry_timeout(hid_handle_t *handle, uint32_t timeout_us);
+
+// Default time after which a waiting report runs ahead of higher classes
+#define MCP2210_DEFAULT_QUEUE_AGING_US 20000
+
+// Set how long a report may wait behind higher priority classes, 0 -> never
+// let lower classes jump ahead
+void mcp2210_set_queue_aging(hid_handle_t *handle, uint32_t aging_us);
+
+// Low latency mode for tight control loops: blocking commands poll for
+// their response for up to spin_us before sleeping, and USB autosuspend is
+// kept off while the mode is on (on Linux, not through the broker, which
+// needs write access to power/control in sysfs unless udev already set it
+// to "on"). 0 turns it off.
+// Returns: 0 -> success; -1 -> error, errno is set
+int mcp2210_set_low_latency(hid_handle_t *handle, uint32_t spin_us);
+
+// Pin the calling thread to a CPU, blocking calls do their I/O on the
+// thread that makes them
+// Returns: 0 -> success; -1 -> error, errno is set (ENOTSUP -> not on Linux)
+int mcp2210_pin_thread(int cpu);
+
+// Get the retry statistics of a device
+void mcp2210_get_stats(hid_handle_t *handle, mcp2210_stats_t *stats);
+// Reset the retry statistics, the learned busy and completion times are kept
+void mcp2210_reset_stats(hid_handle_t *handle);
+
+////
+// NOTE: the functions below fail with errno set to:
+//  EBUSY  -> the chip stayed busy until the retry deadline
+//  EACCES -> access to the NVRAM was blocked or rejected
+//  ENOTSUP -> the chip did not recognize the command
+//  EPROTO -> the response did not match the command
+//  EINVAL -> an unknown priority class was given
+//  ETIMEDOUT -> the watchdog cancelled a stuck transfer of this process
+////
+
 // SPI settings
 #define MCP2210_MAX_BITRATE 12000000
 typedef struct mcp2210_spi_settings {
@@ -107,4 +259,414 @@ int mcp2210_spi_transfer(hid_handle_t *handle,
     void *send, size_t send_len,
     void *recv, size_t *recv_len);
 
+// Chip status
+#define MCP2210_BUS_OWNER_NONE     0x00
+#define MCP2210_BUS_OWNER_USB      0x01
+#define MCP2210_BUS_OWNER_EXTERNAL 0x02
+
+typedef struct mcp2210_chip_status {
+    // 0 -> an external master requested the bus, 1 -> no request pending
+    uint8_t bus_release_status;
+    uint8_t bus_owner;
+    uint8_t password_attempts;
+    uint8_t password_guessed;
+} __attribute__((packed)) mcp2210_chip_status_t;
+
+// Read the chip status
+int mcp2210_get_chip_status(hid_handle_t *handle,
+    mcp2210_chip_status_t *chip_status);
+
+// Cancel the SPI transfer in progress, status is optional
+int mcp2210_cancel_spi_transfer(hid_handle_t *handle,
+    mcp2210_chip_status_t *chip_status);
+
+// Release the SPI bus, ack_value is driven on the bus release ACK pin
+int mcp2210_release_spi_bus(hid_handle_t *handle, bool ack_value);
+
+// Cancel a transfer left behind by a previous user of the device and free the
+// bus, unless a transfer of this process is going, then keep watching: a
+// transfer that stays busy or gets no new data for timeout_us is cancelled,
+// the commands of this process it belonged to fail with ETIMEDOUT. A timeout
+// of 0 disables the watchdog.
+int mcp2210_set_watchdog(hid_handle_t *handle, uint32_t timeout_us);
+
+// GPIO values and directions, bit n is GP<n>, a set direction bit is an input
+int mcp2210_get_gpio(hid_handle_t *handle, uint16_t *value);
+int mcp2210_set_gpio(hid_handle_t *handle, uint16_t value);
+int mcp2210_get_gpio_direction(hid_handle_t *handle, uint16_t *direction);
+int mcp2210_set_gpio_direction(hid_handle_t *handle, uint16_t direction);
+
+// Run a whole SPI transaction, one report at a time in the given class. Other
+// threads' commands may run between the reports, their SPI transfers wait
+// until the transaction finished.
+// Returns: number of bytes received; -1 -> error, errno is set
+ssize_t mcp2210_spi_transaction(hid_handle_t *handle, int priority,
+    const void *send, size_t send_len,
+    void *recv, size_t recv_len);
+
+// Send a complete command report and receive its response, both of
+// MCP2210_REPORT_SIZE bytes, with the same retries and checks as above
+int mcp2210_command(hid_handle_t *handle, const void *cmd, void *resp);
+// Same as mcp2210_command in an explicit priority class
+int mcp2210_command_class(hid_handle_t *handle, int priority,
+    const void *cmd, void *resp);
+
+////
+// Command batches
+//
+// The commands of a batch are written back to back, as many as the backend
+// can have waiting for a response, then the responses are read and matched
+// to the commands by the echoed opcode and NVRAM sub command. Commands the
+// chip answered busy are resent together after the usual backoff. A batch
+// runs in one turn of the normal class, SPI transfers can't be batched.
+////
+
+typedef struct mcp2210_batch_cmd {
+    // Set by the caller
+    uint8_t cmd[MCP2210_REPORT_SIZE];
+
+    // Set on return: 0 -> success; errno value otherwise
+    int error;
+    uint8_t resp[MCP2210_REPORT_SIZE];
+
+    // Internal
+    bool done;
+} mcp2210_batch_cmd_t;
+
+// Run a batch of commands
+// Returns: 0 -> every command succeeded; -1 -> error, errno is set to the
+// first failure, the error of each command tells which ones completed
+int mcp2210_command_batch(hid_handle_t *handle,
+    mcp2210_batch_cmd_t *cmds, size_t count);
+
+// Longest product or manufacturer name the chip stores
+#define MCP2210_NAME_MAX 29
+
+// Everything that configures a chip
+typedef struct mcp2210_device_state {
+    mcp2210_spi_settings_t spi_settings;
+    mcp2210_spi_settings_t nv_spi_settings;
+    mcp2210_chip_settings_t chip_settings;
+    mcp2210_chip_settings_t nv_chip_settings;
+    mcp2210_key_parameters_t key_parameters;
+    char product_name[MCP2210_NAME_MAX + 1];
+    char manufacturer_name[MCP2210_NAME_MAX + 1];
+} mcp2210_device_state_t;
+
+// Read the settings in RAM and NVRAM, the key parameters and both names in
+// one batch
+int mcp2210_read_device_state(hid_handle_t *handle,
+    mcp2210_device_state_t *device_state);
+
+////
+// Transaction programs
+//
+// A fixed sequence of SPI transfers and GPIO changes is compiled once and
+// replayed with mcp2210_program_run. Compiling checks the steps, encodes
+// every report and leaves out SPI settings that don't change between
+// transfers. Send data that changes between runs goes into slots patched
+// in the compiled reports.
+////
+
+// Use these SPI settings for the transfers that follow, their active_cs and
+// bytes_per_transaction are taken from each transfer
+#define MCP2210_STEP_SETTINGS 1
+// One SPI transaction: send_len bytes are written, then recv_len read
+#define MCP2210_STEP_TRANSFER 2
+// Set the GPIO values
+#define MCP2210_STEP_GPIO     3
+
+typedef struct mcp2210_step {
+    int type;
+    // MCP2210_STEP_SETTINGS
+    mcp2210_spi_settings_t settings;
+    // MCP2210_STEP_TRANSFER, active_cs is the CS pin values while it runs
+    uint16_t active_cs;
+    const void *send;
+    size_t send_len;
+    size_t recv_len;
+    // Slot the send data can be patched through, 0 -> fixed. All transfers
+    // sharing a slot send the same bytes, send may be NULL for zeros.
+    int slot;
+    // MCP2210_STEP_GPIO
+    uint16_t gpio;
+} mcp2210_step_t;
+
+typedef struct mcp2210_program mcp2210_program_t;
+
+// Compile the steps, which don't have to stay around afterwards
+// Returns: program; NULL -> error, errno is set (EINVAL -> invalid steps)
+mcp2210_program_t *mcp2210_program_compile(const mcp2210_step_t *steps,
+    size_t count);
+
+// Replace the send data of a slot, data_len has to be its send_len
+int mcp2210_program_patch(mcp2210_program_t *program, int slot,
+    const void *data, size_t data_len);
+
+// Bytes the transfers of a program read in total
+size_t mcp2210_program_recv_len(const mcp2210_program_t *program);
+
+// Run a program in one turn of the given class, nothing else runs on the
+// device in between. The bytes read by the transfers are stored one after
+// the other.
+// Returns: number of bytes received; -1 -> error, errno is set
+ssize_t mcp2210_program_run(hid_handle_t *handle, mcp2210_program_t *program,
+    int priority, void *recv, size_t recv_len);
+
+void mcp2210_program_free(mcp2210_program_t *program);
+
+////
+// Asynchronous commands
+//
+// A submitted command is sent as soon as it gets its turn in the queue of
+// the device, its callback runs from mcp2210_handle_events once the response
+// arrived. Busy responses are retried from the event loop like the blocking
+// calls do, other commands may use the device during the backoff. Commands
+// to one device are sent in submission order.
+//
+// An SPI transfer takes the bus of the device with its first report and
+// holds it until the chip finished it, a report failed or the transfer was
+// cancelled. SPI transfers of blocking calls wait for it meanwhile, and
+// asynchronous ones wait for a blocking transaction holding the bus.
+//
+// Commands may be submitted from any thread. One thread at a time runs the
+// loop, mcp2210_handle_events in other threads waits for it to complete
+// something. Don't make blocking calls on a device with commands in flight
+// from a callback, its turn would never come.
+//
+// Every HID context has a loop of its own, a command completes in the loop
+// of the context its device was opened in. The calls without a context run
+// the loop of the default context.
+////
+
+// Internal retry bookkeeping
+typedef struct mcp2210_retry {
+    uint64_t start;
+    uint64_t deadline;
+    uint32_t wait;
+} mcp2210_retry_t;
+
+typedef struct mcp2210_async mcp2210_async_t;
+typedef void (*mcp2210_callback_t)(mcp2210_async_t *op);
+
+struct mcp2210_async {
+    // Set by the caller
+    hid_handle_t *handle;
+    uint8_t cmd[MCP2210_REPORT_SIZE];
+    mcp2210_callback_t callback;
+    void *arg;
+
+    // Set before the callback runs: 0 -> success; errno value otherwise
+    int error;
+    uint8_t resp[MCP2210_REPORT_SIZE];
+
+    // Internal
+    mcp2210_retry_t retry;
+    uint64_t due;
+    uint64_t seq;
+    mcp2210_async_t *next;
+    mcp2210_async_t *device_next;
+};
+
+// Submit a command, a command that can't be sent completes with its error
+// Returns: 0 -> success; -1 -> error, errno is set and no callback will run
+int mcp2210_submit(mcp2210_async_t *op);
+
+// Wait up to timeout_ms (-1 -> forever, 0 -> don't wait) for commands to
+// complete and run their callbacks
+// Returns: number of completed commands; -1 -> error, errno is set
+int mcp2210_handle_events(int timeout_ms);
+int mcp2210_ctx_handle_events(hid_context_t *ctx, int timeout_ms);
+
+// Commands submitted and not completed yet
+size_t mcp2210_in_flight(void);
+size_t mcp2210_ctx_in_flight(hid_context_t *ctx);
+
+// For driving the event loop from another one: wait until one of the fds
+// is ready or *timeout_ms (-1 -> forever) expired, then call
+// mcp2210_handle_events(0). The set changes with every command, fetch it
+// again before each wait.
+// Returns: number of fds stored; -1 -> error, errno is set (ENOMEM -> too small)
+ssize_t mcp2210_get_pollfds(struct pollfd *fds, size_t fds_len, int *timeout_ms);
+ssize_t mcp2210_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+    int *timeout_ms);
+
+// Result of one device in a fan-out
+typedef struct mcp2210_fanout_result {
+    // 0 -> success; errno value otherwise
+    int error;
+    // Bytes received into the buffer of the device
+    size_t recv_len;
+    // Time from the first command until the transaction finished
+    uint64_t latency_us;
+} mcp2210_fanout_result_t;
+
+// Run the same SPI transaction on several devices concurrently, sending as
+// many reports as needed until each chip reports it finished. Device i
+// receives into recv + i * recv_len. The devices have to share a context.
+// If running the loop fails, the devices stop after the report in flight
+// and finish with ECANCELED. A device that failed after its transaction
+// started is sent a cancel before the call returns.
+// Returns: 0 -> every device succeeded; -1 -> some failed, see results
+// (EINVAL -> devices of several contexts, EDEADLK -> called from a callback,
+// other errors -> the loop failed)
+int mcp2210_spi_fanout(hid_handle_t **handles, size_t count,
+    const void *send, size_t send_len,
+    void *recv, size_t recv_len,
+    mcp2210_fanout_result_t *results);
+
+////
+// SPI capture files
+//
+// A capture file records SPI transfers with the time they finished. It is
+// made of fixed size segments, only the one being written and the next one
+// are mapped, so a capture costs a copy into the mapping per transfer and
+// two segments of memory however long it runs. A helper thread of the
+// capture maps the next segment ahead, a transfer never waits for the file.
+// Every segment has a sparse index of record times, a reader finds a time
+// through the segment headers and one index instead of scanning the records
+// before it.
+////
+
+#define MCP2210_CAPTURE_SEGMENT_DEFAULT (4 << 20)
+
+typedef struct mcp2210_capture mcp2210_capture_t;
+
+// Create a capture file, replacing an existing one. The segment size is a
+// multiple of the page size, 0 -> default.
+// Returns: capture; NULL -> error, errno is set
+mcp2210_capture_t *mcp2210_capture_create(const char *path, size_t segment_size);
+
+// Append a record, status is the SPI status code of the transfer. Records
+// may be written from several threads.
+// Returns: 0 -> success; -1 -> error, errno is set (EMSGSIZE -> larger than a segment)
+int mcp2210_capture_write(mcp2210_capture_t *capture, uint16_t channel, uint8_t status,
+    const void *send, size_t send_len, const void *recv, size_t recv_len);
+
+// Record every mcp2210_spi_transfer and mcp2210_spi_transaction of a device
+// under channel, NULL stops recording. Failed writes are counted in the
+// capture_errors statistic instead of failing the transfer. Returns once no
+// transfer of the device writes to the previous capture anymore.
+void mcp2210_set_capture(hid_handle_t *handle, mcp2210_capture_t *capture,
+    uint16_t channel);
+
+// Flush and close a capture, mcp2210_set_capture has to have moved every
+// device off it
+// Returns: 0 -> success; -1 -> error, errno is set
+int mcp2210_capture_close(mcp2210_capture_t *capture);
+
+typedef struct mcp2210_capture_record {
+    // Microseconds since the epoch
+    uint64_t time_us;
+    uint16_t channel;
+    uint8_t status;
+    // Point into the file, valid until the next call on the reader
+    const uint8_t *send;
+    size_t send_len;
+    const uint8_t *recv;
+    size_t recv_len;
+} mcp2210_capture_record_t;
+
+typedef struct mcp2210_capture_reader mcp2210_capture_reader_t;
+
+// Open a capture file for reading, it may still be written
+// Returns: reader; NULL -> error, errno is set (EINVAL -> not a capture)
+mcp2210_capture_reader_t *mcp2210_capture_reader_open(const char *path);
+
+// Go to the first record taken at or after time_us
+// Returns: 0 -> success; -1 -> error, errno is set
+int mcp2210_capture_seek(mcp2210_capture_reader_t *reader, uint64_t time_us);
+
+// Read the next record
+// Returns: 1 -> record read; 0 -> end of the capture; -1 -> error, errno is set
+int mcp2210_capture_next(mcp2210_capture_reader_t *reader,
+    mcp2210_capture_record_t *record);
+
+void mcp2210_capture_reader_close(mcp2210_capture_reader_t *reader);
+
+////
+// Word framing
+//
+// The MCP2210 shifts bytes MSB first. Chips with LSB first or 9 to 16 and
+// 24 bit words get their words packed into a bit stream, with the last byte
+// filled up with zero bits. Words are stored in uint8_t for 8 bits, uint16_t
+// up to 16 bits and uint32_t for 24 bits, unused high bits are ignored on
+// send and cleared on receive.
+////
+
+typedef struct mcp2210_framing {
+    // 8 to 16 or 24
+    uint8_t word_bits;
+    // Shift the least significant bit of every word first
+    bool lsb_first;
+} mcp2210_framing_t;
+
+// Bytes on the wire for count words
+// Returns: number of bytes; 0 -> invalid framing
+size_t mcp2210_framed_len(const mcp2210_framing_t *framing, size_t count);
+
+// Convert words into mcp2210_framed_len bytes of wire format and back
+// Returns: 0 -> success; -1 -> error, errno is set (EINVAL -> invalid framing)
+int mcp2210_frame_pack(const mcp2210_framing_t *framing, const void *words,
+    size_t count, void *wire);
+int mcp2210_frame_unpack(const mcp2210_framing_t *framing, const void *wire,
+    void *words, size_t count);
+
+// Run mcp2210_spi_transaction on count words in each direction, converted
+// report by report without a buffer in between. Received bytes beyond the
+// last word are dropped.
+// Returns: number of whole words received; -1 -> error, errno is set
+ssize_t mcp2210_spi_transaction_words(hid_handle_t *handle, int priority,
+    const mcp2210_framing_t *framing, const void *send, void *recv, size_t count);
+
+////
+// Polling slave status registers
+//
+// Flash memories, ADCs and radios signal the end of an operation through a
+// status register that is read until a bit changes. mcp2210_spi_poll runs
+// the status transaction until a condition holds. It sleeps through most of
+// the time the operation took before and then polls more often the closer
+// it gets, so an operation that takes as long as before is noticed about
+// one round trip after it finished. Past that time the polls thin out
+// again, an operation that runs late is noticed within a sixteenth of the
+// overrun. Polls are a round trip apart at least.
+////
+
+typedef struct mcp2210_poll {
+    // Status transaction, e.g. a read status opcode and a dummy byte
+    const void *send;
+    size_t len;
+    // The condition holds once (recv[i] & mask[i]) == value[i] for each of
+    // the len bytes received
+    const void *mask;
+    const void *value;
+    // Give up this many microseconds after the call
+    uint32_t timeout_us;
+    // Learned completion time to use, below MCP2210_POLL_SLOTS. Operations of
+    // different length on one device, like page program and sector erase,
+    // take a slot each.
+    uint8_t slot;
+} mcp2210_poll_t;
+
+typedef struct mcp2210_poll_result {
+    // Status transactions run
+    uint32_t polls;
+    // Time from the call until the condition held or the deadline expired
+    uint64_t elapsed_us;
+} mcp2210_poll_result_t;
+
+// Run the status transaction of poll in the given class until its condition
+// holds, starting the operation right before the call. recv gets the len
+// bytes of the last status read, result is optional and also set when the
+// polls failed.
+// Other commands may run between the polls.
+// Returns: 0 -> condition held; -1 -> error, errno is set (ETIMEDOUT ->
+// deadline expired, EPROTO -> short status read)
+int mcp2210_spi_poll(hid_handle_t *handle, int priority,
+    const mcp2210_poll_t *poll, void *recv, mcp2210_poll_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
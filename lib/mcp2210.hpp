@@ -0,0 +1,613 @@
+/* C++ interface to libmcp */
+#ifndef MCP2210_HPP
+#define MCP2210_HPP
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <poll.h>
+#if __has_include(<span>)
+#include <span>
+#endif
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define MCP2210_HPP_COROUTINES 1
+#endif
+#include "mcp2210.h"
+
+namespace mcp {
+
+// A complete command or response report
+using report = std::array<std::uint8_t, MCP2210_REPORT_SIZE>;
+
+// Largest payload of a single SPI transfer report
+inline constexpr std::size_t max_transfer = MCP2210_REPORT_SIZE - 4;
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+////
+// Settings in host byte order, the report builders below encode them
+////
+
+struct spi_settings {
+	std::uint32_t bitrate = 0;
+	std::uint16_t idle_cs = 0;
+	std::uint16_t active_cs = 0;
+	std::uint16_t cs_to_data_delay = 0;
+	std::uint16_t data_to_cs_delay = 0;
+	std::uint16_t data_delay = 0;
+	std::uint16_t bytes_per_transaction = 0;
+	std::uint8_t spi_mode = 0;
+};
+
+struct chip_settings {
+	std::array<std::uint8_t, 9> pins {};
+	std::uint16_t gpio_default = 0;
+	std::uint16_t gpio_direction = 0;
+	std::uint8_t other_settings = 0;
+	std::uint8_t nvram_lock = 0;
+	std::array<std::uint8_t, 8> new_password {};
+};
+
+struct transfer_result {
+	// One of MCP2210_SPI_STATUS_*
+	int status;
+	// Bytes received
+	std::size_t received;
+};
+
+namespace detail {
+
+constexpr void put16(report &r, std::size_t off, std::uint16_t v)
+{
+	r[off] = v & 0xff;
+	r[off + 1] = v >> 8;
+}
+
+constexpr void put32(report &r, std::size_t off, std::uint32_t v)
+{
+	put16(r, off, v & 0xffff);
+	put16(r, off + 2, v >> 16);
+}
+
+constexpr std::uint16_t get16(const report &r, std::size_t off)
+{
+	return r[off] | r[off + 1] << 8;
+}
+
+constexpr std::uint32_t get32(const report &r, std::size_t off)
+{
+	return get16(r, off) | std::uint32_t(get16(r, off + 2)) << 16;
+}
+
+constexpr report header(std::uint8_t hdr_0, std::uint8_t hdr_1)
+{
+	report r {};
+	r[0] = hdr_0;
+	r[1] = hdr_1;
+	return r;
+}
+
+} // namespace detail
+
+////
+// Report builders, usable in constant expressions so that fixed
+// configurations are encoded by the compiler
+////
+
+constexpr report get_spi_settings_report(bool nv = false)
+{
+	return nv ? detail::header(MCP2210_CMD_GET_NVRAM, MCP2210_SUB_SPI_SETTINGS)
+		: detail::header(MCP2210_CMD_GET_SPI_SETTINGS, 0);
+}
+
+constexpr report set_spi_settings_report(const spi_settings &s, bool nv = false)
+{
+	report r = nv ? detail::header(MCP2210_CMD_SET_NVRAM, MCP2210_SUB_SPI_SETTINGS)
+		: detail::header(MCP2210_CMD_SET_SPI_SETTINGS, 0);
+	detail::put32(r, 4, s.bitrate);
+	detail::put16(r, 8, s.idle_cs);
+	detail::put16(r, 10, s.active_cs);
+	detail::put16(r, 12, s.cs_to_data_delay);
+	detail::put16(r, 14, s.data_to_cs_delay);
+	detail::put16(r, 16, s.data_delay);
+	detail::put16(r, 18, s.bytes_per_transaction);
+	r[20] = s.spi_mode;
+	return r;
+}
+
+constexpr report get_chip_settings_report(bool nv = false)
+{
+	return nv ? detail::header(MCP2210_CMD_GET_NVRAM, MCP2210_SUB_CHIP_SETTINGS)
+		: detail::header(MCP2210_CMD_GET_CHIP_SETTINGS, 0);
+}
+
+constexpr report set_chip_settings_report(const chip_settings &s, bool nv = false)
+{
+	report r = nv ? detail::header(MCP2210_CMD_SET_NVRAM, MCP2210_SUB_CHIP_SETTINGS)
+		: detail::header(MCP2210_CMD_SET_CHIP_SETTINGS, 0);
+	for (std::size_t i = 0; i < s.pins.size(); ++i)
+		r[4 + i] = s.pins[i];
+	detail::put16(r, 13, s.gpio_default);
+	detail::put16(r, 15, s.gpio_direction);
+	r[17] = s.other_settings;
+	r[18] = s.nvram_lock;
+	for (std::size_t i = 0; i < s.new_password.size(); ++i)
+		r[19 + i] = s.new_password[i];
+	return r;
+}
+
+// SPI transfer of a payload known at compile time
+template <std::size_t N>
+constexpr report transfer_report(const std::array<std::uint8_t, N> &data)
+{
+	static_assert(N <= max_transfer, "SPI transfer payload too large");
+	report r = detail::header(MCP2210_CMD_TRANSFER_SPI_DATA, N);
+	for (std::size_t i = 0; i < N; ++i)
+		r[4 + i] = data[i];
+	return r;
+}
+
+constexpr report get_gpio_report()
+{
+	return detail::header(MCP2210_CMD_GET_GPIO_VALUE, 0);
+}
+
+constexpr report set_gpio_report(std::uint16_t value)
+{
+	report r = detail::header(MCP2210_CMD_SET_GPIO_VALUE, 0);
+	detail::put16(r, 4, value);
+	return r;
+}
+
+constexpr report get_gpio_direction_report()
+{
+	return detail::header(MCP2210_CMD_GET_GPIO_DIRECTION, 0);
+}
+
+constexpr report set_gpio_direction_report(std::uint16_t direction)
+{
+	report r = detail::header(MCP2210_CMD_SET_GPIO_DIRECTION, 0);
+	detail::put16(r, 4, direction);
+	return r;
+}
+
+// GPIO value or direction of any of the GPIO responses
+constexpr std::uint16_t decode_gpio(const report &r)
+{
+	return detail::get16(r, 4);
+}
+
+constexpr spi_settings decode_spi_settings(const report &r)
+{
+	spi_settings s;
+	s.bitrate = detail::get32(r, 4);
+	s.idle_cs = detail::get16(r, 8);
+	s.active_cs = detail::get16(r, 10);
+	s.cs_to_data_delay = detail::get16(r, 12);
+	s.data_to_cs_delay = detail::get16(r, 14);
+	s.data_delay = detail::get16(r, 16);
+	s.bytes_per_transaction = detail::get16(r, 18);
+	s.spi_mode = r[20];
+	return s;
+}
+
+constexpr chip_settings decode_chip_settings(const report &r)
+{
+	chip_settings s;
+	for (std::size_t i = 0; i < s.pins.size(); ++i)
+		s.pins[i] = r[4 + i];
+	s.gpio_default = detail::get16(r, 13);
+	s.gpio_direction = detail::get16(r, 15);
+	s.other_settings = r[17];
+	s.nvram_lock = r[18];
+	return s;
+}
+
+////
+// Event loop of the asynchronous commands. Commands may be submitted from
+// any thread and one thread at a time runs the loop, the others wait for it
+// as in the C interface. Coroutines resume on the thread running the loop.
+// Every context has a loop of its own, the default context's runs when none
+// is given.
+////
+
+struct event_loop {
+	// Wait up to timeout_ms (-1 -> forever) for completions and run them
+	// Returns: number of completed commands
+	static int run_once(int timeout_ms = -1, hid_context_t *ctx = hid_default_context())
+	{
+		int count = mcp2210_ctx_handle_events(ctx, timeout_ms);
+		if (count == -1) {
+			if (errno == EINTR)
+				return 0;
+			throw_errno("mcp2210_handle_events");
+		}
+		return count;
+	}
+
+	// Run until no command is in flight
+	static void run(hid_context_t *ctx = hid_default_context())
+	{
+		while (mcp2210_ctx_in_flight(ctx))
+			run_once(-1, ctx);
+	}
+
+	// For an outside executor: wait for one of the fds or until timeout_ms
+	// expired (-1 -> no limit), then call run_once(0)
+	static std::vector<pollfd> pollfds(int &timeout_ms,
+		hid_context_t *ctx = hid_default_context())
+	{
+		std::vector<pollfd> fds(16);
+		ssize_t count;
+		int timeout;
+		while (timeout = timeout_ms,
+				-1 == (count = mcp2210_ctx_get_pollfds(ctx, fds.data(), fds.size(),
+					&timeout))) {
+			if (errno != ENOMEM)
+				throw_errno("mcp2210_get_pollfds");
+			fds.resize(fds.size() * 2);
+		}
+		fds.resize(count);
+		timeout_ms = timeout;
+		return fds;
+	}
+};
+
+#ifdef MCP2210_HPP_COROUTINES
+// A command that suspends the awaiting coroutine until its response arrived,
+// the coroutine resumes from event_loop. The response is turned into the
+// result by decode.
+template <typename Decode>
+class command_awaitable {
+public:
+	command_awaitable(hid_handle_t *handle, const report &cmd, Decode decode)
+		: decode_(std::move(decode))
+	{
+		op_.handle = handle;
+		for (std::size_t i = 0; i < cmd.size(); ++i)
+			op_.cmd[i] = cmd[i];
+		op_.callback = &done;
+	}
+	// The library keeps a pointer to the operation while it runs
+	command_awaitable(const command_awaitable &) = delete;
+	command_awaitable &operator=(const command_awaitable &) = delete;
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> waiter) noexcept
+	{
+		waiter_ = waiter;
+		op_.arg = this;
+		if (-1 == mcp2210_submit(&op_)) {
+			op_.error = errno;
+			return false;
+		}
+		return true;
+	}
+
+	decltype(auto) await_resume()
+	{
+		if (op_.error)
+			throw std::system_error(op_.error, std::generic_category(),
+				"mcp2210_submit");
+		report resp;
+		for (std::size_t i = 0; i < resp.size(); ++i)
+			resp[i] = op_.resp[i];
+		return decode_(resp);
+	}
+
+private:
+	static void done(mcp2210_async_t *op)
+	{
+		static_cast<command_awaitable *>(op->arg)->waiter_.resume();
+	}
+
+	mcp2210_async_t op_ {};
+	std::coroutine_handle<> waiter_;
+	Decode decode_;
+};
+#endif
+
+////
+// RAII wrappers, errors are thrown as std::system_error
+////
+
+// Owns an open device
+class device {
+public:
+	device() noexcept = default;
+	explicit device(hid_handle_t *handle) noexcept : handle_(handle) {}
+	device(device &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	device &operator=(device &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+	~device() { reset(); }
+
+	hid_handle_t *get() const noexcept { return handle_; }
+	hid_handle_t *release() noexcept { return std::exchange(handle_, nullptr); }
+	void reset() noexcept
+	{
+		if (handle_)
+			hid_cleanup_device(std::exchange(handle_, nullptr));
+	}
+	explicit operator bool() const noexcept { return handle_; }
+
+	const char *description() const { return hid_device_desc(handle_); }
+
+	// Send a prepared report and return the response
+	report command(const report &cmd) const
+	{
+		report resp;
+		command(cmd, resp);
+		return resp;
+	}
+	void command(const report &cmd, report &resp) const
+	{
+		if (-1 == mcp2210_command(handle_, cmd.data(), resp.data()))
+			throw_errno("mcp2210_command");
+	}
+
+	spi_settings read_spi_settings(bool nv = false) const
+	{
+		return decode_spi_settings(command(get_spi_settings_report(nv)));
+	}
+	void write_spi_settings(const spi_settings &s, bool nv = false) const
+	{
+		command(set_spi_settings_report(s, nv));
+	}
+
+	chip_settings read_chip_settings(bool nv = false) const
+	{
+		return decode_chip_settings(command(get_chip_settings_report(nv)));
+	}
+	void write_chip_settings(const chip_settings &s, bool nv = false) const
+	{
+		command(set_chip_settings_report(s, nv));
+	}
+
+	std::uint16_t gpio() const { return decode_gpio(command(get_gpio_report())); }
+	void set_gpio(std::uint16_t value) const { command(set_gpio_report(value)); }
+	std::uint16_t gpio_direction() const
+	{
+		return decode_gpio(command(get_gpio_direction_report()));
+	}
+	void set_gpio_direction(std::uint16_t direction) const
+	{
+		command(set_gpio_direction_report(direction));
+	}
+
+	mcp2210_stats_t stats() const
+	{
+		mcp2210_stats_t s;
+		mcp2210_get_stats(handle_, &s);
+		return s;
+	}
+
+#ifdef __cpp_lib_span
+	// SPI transfer of a prepared report, e.g. from transfer_report
+	transfer_result transfer(const report &cmd, std::span<std::uint8_t> recv) const
+	{
+		report resp;
+		command(cmd, resp);
+		return receive(resp, recv);
+	}
+
+	// SPI transfer, payloads with a static extent are checked at compile time
+	template <std::size_t N>
+	transfer_result transfer(std::span<const std::uint8_t, N> send,
+		std::span<std::uint8_t> recv) const
+	{
+		static_assert(N == std::dynamic_extent || N <= max_transfer,
+			"SPI transfer payload too large");
+		if constexpr (N == std::dynamic_extent) {
+			if (send.size() > max_transfer) {
+				errno = EINVAL;
+				throw_errno("mcp::device::transfer");
+			}
+		}
+		report cmd = detail::header(MCP2210_CMD_TRANSFER_SPI_DATA, send.size());
+		for (std::size_t i = 0; i < send.size(); ++i)
+			cmd[4 + i] = send[i];
+		return transfer(cmd, recv);
+	}
+
+#ifdef MCP2210_HPP_COROUTINES
+	// Same as transfer without blocking, co_await the result
+	auto async_transfer(const report &cmd, std::span<std::uint8_t> recv) const
+	{
+		return command_awaitable(handle_, cmd,
+			[recv](const report &resp) { return receive(resp, recv); });
+	}
+#endif
+
+private:
+	static transfer_result receive(const report &resp, std::span<std::uint8_t> recv)
+	{
+		std::size_t len = resp[2];
+		if (len > recv.size()) {
+			errno = ENOMEM;
+			throw_errno("mcp::device::transfer");
+		}
+		for (std::size_t i = 0; i < len; ++i)
+			recv[i] = resp[4 + i];
+		return { resp[3], len };
+	}
+#endif
+
+#ifdef MCP2210_HPP_COROUTINES
+public:
+	// Awaitable versions of the calls above, e.g.
+	//   auto settings = co_await dev.async_read_spi_settings();
+	auto async_command(const report &cmd) const
+	{
+		return command_awaitable(handle_, cmd, [](const report &resp) { return resp; });
+	}
+
+	auto async_read_spi_settings(bool nv = false) const
+	{
+		return command_awaitable(handle_, get_spi_settings_report(nv), decode_spi_settings);
+	}
+	auto async_write_spi_settings(const spi_settings &s, bool nv = false) const
+	{
+		return command_awaitable(handle_, set_spi_settings_report(s, nv), discard);
+	}
+
+	auto async_read_chip_settings(bool nv = false) const
+	{
+		return command_awaitable(handle_, get_chip_settings_report(nv), decode_chip_settings);
+	}
+	auto async_write_chip_settings(const chip_settings &s, bool nv = false) const
+	{
+		return command_awaitable(handle_, set_chip_settings_report(s, nv), discard);
+	}
+
+	auto async_gpio() const
+	{
+		return command_awaitable(handle_, get_gpio_report(), decode_gpio);
+	}
+	auto async_set_gpio(std::uint16_t value) const
+	{
+		return command_awaitable(handle_, set_gpio_report(value), discard);
+	}
+	auto async_gpio_direction() const
+	{
+		return command_awaitable(handle_, get_gpio_direction_report(), decode_gpio);
+	}
+	auto async_set_gpio_direction(std::uint16_t direction) const
+	{
+		return command_awaitable(handle_, set_gpio_direction_report(direction), discard);
+	}
+
+private:
+	static void discard(const report &) {}
+#endif
+
+private:
+	hid_handle_t *handle_ = nullptr;
+};
+
+// Selects a context independent of the default one
+struct separate_t { explicit separate_t() = default; };
+inline constexpr separate_t separate{};
+
+// Owns the HID module, or a context of its own with its own event loop
+class context {
+public:
+	context()
+	{
+		if (-1 == hid_init())
+			throw_errno("hid_init");
+		ctx_ = hid_default_context();
+	}
+	explicit context(separate_t) : ctx_(hid_context_create()), separate_(true)
+	{
+		if (!ctx_)
+			throw_errno("hid_context_create");
+	}
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+	~context()
+	{
+		if (separate_)
+			hid_context_free(ctx_);
+		else
+			hid_fini();
+	}
+
+	// For event_loop and the C API
+	hid_context_t *get() const noexcept { return ctx_; }
+
+	// List devices without opening them
+	std::vector<hid_device_info_t> enumerate(std::uint16_t vid = MCP2210_VID,
+		std::uint16_t pid = MCP2210_PID) const
+	{
+		std::vector<hid_device_info_t> info(8);
+		ssize_t count;
+		while (-1 == (count = hid_ctx_enumerate(ctx_, vid, pid, info.data(), info.size()))) {
+			if (errno != ENOMEM)
+				throw_errno("hid_enumerate");
+			info.resize(info.size() * 2);
+		}
+		info.resize(count);
+		return info;
+	}
+
+	device open(const hid_device_info_t &info) const
+	{
+		hid_handle_t *handle = hid_ctx_open(ctx_, &info);
+		if (!handle)
+			throw_errno("hid_open");
+		return device(handle);
+	}
+
+	device open_port(const char *port_path) const
+	{
+		hid_handle_t *handle = hid_ctx_open_port(ctx_, port_path);
+		if (!handle)
+			throw_errno("hid_open_port");
+		return device(handle);
+	}
+
+	device open_path(const char *path) const
+	{
+		hid_handle_t *handle = hid_ctx_open_path(ctx_, path);
+		if (!handle)
+			throw_errno("hid_open_path");
+		return device(handle);
+	}
+
+	device open_serial(const char *serial, std::uint16_t vid = MCP2210_VID,
+		std::uint16_t pid = MCP2210_PID) const
+	{
+		hid_handle_t *handle = hid_ctx_open_serial(ctx_, vid, pid, serial);
+		if (!handle)
+			throw_errno("hid_open_serial");
+		return device(handle);
+	}
+
+	std::vector<device> find_devices(std::uint16_t vid = MCP2210_VID,
+		std::uint16_t pid = MCP2210_PID) const
+	{
+		// Both are allocated before the handles are opened, taking them over
+		// can't throw
+		std::vector<hid_handle_t *> handles(16);
+		std::vector<device> devices(handles.size());
+		ssize_t count;
+		while (-1 == (count = hid_ctx_find_devices(ctx_, vid, pid, handles.data(),
+				handles.size()))) {
+			if (errno != ENOMEM)
+				throw_errno("hid_find_devices");
+			handles.resize(handles.size() * 2);
+			devices.resize(handles.size());
+		}
+
+		for (ssize_t i = 0; i < count; ++i)
+			devices[i] = device(handles[i]);
+		devices.resize(count);
+		return devices;
+	}
+
+private:
+	hid_context_t *ctx_;
+	bool separate_ = false;
+};
+
+} // namespace mcp
+
+#endif
@@ -0,0 +1,686 @@
+/* asynchronous commands and fan-out to many MCP2210s */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "mcp2210_priv.h"
+
+// Largest SPI payload of a single report
+#define TRANSFER_CHUNK (MCP2210_REPORT_SIZE - 4)
+
+////
+// Only one thread at a time makes the asynchronous calls into the backend:
+// the thread in mcp2210_handle_events, or a submitting thread while no one
+// runs the loop. Everything else hands its work over through the lists of
+// the loop and wakes it through a pipe. Each context has its own loop.
+////
+
+int mcp2210_loop_init(struct mcp2210_loop *loop)
+{
+	memset(loop, 0, sizeof(*loop));
+	if (-1 == pipe(loop->wake_fds))
+		return -1;
+	for (int i = 0; i < 2; ++i) {
+		fcntl(loop->wake_fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(loop->wake_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+	return 0;
+}
+
+void mcp2210_loop_fini(struct mcp2210_loop *loop)
+{
+	close(loop->wake_fds[0]);
+	close(loop->wake_fds[1]);
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->cond);
+	free(loop->fds);
+}
+
+// Loop the command completes in
+static struct mcp2210_loop *op_loop(mcp2210_async_t *op)
+{
+	return hid_loop(hid_context(op->handle));
+}
+
+static void wake_loop(struct mcp2210_loop *loop)
+{
+	static const char byte = 0;
+	(void) !write(loop->wake_fds[1], &byte, 1);
+}
+
+static void drain_wake_pipe(struct mcp2210_loop *loop)
+{
+	char buffer[64];
+	while (read(loop->wake_fds[0], buffer, sizeof(buffer)) > 0)
+		;
+}
+
+// Called with the loop lock held
+static bool in_loop(struct mcp2210_loop *loop)
+{
+	return loop->running && pthread_equal(loop->thread, pthread_self());
+}
+
+static void append(mcp2210_async_t **head, mcp2210_async_t **tail, mcp2210_async_t *op)
+{
+	op->next = NULL;
+	if (*tail)
+		(*tail)->next = op;
+	else
+		*head = op;
+	*tail = op;
+}
+
+static mcp2210_async_t *pop(mcp2210_async_t **head, mcp2210_async_t **tail)
+{
+	mcp2210_async_t *op = *head;
+	if (op) {
+		*head = op->next;
+		if (!*head)
+			*tail = NULL;
+	}
+	return op;
+}
+
+// Hand a finished exchange to the loop
+static void push_done(mcp2210_async_t *op, int error)
+{
+	struct mcp2210_loop *loop = op_loop(op);
+	pthread_mutex_lock(&loop->lock);
+	op->error = error;
+	append(&loop->done_head, &loop->done_tail, op);
+	bool wake = !in_loop(loop);
+	pthread_mutex_unlock(&loop->lock);
+	if (wake)
+		wake_loop(loop);
+}
+
+void mcp2210_async_turn(struct mcp2210_state *state)
+{
+	struct mcp2210_loop *loop = op_loop(state->async_head);
+	pthread_mutex_lock(&loop->lock);
+	append(&loop->ready_head, &loop->ready_tail, state->async_head);
+	bool wake = !in_loop(loop);
+	pthread_mutex_unlock(&loop->lock);
+	if (wake)
+		wake_loop(loop);
+}
+
+// Get the first command of a device its turn, it is sent by the loop
+static void request_turn(mcp2210_async_t *op)
+{
+	struct mcp2210_state *state = hid_state(op->handle);
+	if (mcp2210_queue_enter_async(state, mcp2210_cmd_priority(op->cmd[0]),
+			op->cmd[0] == MCP2210_CMD_TRANSFER_SPI_DATA))
+		mcp2210_async_turn(state);
+}
+
+static void complete(mcp2210_async_t *op, int error)
+{
+	struct mcp2210_state *state = hid_state(op->handle);
+	struct mcp2210_loop *loop = op_loop(op);
+
+	// The transfer holds the bus until the chip finished or it failed
+	if (op->cmd[0] == MCP2210_CMD_TRANSFER_SPI_DATA &&
+			(error || op->resp[3] == MCP2210_SPI_STATUS_FINISHED))
+		mcp2210_queue_release_async_spi(state);
+	mcp2210_queue_leave(state);
+
+	pthread_mutex_lock(&loop->lock);
+	state->async_head = op->device_next;
+	if (!state->async_head)
+		state->async_tail = NULL;
+	mcp2210_async_t *next = state->async_head;
+	op->error = error;
+	loop->completed++;
+	loop->in_flight--;
+	pthread_mutex_unlock(&loop->lock);
+
+	// Keep the device busy with the next command before running the callback
+	if (next)
+		request_turn(next);
+	op->callback(op);
+}
+
+static void queue_retry(struct mcp2210_loop *loop, mcp2210_async_t *op)
+{
+	mcp2210_async_t **cur = &loop->retry_queue;
+	while (*cur && (*cur)->due <= op->due)
+		cur = &(*cur)->next;
+	op->next = *cur;
+	*cur = op;
+}
+
+// The backend may call this from any thread that handles its events
+static void on_exchange(hid_handle_t *handle, int error, void *arg)
+{
+	(void) handle;
+	push_done(arg, error);
+}
+
+// Check a finished exchange, by the loop
+static void check_done(mcp2210_async_t *op)
+{
+	hid_handle_t *handle = op->handle;
+	struct mcp2210_state *state = hid_state(handle);
+
+	if (op->error) {
+		complete(op, op->error);
+		return;
+	}
+	MCP2210_TRACE5(cmd_response, handle, op->seq, op->resp[0], op->resp[1], op->resp[2]);
+
+	switch (mcp2210_check_resp(state, op->cmd, op->resp)) {
+	case MCP2210_RESP_OK:
+		mcp2210_retry_done(state, &op->retry);
+		if (op->cmd[0] == MCP2210_CMD_TRANSFER_SPI_DATA)
+			mcp2210_track_transfer(state, op->resp);
+		complete(op, 0);
+		return;
+	case MCP2210_RESP_BUSY:
+		break;
+	default:
+		complete(op, errno);
+		return;
+	}
+
+	int64_t wait = mcp2210_retry_next(state, &op->retry);
+	if (wait < 0) {
+		complete(op, errno);
+		return;
+	}
+
+	// Other commands may use the device during the backoff
+	mcp2210_queue_leave(state);
+	op->due = mcp2210_now_us() + wait;
+	struct mcp2210_loop *loop = op_loop(op);
+	pthread_mutex_lock(&loop->lock);
+	queue_retry(loop, op);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+// Send the commands that got their turn, by the thread owning the loop
+static void send_ready(struct mcp2210_loop *loop)
+{
+	for (;;) {
+		pthread_mutex_lock(&loop->lock);
+		mcp2210_async_t *op = pop(&loop->ready_head, &loop->ready_tail);
+		pthread_mutex_unlock(&loop->lock);
+		if (!op)
+			return;
+
+		op->seq = mcp2210_trace_seq(hid_state(op->handle));
+		MCP2210_TRACE4(cmd_submit, op->handle, op->seq, op->cmd[0], op->cmd[1]);
+		if (-1 == hid_exchange_async(op->handle, op->cmd, sizeof(op->cmd),
+				op->resp, sizeof(op->resp), on_exchange, op))
+			push_done(op, errno);
+	}
+}
+
+// Become the thread making the backend calls, unless another one is
+static bool claim_loop(struct mcp2210_loop *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	bool claimed = !loop->running;
+	if (claimed) {
+		loop->running = true;
+		loop->thread = pthread_self();
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return claimed;
+}
+
+static void release_loop(struct mcp2210_loop *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	loop->running = false;
+	pthread_cond_broadcast(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+// Send what is ready right away, unless another thread runs the loop
+static void try_send(struct mcp2210_loop *loop)
+{
+	if (!claim_loop(loop))
+		return;
+	send_ready(loop);
+	release_loop(loop);
+}
+
+int mcp2210_submit(mcp2210_async_t *op)
+{
+	struct mcp2210_state *state = hid_state(op->handle);
+	struct mcp2210_loop *loop = op_loop(op);
+
+	memset(&op->retry, 0, sizeof(op->retry));
+	op->error = 0;
+	op->device_next = NULL;
+
+	// Commands of a device are sent one after another
+	pthread_mutex_lock(&loop->lock);
+	bool first = !state->async_tail;
+	if (first)
+		state->async_head = op;
+	else
+		state->async_tail->device_next = op;
+	state->async_tail = op;
+	loop->in_flight++;
+	pthread_mutex_unlock(&loop->lock);
+
+	if (first) {
+		request_turn(op);
+		try_send(loop);
+	}
+	return 0;
+}
+
+size_t mcp2210_ctx_in_flight(hid_context_t *ctx)
+{
+	struct mcp2210_loop *loop = hid_loop(ctx);
+	pthread_mutex_lock(&loop->lock);
+	size_t result = loop->in_flight;
+	pthread_mutex_unlock(&loop->lock);
+	return result;
+}
+
+size_t mcp2210_in_flight(void)
+{
+	hid_context_t *ctx = hid_default_context();
+	return ctx ? mcp2210_ctx_in_flight(ctx) : 0;
+}
+
+// Time until the loop has to run again, lowering timeout_ms. Called with
+// the loop lock held.
+static int loop_timeout(struct mcp2210_loop *loop, uint64_t now, int timeout_ms)
+{
+	if (loop->ready_head || loop->done_head)
+		return 0;
+	if (loop->retry_queue) {
+		uint64_t due = loop->retry_queue->due;
+		int64_t until = due > now ? (due - now + 999) / 1000 : 0;
+		if (timeout_ms < 0 || until < timeout_ms)
+			timeout_ms = until;
+	}
+	return timeout_ms;
+}
+
+ssize_t mcp2210_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
+{
+	struct mcp2210_loop *loop = hid_loop(ctx);
+	if (!fds_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	fds[0].fd = loop->wake_fds[0];
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	*timeout_ms = loop_timeout(loop, mcp2210_now_us(), *timeout_ms);
+	bool owner = in_loop(loop);
+	pthread_mutex_unlock(&loop->lock);
+
+	// The thread running the loop watches the backend
+	if (!owner && !claim_loop(loop))
+		return 1;
+	ssize_t n = hid_ctx_get_pollfds(ctx, fds + 1, fds_len - 1, timeout_ms);
+	int error = errno;
+	if (!owner)
+		release_loop(loop);
+
+	errno = error;
+	return n == -1 ? -1 : n + 1;
+}
+
+ssize_t mcp2210_get_pollfds(struct pollfd *fds, size_t fds_len, int *timeout_ms)
+{
+	hid_context_t *ctx = hid_default_context();
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+	return mcp2210_ctx_get_pollfds(ctx, fds, fds_len, timeout_ms);
+}
+
+// One round of the loop, without the loop lock held
+static int run_loop(hid_context_t *ctx, int timeout_ms)
+{
+	struct mcp2210_loop *loop = hid_loop(ctx);
+	unsigned before = loop->completed;
+
+	// Resend commands whose backoff ran out
+	pthread_mutex_lock(&loop->lock);
+	uint64_t now = mcp2210_now_us();
+	while (loop->retry_queue && loop->retry_queue->due <= now) {
+		mcp2210_async_t *op = loop->retry_queue;
+		loop->retry_queue = op->next;
+		pthread_mutex_unlock(&loop->lock);
+		request_turn(op);
+		pthread_mutex_lock(&loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	send_ready(loop);
+
+	// Wait for the backend or a wakeup, but not past the next retry
+	pthread_mutex_lock(&loop->lock);
+	timeout_ms = loop_timeout(loop, now, timeout_ms);
+	pthread_mutex_unlock(&loop->lock);
+
+	ssize_t n;
+	int poll_timeout;
+	for (;;) {
+		poll_timeout = timeout_ms;
+		n = mcp2210_ctx_get_pollfds(ctx, loop->fds, loop->fds_len, &poll_timeout);
+		if (n != -1 || errno != ENOMEM)
+			break;
+		size_t len = loop->fds_len ? loop->fds_len * 2 : 16;
+		struct pollfd *fds = realloc(loop->fds, len * sizeof(*fds));
+		if (!fds)
+			return -1;
+		loop->fds = fds;
+		loop->fds_len = len;
+	}
+
+	if (n == -1) {
+		// The backend can't be polled from here, let it wait itself
+		if (errno != ENOTSUP || -1 == hid_ctx_handle_events(ctx, timeout_ms))
+			return -1;
+	} else {
+		if (-1 == poll(loop->fds, n, poll_timeout))
+			return -1;
+		if (loop->fds[0].revents & POLLIN)
+			drain_wake_pipe(loop);
+		if (-1 == hid_ctx_handle_events(ctx, 0))
+			return -1;
+	}
+
+	// Check the responses, then send whatever got its turn meanwhile
+	for (;;) {
+		pthread_mutex_lock(&loop->lock);
+		mcp2210_async_t *op = pop(&loop->done_head, &loop->done_tail);
+		pthread_mutex_unlock(&loop->lock);
+		if (!op)
+			break;
+		check_done(op);
+	}
+	send_ready(loop);
+
+	return loop->completed - before;
+}
+
+int mcp2210_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	struct mcp2210_loop *loop = hid_loop(ctx);
+	uint64_t deadline = timeout_ms < 0 ? 0 : mcp2210_now_us() + timeout_ms * 1000ull;
+
+	pthread_mutex_lock(&loop->lock);
+	if (in_loop(loop)) {
+		// Called from a callback
+		pthread_mutex_unlock(&loop->lock);
+		errno = EDEADLK;
+		return -1;
+	}
+
+	// Another thread runs the loop, wait for it to complete something
+	unsigned before = loop->completed;
+	while (loop->running && loop->completed == before) {
+		if (!deadline) {
+			pthread_cond_wait(&loop->cond, &loop->lock);
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t now = mcp2210_now_us();
+		if (now >= deadline)
+			break;
+		uint64_t ns = ts.tv_nsec + (deadline - now) * 1000;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&loop->cond, &loop->lock, &ts);
+	}
+	if (loop->running || loop->completed != before) {
+		pthread_mutex_unlock(&loop->lock);
+		return loop->completed - before;
+	}
+
+	loop->running = true;
+	loop->thread = pthread_self();
+	pthread_mutex_unlock(&loop->lock);
+
+	int result = run_loop(ctx, timeout_ms);
+	int error = errno;
+	release_loop(loop);
+
+	errno = error;
+	return result;
+}
+
+int mcp2210_handle_events(int timeout_ms)
+{
+	hid_context_t *ctx = hid_default_context();
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+	return mcp2210_ctx_handle_events(ctx, timeout_ms);
+}
+
+////
+// Fan-out
+////
+
+struct fanout;
+
+struct fanout_dev {
+	mcp2210_async_t op;
+	struct fanout *fanout;
+	const uint8_t *send;
+	size_t send_len, sent;
+	uint8_t *recv;
+	size_t recv_len;
+	mcp2210_fanout_result_t *result;
+	uint64_t start;
+	// The chip accepted a report, the transaction is under way
+	bool started;
+	bool finished;
+};
+
+// Shared by the devices of a fan-out. The callbacks may run in another
+// thread's loop, the lock protects everything they touch.
+struct fanout {
+	pthread_mutex_t lock;
+	// Devices with a command in flight
+	size_t pending;
+	// Send no more chunks, the devices finish with ECANCELED
+	bool cancelled;
+	// The caller returned, the last callback frees the fan-out and may not
+	// touch the results or buffers
+	bool abandoned;
+	struct fanout_dev devs[];
+};
+
+// Called with the fan-out lock held
+static void fanout_finish(struct fanout_dev *dev, int error)
+{
+	dev->finished = true;
+	dev->result->error = error;
+	dev->result->latency_us = mcp2210_now_us() - dev->start;
+}
+
+// Fill in the next chunk, or an empty one to collect the remaining data
+static void fanout_prepare(struct fanout_dev *dev)
+{
+	size_t chunk = dev->send_len - dev->sent;
+	if (chunk > TRANSFER_CHUNK)
+		chunk = TRANSFER_CHUNK;
+
+	memset(dev->op.cmd, 0, sizeof(dev->op.cmd));
+	dev->op.cmd[0] = MCP2210_CMD_TRANSFER_SPI_DATA;
+	dev->op.cmd[1] = chunk;
+	memcpy(dev->op.cmd + 4, dev->send + dev->sent, chunk);
+}
+
+// Called with the fan-out lock held, a command is in flight on success
+static void fanout_submit(struct fanout_dev *dev)
+{
+	if (-1 == mcp2210_submit(&dev->op)) {
+		fanout_finish(dev, errno);
+		return;
+	}
+	dev->fanout->pending++;
+}
+
+static void fanout_step(mcp2210_async_t *op)
+{
+	struct fanout_dev *dev = op->arg;
+	struct fanout *fanout = dev->fanout;
+
+	pthread_mutex_lock(&fanout->lock);
+	fanout->pending--;
+	if (fanout->abandoned) {
+		bool last = !fanout->pending;
+		pthread_mutex_unlock(&fanout->lock);
+		if (last) {
+			pthread_mutex_destroy(&fanout->lock);
+			free(fanout);
+		}
+		return;
+	}
+
+	if (op->error) {
+		fanout_finish(dev, op->error);
+	} else {
+		// The chunk was accepted, collect what was received
+		size_t len = op->resp[2];
+		dev->started = true;
+		dev->sent += op->cmd[1];
+		if (dev->result->recv_len + len > dev->recv_len) {
+			fanout_finish(dev, ENOMEM);
+		} else {
+			memcpy(dev->recv + dev->result->recv_len, op->resp + 4, len);
+			dev->result->recv_len += len;
+
+			if (op->resp[3] == MCP2210_SPI_STATUS_FINISHED)
+				fanout_finish(dev, 0);
+			else if (fanout->cancelled)
+				fanout_finish(dev, ECANCELED);
+			else {
+				fanout_prepare(dev);
+				fanout_submit(dev);
+			}
+		}
+	}
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+int mcp2210_spi_fanout(hid_handle_t **handles, size_t count,
+	const void *send, size_t send_len,
+	void *recv, size_t recv_len,
+	mcp2210_fanout_result_t *results)
+{
+	if (!count)
+		return 0;
+
+	// One loop runs all of them
+	hid_context_t *ctx = hid_context(handles[0]);
+	for (size_t i = 1; i < count; ++i) {
+		if (hid_context(handles[i]) != ctx) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	// The callbacks would wait for the loop that runs them
+	struct mcp2210_loop *loop = hid_loop(ctx);
+	pthread_mutex_lock(&loop->lock);
+	bool nested = in_loop(loop);
+	pthread_mutex_unlock(&loop->lock);
+	if (nested) {
+		errno = EDEADLK;
+		return -1;
+	}
+
+	struct fanout *fanout = calloc(1, sizeof(*fanout) + count * sizeof(struct fanout_dev));
+	if (!fanout)
+		return -1;
+	pthread_mutex_init(&fanout->lock, NULL);
+
+	pthread_mutex_lock(&fanout->lock);
+	for (size_t i = 0; i < count; ++i) {
+		struct fanout_dev *dev = &fanout->devs[i];
+		dev->fanout = fanout;
+		dev->op.handle = handles[i];
+		dev->op.callback = fanout_step;
+		dev->op.arg = dev;
+		dev->send = send;
+		dev->send_len = send_len;
+		dev->recv = (uint8_t *) recv + i * recv_len;
+		dev->recv_len = recv_len;
+		dev->result = &results[i];
+		dev->result->recv_len = 0;
+		dev->start = mcp2210_now_us();
+		fanout_prepare(dev);
+		fanout_submit(dev);
+	}
+	pthread_mutex_unlock(&fanout->lock);
+
+	int error = 0;
+	for (;;) {
+		pthread_mutex_lock(&fanout->lock);
+		size_t pending = fanout->pending;
+		pthread_mutex_unlock(&fanout->lock);
+		if (!pending)
+			break;
+
+		if (-1 == mcp2210_ctx_handle_events(ctx, -1) && errno != EINTR) {
+			if (error)
+				break;
+			// Stop sending and collect what is in flight
+			error = errno;
+			pthread_mutex_lock(&fanout->lock);
+			fanout->cancelled = true;
+			pthread_mutex_unlock(&fanout->lock);
+		}
+	}
+
+	pthread_mutex_lock(&fanout->lock);
+	for (size_t i = 0; i < count; ++i)
+		if (!fanout->devs[i].finished)
+			fanout_finish(&fanout->devs[i], ECANCELED);
+	if (fanout->pending) {
+		// The loop keeps failing, leave the commands in flight to it
+		fanout->abandoned = true;
+		pthread_mutex_unlock(&fanout->lock);
+		errno = error;
+		return -1;
+	}
+	pthread_mutex_unlock(&fanout->lock);
+
+	int status = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!results[i].error)
+			continue;
+		status = -1;
+		// Don't leave a half done transaction to the next SPI user, this
+		// also gives up the bus the asynchronous reports took
+		if (fanout->devs[i].started)
+			mcp2210_cancel_spi_transfer(handles[i], NULL);
+	}
+
+	pthread_mutex_destroy(&fanout->lock);
+	free(fanout);
+	if (error)
+		errno = error;
+	return status;
+}
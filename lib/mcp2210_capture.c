@@ -0,0 +1,565 @@
+/* memory mapped capture files of SPI transfers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+
+// File layout, all fields in host byte order:
+//
+// header page  struct capture_header, padded to header_size
+// segment 0    struct segment_header, then records
+// segment 1    ...
+//
+// Every segment is segment_size bytes. A record is a struct record_header
+// followed by the sent and the received bytes, padded to 8 bytes. Records
+// never cross a segment. A helper thread keeps the segment after the current
+// one allocated and mapped, an unused segment is all zeroes.
+
+#define CAPTURE_MAGIC "MCPCAP1"
+#define SEGMENT_MAGIC 0x4753434d
+// Index entries per segment
+#define INDEX_LEN 64
+
+struct capture_header {
+	char magic[8];
+	uint32_t header_size;
+	uint32_t segment_size;
+};
+
+// A record and the time it was taken
+struct capture_index {
+	uint64_t time_us;
+	uint64_t offset;
+};
+
+struct segment_header {
+	uint32_t magic;
+	uint32_t records;
+	// End of the last complete record, from the start of the segment
+	uint64_t used;
+	uint64_t first_us;
+	uint64_t last_us;
+	// The first record starting in each stretch of index_stride bytes
+	uint32_t index_len;
+	uint32_t index_stride;
+	struct capture_index index[INDEX_LEN];
+};
+
+struct record_header {
+	uint64_t time_us;
+	uint16_t channel;
+	uint16_t send_len;
+	uint16_t recv_len;
+	uint8_t status;
+	uint8_t pad;
+};
+
+#define RECORD_ALIGN 8
+#define DATA_START ((sizeof(struct segment_header) + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1))
+
+static size_t record_size(size_t send_len, size_t recv_len)
+{
+	size_t len = sizeof(struct record_header) + send_len + recv_len;
+	return (len + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+}
+
+static off_t segment_offset(size_t header_size, size_t segment_size, size_t segment)
+{
+	return (off_t) header_size + (off_t) segment * segment_size;
+}
+
+struct mcp2210_capture {
+	pthread_mutex_t lock;
+	int fd;
+	size_t header_size;
+	size_t segment_size;
+	// Only the segment written to is mapped
+	uint8_t *map;
+	size_t segment;
+
+	// The helper thread maps the next segment ahead and unmaps the one left
+	// behind, so writers only swap pointers under the lock
+	pthread_t helper;
+	pthread_cond_t wake;
+	// Segment after the current one, NULL -> not mapped yet
+	uint8_t *next_map;
+	// Segment left behind, NULL -> none
+	uint8_t *retired;
+	// The next segment is to be mapped
+	bool prepare;
+	bool stop;
+	// Wall clock time at mcp2210_now_us() == start_us, record times follow
+	// the monotonic clock so they never go back
+	uint64_t start_us;
+	uint64_t start_real_us;
+};
+
+// Allocate a segment and map it
+static uint8_t *alloc_segment(mcp2210_capture_t *capture, size_t segment)
+{
+	off_t offset = segment_offset(capture->header_size, capture->segment_size, segment);
+	int error = posix_fallocate(capture->fd, offset, capture->segment_size);
+	if (error) {
+		errno = error;
+		return NULL;
+	}
+
+	uint8_t *map = mmap(NULL, capture->segment_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, capture->fd, offset);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+static void unmap_segment(mcp2210_capture_t *capture, uint8_t *map)
+{
+	// Written back by the kernel, no need to wait for it
+	msync(map, capture->segment_size, MS_ASYNC);
+	munmap(map, capture->segment_size);
+}
+
+// Start writing to a mapped segment, called with the lock held
+static void start_segment(mcp2210_capture_t *capture, uint8_t *map, size_t segment)
+{
+	if (capture->map) {
+		// Two segments filled before the helper got to run
+		if (capture->retired)
+			unmap_segment(capture, capture->retired);
+		capture->retired = capture->map;
+	}
+	capture->map = map;
+	capture->segment = segment;
+	capture->prepare = true;
+	pthread_cond_signal(&capture->wake);
+
+	struct segment_header *seg = (struct segment_header *) map;
+	seg->index_stride = (capture->segment_size - DATA_START) / INDEX_LEN;
+	seg->used = DATA_START;
+	__atomic_store_n(&seg->magic, SEGMENT_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Move on to the next segment, called with the lock held. It is normally
+// mapped already, unless the helper fell behind or failed.
+static int next_segment(mcp2210_capture_t *capture)
+{
+	size_t segment = capture->segment + 1;
+	uint8_t *map = capture->next_map;
+	capture->next_map = NULL;
+	if (!map && !(map = alloc_segment(capture, segment)))
+		return -1;
+	start_segment(capture, map, segment);
+	return 0;
+}
+
+static void *helper(void *arg)
+{
+	mcp2210_capture_t *capture = arg;
+
+	pthread_mutex_lock(&capture->lock);
+	while (!capture->stop) {
+		if (!capture->prepare && !capture->retired) {
+			pthread_cond_wait(&capture->wake, &capture->lock);
+			continue;
+		}
+		uint8_t *retired = capture->retired;
+		bool prepare = capture->prepare;
+		size_t segment = capture->segment + 1;
+		capture->retired = NULL;
+		capture->prepare = false;
+		pthread_mutex_unlock(&capture->lock);
+
+		if (retired)
+			unmap_segment(capture, retired);
+		// A failure is left to the writer, which tries again synchronously
+		uint8_t *map = prepare ? alloc_segment(capture, segment) : NULL;
+
+		pthread_mutex_lock(&capture->lock);
+		// The writer may have moved on by itself meanwhile
+		if (map && capture->segment + 1 != segment)
+			munmap(map, capture->segment_size);
+		else if (map)
+			capture->next_map = map;
+	}
+	pthread_mutex_unlock(&capture->lock);
+	return NULL;
+}
+
+mcp2210_capture_t *mcp2210_capture_create(const char *path, size_t segment_size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (!segment_size)
+		segment_size = MCP2210_CAPTURE_SEGMENT_DEFAULT;
+	if (segment_size % page || segment_size < DATA_START + record_size(0, 0) ||
+			segment_size > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mcp2210_capture_t *capture = calloc(1, sizeof(*capture));
+	if (!capture)
+		return NULL;
+	capture->header_size = page;
+	capture->segment_size = segment_size;
+
+	capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == capture->fd)
+		goto err_free;
+
+	struct capture_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.header_size = capture->header_size;
+	header.segment_size = segment_size;
+	if (sizeof(header) != pwrite(capture->fd, &header, sizeof(header), 0))
+		goto err_close;
+
+	uint8_t *map = alloc_segment(capture, 0);
+	if (!map)
+		goto err_close;
+
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->wake, NULL);
+	start_segment(capture, map, 0);
+	int status = pthread_create(&capture->helper, NULL, helper, capture);
+	if (status) {
+		munmap(map, segment_size);
+		pthread_cond_destroy(&capture->wake);
+		pthread_mutex_destroy(&capture->lock);
+		errno = status;
+		goto err_close;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	capture->start_real_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	capture->start_us = mcp2210_now_us();
+	return capture;
+
+err_close:;
+	int error = errno;
+	close(capture->fd);
+	unlink(path);
+	errno = error;
+err_free:
+	free(capture);
+	return NULL;
+}
+
+int mcp2210_capture_write(mcp2210_capture_t *capture, uint16_t channel, uint8_t status,
+    const void *send, size_t send_len, const void *recv, size_t recv_len)
+{
+	size_t len = record_size(send_len, recv_len);
+	if (send_len > UINT16_MAX || recv_len > UINT16_MAX ||
+			len > capture->segment_size - DATA_START) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&capture->lock);
+	struct segment_header *seg = (struct segment_header *) capture->map;
+	if (seg->used + len > capture->segment_size) {
+		if (-1 == next_segment(capture)) {
+			pthread_mutex_unlock(&capture->lock);
+			return -1;
+		}
+		seg = (struct segment_header *) capture->map;
+	}
+
+	uint64_t offset = seg->used;
+	struct record_header *rec = (struct record_header *) (capture->map + offset);
+	rec->time_us = capture->start_real_us + (mcp2210_now_us() - capture->start_us);
+	rec->channel = channel;
+	rec->send_len = send_len;
+	rec->recv_len = recv_len;
+	rec->status = status;
+	uint8_t *data = (uint8_t *) (rec + 1);
+	if (send_len)
+		memcpy(data, send, send_len);
+	if (recv_len)
+		memcpy(data + send_len, recv, recv_len);
+
+	if (seg->index_len < INDEX_LEN &&
+			offset >= DATA_START + (uint64_t) seg->index_len * seg->index_stride) {
+		seg->index[seg->index_len].time_us = rec->time_us;
+		seg->index[seg->index_len].offset = offset;
+		seg->index_len++;
+	}
+	if (!seg->records)
+		seg->first_us = rec->time_us;
+	seg->last_us = rec->time_us;
+	seg->records++;
+	// Publish the record to readers of a live capture
+	__atomic_store_n(&seg->used, offset + len, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&capture->lock);
+	return 0;
+}
+
+int mcp2210_capture_close(mcp2210_capture_t *capture)
+{
+	int status = 0;
+	pthread_mutex_lock(&capture->lock);
+	capture->stop = true;
+	pthread_cond_signal(&capture->wake);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->helper, NULL);
+	if (capture->retired)
+		unmap_segment(capture, capture->retired);
+	if (capture->next_map)
+		munmap(capture->next_map, capture->segment_size);
+
+	// Drop the segment allocated ahead
+	off_t end = segment_offset(capture->header_size, capture->segment_size,
+		capture->segment + 1);
+	if (-1 == msync(capture->map, capture->segment_size, MS_SYNC))
+		status = -1;
+	munmap(capture->map, capture->segment_size);
+	if (-1 == ftruncate(capture->fd, end))
+		status = -1;
+	if (-1 == close(capture->fd))
+		status = -1;
+	pthread_cond_destroy(&capture->wake);
+	pthread_mutex_destroy(&capture->lock);
+	free(capture);
+	return status;
+}
+
+void mcp2210_set_capture(hid_handle_t *handle, mcp2210_capture_t *capture,
+    uint16_t channel)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	pthread_mutex_lock(&state->queue.lock);
+	state->capture = capture;
+	state->capture_channel = channel;
+	// The previous capture may be closed once this returns
+	while (state->capture_writers)
+		pthread_cond_wait(&state->capture_idle, &state->queue.lock);
+	pthread_mutex_unlock(&state->queue.lock);
+}
+
+void mcp2210_capture_transfer(struct mcp2210_state *state, uint8_t status,
+	const void *send, size_t send_len, const void *recv, size_t recv_len)
+{
+	pthread_mutex_lock(&state->queue.lock);
+	mcp2210_capture_t *capture = state->capture;
+	uint16_t channel = state->capture_channel;
+	if (capture)
+		state->capture_writers++;
+	pthread_mutex_unlock(&state->queue.lock);
+	if (!capture)
+		return;
+
+	int result = mcp2210_capture_write(capture, channel, status,
+		send, send_len, recv, recv_len);
+
+	pthread_mutex_lock(&state->queue.lock);
+	// A full disk must not fail the transfer itself
+	if (-1 == result)
+		state->stats.capture_errors++;
+	if (!--state->capture_writers)
+		pthread_cond_broadcast(&state->capture_idle);
+	pthread_mutex_unlock(&state->queue.lock);
+}
+
+struct mcp2210_capture_reader {
+	int fd;
+	size_t header_size;
+	size_t segment_size;
+	// Mapped segment, NULL -> none yet
+	const uint8_t *map;
+	size_t segment;
+	// Next record in the mapped segment
+	uint64_t pos;
+};
+
+mcp2210_capture_reader_t *mcp2210_capture_reader_open(const char *path)
+{
+	mcp2210_capture_reader_t *reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+
+	reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == reader->fd)
+		goto err_free;
+
+	struct capture_header header;
+	ssize_t len = pread(reader->fd, &header, sizeof(header), 0);
+	if (-1 == len)
+		goto err_close;
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (len != sizeof(header) || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+			header.header_size % page || header.segment_size % page ||
+			header.segment_size <= DATA_START) {
+		errno = EINVAL;
+		goto err_close;
+	}
+	reader->header_size = header.header_size;
+	reader->segment_size = header.segment_size;
+	return reader;
+
+err_close:;
+	int error = errno;
+	close(reader->fd);
+	errno = error;
+err_free:
+	free(reader);
+	return NULL;
+}
+
+// Number of segments in the file, it grows while the capture is written
+static ssize_t segment_count(mcp2210_capture_reader_t *reader)
+{
+	struct stat st;
+	if (-1 == fstat(reader->fd, &st))
+		return -1;
+	if ((size_t) st.st_size < reader->header_size)
+		return 0;
+	return (st.st_size - reader->header_size) / reader->segment_size;
+}
+
+// Read the start of a segment header without mapping the segment
+// Returns: 1 -> segment holds records; 0 -> empty or missing; -1 -> error
+static int peek_segment(mcp2210_capture_reader_t *reader, size_t segment,
+	struct segment_header *seg)
+{
+	ssize_t len = pread(reader->fd, seg, offsetof(struct segment_header, index_len),
+		segment_offset(reader->header_size, reader->segment_size, segment));
+	if (-1 == len)
+		return -1;
+	return len == offsetof(struct segment_header, index_len) &&
+		seg->magic == SEGMENT_MAGIC && seg->records;
+}
+
+// Returns: 1 -> mapped; 0 -> no such segment; -1 -> error
+static int map_segment(mcp2210_capture_reader_t *reader, size_t segment)
+{
+	if (reader->map && reader->segment == segment)
+		return 1;
+
+	ssize_t count = segment_count(reader);
+	if (-1 == count)
+		return -1;
+	if (segment >= (size_t) count)
+		return 0;
+
+	void *map = mmap(NULL, reader->segment_size, PROT_READ, MAP_SHARED, reader->fd,
+		segment_offset(reader->header_size, reader->segment_size, segment));
+	if (map == MAP_FAILED)
+		return -1;
+	if (__atomic_load_n(&((const struct segment_header *) map)->magic, __ATOMIC_ACQUIRE) !=
+			SEGMENT_MAGIC) {
+		munmap(map, reader->segment_size);
+		return 0;
+	}
+
+	if (reader->map)
+		munmap((void *) reader->map, reader->segment_size);
+	reader->map = map;
+	reader->segment = segment;
+	reader->pos = DATA_START;
+	return 1;
+}
+
+int mcp2210_capture_seek(mcp2210_capture_reader_t *reader, uint64_t time_us)
+{
+	ssize_t count = segment_count(reader);
+	if (-1 == count)
+		return -1;
+
+	// Last segment starting before the time, segments are in time order.
+	// Records of the time may end the one before a segment starting at it.
+	size_t lo = 0, hi = count;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct segment_header seg;
+		int found = peek_segment(reader, mid, &seg);
+		if (-1 == found)
+			return -1;
+		if (found && seg.first_us < time_us)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	int mapped = map_segment(reader, lo);
+	if (mapped <= 0)
+		return mapped;
+
+	// Last index entry before the time, then a scan of one stride. An entry
+	// at the time may follow earlier records of the same microsecond.
+	const struct segment_header *seg = (const struct segment_header *) reader->map;
+	uint64_t used = __atomic_load_n(&seg->used, __ATOMIC_ACQUIRE);
+	uint32_t index_len = seg->index_len < INDEX_LEN ? seg->index_len : INDEX_LEN;
+	uint64_t pos = DATA_START;
+	for (uint32_t i = 0; i < index_len && seg->index[i].time_us < time_us; ++i)
+		pos = seg->index[i].offset;
+
+	while (pos + sizeof(struct record_header) <= used) {
+		const struct record_header *rec =
+			(const struct record_header *) (reader->map + pos);
+		if (rec->time_us >= time_us)
+			break;
+		pos += record_size(rec->send_len, rec->recv_len);
+	}
+	reader->pos = pos;
+	return 0;
+}
+
+int mcp2210_capture_next(mcp2210_capture_reader_t *reader,
+    mcp2210_capture_record_t *record)
+{
+	if (!reader->map) {
+		int mapped = map_segment(reader, 0);
+		if (mapped <= 0)
+			return mapped;
+	}
+
+	for (;;) {
+		const struct segment_header *seg = (const struct segment_header *) reader->map;
+		uint64_t used = __atomic_load_n(&seg->used, __ATOMIC_ACQUIRE);
+		if (used > reader->segment_size) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		if (reader->pos < used) {
+			const struct record_header *rec =
+				(const struct record_header *) (reader->map + reader->pos);
+			size_t len = record_size(rec->send_len, rec->recv_len);
+			if (used - reader->pos < len) {
+				errno = EPROTO;
+				return -1;
+			}
+			const uint8_t *data = (const uint8_t *) (rec + 1);
+			record->time_us = rec->time_us;
+			record->channel = rec->channel;
+			record->status = rec->status;
+			record->send = data;
+			record->send_len = rec->send_len;
+			record->recv = data + rec->send_len;
+			record->recv_len = rec->recv_len;
+			reader->pos += len;
+			return 1;
+		}
+
+		// The writer only moves on once a record doesn't fit anymore
+		int mapped = map_segment(reader, reader->segment + 1);
+		if (mapped <= 0)
+			return mapped;
+	}
+}
+
+void mcp2210_capture_reader_close(mcp2210_capture_reader_t *reader)
+{
+	if (reader->map)
+		munmap((void *) reader->map, reader->segment_size);
+	close(reader->fd);
+	free(reader);
+}
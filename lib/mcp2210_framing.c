@@ -0,0 +1,407 @@
+/* LSB first and non-byte word framing of SPI transfers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "mcp2210_priv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAMING_X86
+#include <immintrin.h>
+#endif
+
+// Bits reversed in every byte value
+static uint8_t rev8[256];
+
+static bool valid_framing(const mcp2210_framing_t *framing)
+{
+	return (framing->word_bits >= 8 && framing->word_bits <= 16) ||
+		framing->word_bits == 24;
+}
+
+// Bytes of a word in memory
+static size_t word_size(unsigned bits)
+{
+	return bits == 8 ? 1 : bits <= 16 ? 2 : 4;
+}
+
+size_t mcp2210_framed_len(const mcp2210_framing_t *framing, size_t count)
+{
+	if (!valid_framing(framing))
+		return 0;
+	return (count * framing->word_bits + 7) / 8;
+}
+
+////
+// Whole words of 8, 16 and 24 bits are a byte shuffle plus, for LSB first,
+// a bit reversal of every byte. A kernel converts a run of such words.
+////
+
+struct kernel {
+	// Bytes of a word on either side
+	uint8_t in_size, out_size;
+	bool reverse;
+	// Source byte of every output byte in a block of 16, 0x80 -> zero
+	uint8_t shuffle[16];
+};
+
+#define Z 0x80
+static const struct kernel kernels[3][2][2] = {
+	// 8 bits, only LSB first needs converting
+	{ { { 1, 1, false, { 0 } }, { 1, 1, false, { 0 } } },
+	  { { 1, 1, true, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } },
+	    { 1, 1, true, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } } } },
+	// 16 bits: big endian on the wire, LSB first is little endian reversed
+	{ { { 2, 2, false, { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 } },
+	    { 2, 2, false, { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 } } },
+	  { { 2, 2, true, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } },
+	    { 2, 2, true, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } } } },
+	// 24 bits: 4 bytes in memory, 3 on the wire
+	{ { { 4, 3, false, { 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, Z, Z, Z, Z } },
+	    { 3, 4, false, { 2, 1, 0, Z, 5, 4, 3, Z, 8, 7, 6, Z, 11, 10, 9, Z } } },
+	  { { 4, 3, true, { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, Z, Z, Z, Z } },
+	    { 3, 4, true, { 0, 1, 2, Z, 3, 4, 5, Z, 6, 7, 8, Z, 9, 10, 11, Z } } } },
+};
+#undef Z
+
+// Kernel for a framing, NULL if the words don't line up with bytes
+// Direction 0 packs words, 1 unpacks them
+static const struct kernel *find_kernel(const mcp2210_framing_t *framing, int direction)
+{
+	int size = framing->word_bits == 8 ? 0 : framing->word_bits == 16 ? 1 :
+		framing->word_bits == 24 ? 2 : -1;
+	if (size < 0)
+		return NULL;
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	// The shuffles expect little endian words in memory
+	if (size > 0)
+		return NULL;
+#endif
+	return &kernels[size][framing->lsb_first][direction];
+}
+
+// Words one kernel block converts
+static size_t block_words(const struct kernel *k)
+{
+	return (k->in_size == 3 ? 12 : 16) / k->in_size;
+}
+
+static size_t scalar_kernel(const struct kernel *k, uint8_t *dst, const uint8_t *src, size_t words)
+{
+	size_t block = block_words(k);
+	for (size_t i = 0; i + block <= words; i += block) {
+		for (size_t j = 0; j < 16; ++j) {
+			if (k->shuffle[j] & 0x80) {
+				if (j < block * k->out_size)
+					dst[j] = 0;
+				continue;
+			}
+			if (j >= block * k->out_size)
+				continue;
+			uint8_t byte = src[k->shuffle[j]];
+			dst[j] = k->reverse ? rev8[byte] : byte;
+		}
+		src += block * k->in_size;
+		dst += block * k->out_size;
+	}
+	return words / block * block;
+}
+
+#ifdef FRAMING_X86
+__attribute__((target("ssse3")))
+static __m128i reverse_128(__m128i v)
+{
+	const __m128i lo_rev = _mm_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f);
+	const __m128i hi_rev = _mm_slli_epi16(lo_rev, 4);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	// The reversed low nibble becomes the high one and the other way round
+	__m128i lo = _mm_and_si128(v, nibble);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+	return _mm_or_si128(_mm_shuffle_epi8(hi_rev, lo), _mm_shuffle_epi8(lo_rev, hi));
+}
+
+__attribute__((target("ssse3")))
+static size_t ssse3_kernel(const struct kernel *k, uint8_t *dst, const uint8_t *src, size_t words)
+{
+	size_t block = block_words(k), done = 0;
+	const __m128i shuffle = _mm_loadu_si128((const __m128i *) k->shuffle);
+	// Every block loads and stores 16 bytes, stay inside both buffers
+	size_t min_size = k->in_size < k->out_size ? k->in_size : k->out_size;
+	for (; words - done >= block && (words - done) * min_size >= 16; done += block) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + done * k->in_size));
+		v = _mm_shuffle_epi8(v, shuffle);
+		if (k->reverse)
+			v = reverse_128(v);
+		_mm_storeu_si128((__m128i *) (dst + done * k->out_size), v);
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static __m256i reverse_256(__m256i v)
+{
+	const __m256i lo_rev = _mm256_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f,
+		0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f);
+	const __m256i hi_rev = _mm256_slli_epi16(lo_rev, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(v, nibble);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+	return _mm256_or_si256(_mm256_shuffle_epi8(hi_rev, lo), _mm256_shuffle_epi8(lo_rev, hi));
+}
+
+// The shuffle stays within 128 bit lanes, which only works while words
+// keep their size. 24 bit words are left to SSSE3.
+__attribute__((target("avx2")))
+static size_t avx2_kernel(const struct kernel *k, uint8_t *dst, const uint8_t *src, size_t words)
+{
+	if (k->in_size != k->out_size)
+		return ssse3_kernel(k, dst, src, words);
+
+	size_t step = 32 / k->in_size, done = 0;
+	const __m256i shuffle = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) k->shuffle));
+	for (; words - done >= step; done += step) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + done * k->in_size));
+		v = _mm256_shuffle_epi8(v, shuffle);
+		if (k->reverse)
+			v = reverse_256(v);
+		_mm256_storeu_si256((__m256i *) (dst + done * k->out_size), v);
+	}
+	return done + ssse3_kernel(k, dst + done * k->out_size,
+		src + done * k->in_size, words - done);
+}
+#endif
+
+// Best kernel of the CPU, picked once
+static size_t (*run_kernel)(const struct kernel *k, uint8_t *dst,
+	const uint8_t *src, size_t words);
+static pthread_once_t framing_once = PTHREAD_ONCE_INIT;
+
+static void framing_init(void)
+{
+	for (unsigned i = 0; i < 256; ++i) {
+		uint8_t r = 0;
+		for (unsigned bit = 0; bit < 8; ++bit)
+			r |= ((i >> bit) & 1) << (7 - bit);
+		rev8[i] = r;
+	}
+
+	run_kernel = scalar_kernel;
+#ifdef FRAMING_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		run_kernel = avx2_kernel;
+	else if (__builtin_cpu_supports("ssse3"))
+		run_kernel = ssse3_kernel;
+#endif
+}
+
+// Convert words with the kernel as far as it goes, the rest one by one
+static size_t convert_words(const struct kernel *k, uint8_t *dst, const uint8_t *src, size_t words)
+{
+	if (!k->reverse && k->in_size == 1) {
+		memcpy(dst, src, words);
+		return words;
+	}
+	return run_kernel(k, dst, src, words);
+}
+
+////
+// Words of any size go through a bit accumulator, which also carries
+// partial words from one report to the next
+////
+
+// Bits of a word in the order they go on the wire
+static uint32_t wire_bits(const mcp2210_framing_t *framing, uint32_t value)
+{
+	unsigned bits = framing->word_bits;
+	value &= (uint32_t) -1 >> (32 - bits);
+	if (!framing->lsb_first)
+		return value;
+	uint32_t r = (uint32_t) rev8[value & 0xff] << 24 | (uint32_t) rev8[value >> 8 & 0xff] << 16 |
+		(uint32_t) rev8[value >> 16 & 0xff] << 8;
+	return r >> (32 - bits);
+}
+
+static uint32_t load_word(const mcp2210_framing_t *framing, const void *words, size_t i)
+{
+	switch (word_size(framing->word_bits)) {
+	case 1:
+		return ((const uint8_t *) words)[i];
+	case 2:
+		return ((const uint16_t *) words)[i];
+	default:
+		return ((const uint32_t *) words)[i];
+	}
+}
+
+static void store_word(const mcp2210_framing_t *framing, void *words, size_t i, uint32_t value)
+{
+	switch (word_size(framing->word_bits)) {
+	case 1:
+		((uint8_t *) words)[i] = value;
+		break;
+	case 2:
+		((uint16_t *) words)[i] = value;
+		break;
+	default:
+		((uint32_t *) words)[i] = value;
+		break;
+	}
+}
+
+// Position in a buffer of words being packed or unpacked
+struct codec {
+	mcp2210_framing_t framing;
+	const struct kernel *kernel;
+	uint8_t *words;
+	size_t count, word;
+	// Bits not yet stored, right aligned
+	uint64_t acc;
+	unsigned bits;
+};
+
+static int codec_init(struct codec *c, const mcp2210_framing_t *framing, int direction,
+	const void *words, size_t count)
+{
+	if (!valid_framing(framing)) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&framing_once, framing_init);
+	memset(c, 0, sizeof(*c));
+	c->framing = *framing;
+	c->kernel = find_kernel(framing, direction);
+	c->words = (uint8_t *) words;
+	c->count = count;
+	return 0;
+}
+
+// Produce up to len bytes of the wire format
+static size_t codec_pack(struct codec *c, uint8_t *out, size_t len)
+{
+	unsigned bits = c->framing.word_bits;
+	size_t n = 0;
+
+	for (;;) {
+		while (c->bits >= 8 && n < len) {
+			out[n++] = c->acc >> (c->bits - 8);
+			c->bits -= 8;
+		}
+		if (n == len)
+			break;
+		if (c->word == c->count) {
+			// Zero bits fill up the last byte
+			if (c->bits) {
+				out[n++] = c->acc << (8 - c->bits);
+				c->bits = 0;
+			}
+			break;
+		}
+
+		if (c->kernel && !c->bits) {
+			const struct kernel *k = c->kernel;
+			size_t words = (len - n) / k->out_size;
+			if (words > c->count - c->word)
+				words = c->count - c->word;
+			words = convert_words(k, out + n, c->words + c->word * k->in_size, words);
+			n += words * k->out_size;
+			c->word += words;
+			if (words)
+				continue;
+		}
+
+		c->acc = c->acc << bits | wire_bits(&c->framing, load_word(&c->framing, c->words, c->word));
+		c->bits += bits;
+		c->word++;
+	}
+	return n;
+}
+
+// Take len bytes of the wire format, bytes after the last word are ignored
+static void codec_unpack(struct codec *c, const uint8_t *in, size_t len)
+{
+	unsigned bits = c->framing.word_bits;
+	size_t i = 0;
+
+	while (i < len && c->word < c->count) {
+		if (c->kernel && !c->bits) {
+			const struct kernel *k = c->kernel;
+			size_t words = (len - i) / k->in_size;
+			if (words > c->count - c->word)
+				words = c->count - c->word;
+			words = convert_words(k, c->words + c->word * k->out_size, in + i, words);
+			i += words * k->in_size;
+			c->word += words;
+			if (words)
+				continue;
+		}
+
+		c->acc = c->acc << 8 | in[i++];
+		c->bits += 8;
+		if (c->bits >= bits) {
+			// LSB first words are reversed the same way back
+			uint32_t value = wire_bits(&c->framing, c->acc >> (c->bits - bits));
+			store_word(&c->framing, c->words, c->word++, value);
+			c->bits -= bits;
+		}
+	}
+}
+
+int mcp2210_frame_pack(const mcp2210_framing_t *framing, const void *words,
+    size_t count, void *wire)
+{
+	struct codec c;
+	if (-1 == codec_init(&c, framing, 0, words, count))
+		return -1;
+	codec_pack(&c, wire, mcp2210_framed_len(framing, count));
+	return 0;
+}
+
+int mcp2210_frame_unpack(const mcp2210_framing_t *framing, const void *wire,
+    void *words, size_t count)
+{
+	struct codec c;
+	if (-1 == codec_init(&c, framing, 1, words, count))
+		return -1;
+	codec_unpack(&c, wire, mcp2210_framed_len(framing, count));
+	return 0;
+}
+
+// Words as the stream of a transaction, converted report by report
+struct words_stream {
+	struct codec send, recv;
+};
+
+static size_t words_fill(void *ctx, uint8_t *data, size_t len)
+{
+	struct words_stream *ws = ctx;
+	return codec_pack(&ws->send, data, len);
+}
+
+static int words_drain(void *ctx, const uint8_t *data, size_t len)
+{
+	struct words_stream *ws = ctx;
+	codec_unpack(&ws->recv, data, len);
+	return 0;
+}
+
+ssize_t mcp2210_spi_transaction_words(hid_handle_t *handle, int priority,
+    const mcp2210_framing_t *framing, const void *send, void *recv, size_t count)
+{
+	struct words_stream ws;
+	if (-1 == codec_init(&ws.send, framing, 0, send, count) ||
+			-1 == codec_init(&ws.recv, framing, 1, recv, count))
+		return -1;
+
+	struct mcp2210_spi_stream stream = { words_fill, words_drain, &ws };
+	if (-1 == mcp2210_spi_stream(handle, priority, &stream))
+		return -1;
+	return ws.recv.word;
+}
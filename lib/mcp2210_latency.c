@@ -0,0 +1,88 @@
+/* low latency mode: busy polling, USB autosuspend and CPU pinning */
+#ifdef __linux__
+// sched_setaffinity
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+
+int hid_power_keep_on(struct hid_power *power)
+{
+	power->saved[0] = '\0';
+
+	FILE *file = fopen(power->control, "r");
+	if (!file)
+		return -1;
+	char value[sizeof(power->saved)] = "";
+	if (fgets(value, sizeof(value), file))
+		value[strcspn(value, "\n")] = '\0';
+	fclose(file);
+
+	// Nothing to undo, and no write access needed, if udev already did it
+	if (!strcmp(value, "on"))
+		return 0;
+
+	file = fopen(power->control, "w");
+	if (!file)
+		return -1;
+	if (EOF == fputs("on", file)) {
+		int error = errno;
+		fclose(file);
+		errno = error;
+		return -1;
+	}
+	if (EOF == fclose(file))
+		return -1;
+	strcpy(power->saved, value);
+	return 0;
+}
+
+void hid_power_restore(struct hid_power *power)
+{
+	if (!power->saved[0])
+		return;
+
+	FILE *file = fopen(power->control, "w");
+	if (file) {
+		fputs(power->saved, file);
+		fclose(file);
+	}
+	power->saved[0] = '\0';
+}
+
+int mcp2210_set_low_latency(hid_handle_t *handle, uint32_t spin_us)
+{
+	if (-1 == hid_set_low_latency(handle, spin_us))
+		return -1;
+
+	struct mcp2210_state *state = hid_state(handle);
+	pthread_mutex_lock(&state->queue.lock);
+	state->low_latency = spin_us != 0;
+	pthread_mutex_unlock(&state->queue.lock);
+	return 0;
+}
+
+int mcp2210_pin_thread(int cpu)
+{
+#ifdef __linux__
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+#else
+	(void) cpu;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
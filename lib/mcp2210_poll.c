@@ -0,0 +1,144 @@
+/* polling slave status registers until a condition holds */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "mcp2210_priv.h"
+
+// Waits shorter than this poll right away instead of sleeping
+#define POLL_MIN_WAIT_US 20
+// Past the learned completion time, or without one, wait 1/2^n of the time
+// elapsed beyond it between polls
+#define POLL_GAP_SHIFT 4
+// Wake up 1/2^n of the learned completion time early
+#define POLL_EARLY_SHIFT 3
+
+static bool poll_matches(const mcp2210_poll_t *poll, const uint8_t *recv)
+{
+	const uint8_t *mask = poll->mask, *value = poll->value;
+	for (size_t i = 0; i < poll->len; i++)
+		if ((recv[i] & mask[i]) != value[i])
+			return false;
+	return true;
+}
+
+static void sleep_until(uint64_t at)
+{
+	uint64_t now = mcp2210_now_us();
+	if (at >= now + POLL_MIN_WAIT_US)
+		mcp2210_sleep_us(at - now);
+}
+
+// Time to wait after a poll that missed, elapsed after the start of the
+// call. Before the learned completion time the gap halves the distance to
+// it, after it grows with the overrun. It is at least a round trip so the
+// polls don't flood the bus.
+static uint64_t poll_gap(uint64_t elapsed, uint32_t estimate, uint32_t rtt)
+{
+	uint64_t gap;
+	if (elapsed < estimate)
+		gap = (estimate - elapsed) / 2;
+	else
+		gap = (elapsed - estimate) >> POLL_GAP_SHIFT;
+	return gap > rtt ? gap : rtt;
+}
+
+// Move a learned time an eighth towards a sample, the first sample is taken
+// as it is. Called with the queue lock held.
+static void learn(uint32_t *estimate, uint64_t sample)
+{
+	if (sample > UINT32_MAX)
+		sample = UINT32_MAX;
+	if (!*estimate)
+		*estimate = sample ? sample : 1;
+	else
+		*estimate += ((int64_t) sample - *estimate) / 8;
+}
+
+int mcp2210_spi_poll(hid_handle_t *handle, int priority,
+	const mcp2210_poll_t *poll, void *recv, mcp2210_poll_result_t *result)
+{
+	uint64_t start = mcp2210_now_us();
+	if (poll->slot >= MCP2210_POLL_SLOTS || !poll->len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct mcp2210_state *state = hid_state(handle);
+	pthread_mutex_lock(&state->queue.lock);
+	uint32_t estimate = state->stats.poll_estimate_us[poll->slot];
+	uint32_t rtt = state->poll_rtt_us;
+	pthread_mutex_unlock(&state->queue.lock);
+
+	// A poll reads the status about half a round trip after it was sent.
+	// Sleep through most of an operation of known length.
+	uint64_t next = start;
+	uint32_t wake = estimate - (estimate >> POLL_EARLY_SHIFT);
+	if (wake > rtt / 2)
+		next += wake - rtt / 2;
+
+	uint64_t deadline = start + poll->timeout_us;
+	uint32_t polls = 0;
+	// Time after start the last poll that missed read the status
+	uint64_t missed = 0;
+	uint64_t now = start;
+	int error = 0;
+	for (;;) {
+		sleep_until(next < deadline ? next : deadline);
+
+		uint64_t sent = mcp2210_now_us();
+		ssize_t received = mcp2210_spi_transaction(handle, priority,
+			poll->send, poll->len, recv, poll->len);
+		now = mcp2210_now_us();
+		if (received == -1) {
+			error = errno;
+			break;
+		}
+		polls++;
+		if ((size_t) received < poll->len) {
+			error = EPROTO;
+			break;
+		}
+
+		uint64_t sampled = (sent + now) / 2 - start;
+		pthread_mutex_lock(&state->queue.lock);
+		learn(&state->poll_rtt_us, now - sent);
+		rtt = state->poll_rtt_us;
+		pthread_mutex_unlock(&state->queue.lock);
+
+		if (poll_matches(poll, recv)) {
+			// The operation finished between the last miss and this poll
+			uint64_t done = polls > 1 ? (missed + sampled) / 2 : sampled;
+			pthread_mutex_lock(&state->queue.lock);
+			learn(&state->stats.poll_estimate_us[poll->slot], done);
+			pthread_mutex_unlock(&state->queue.lock);
+			break;
+		}
+		missed = sampled;
+
+		if (now >= deadline) {
+			error = ETIMEDOUT;
+			break;
+		}
+		next = now + poll_gap(now - start, estimate, rtt);
+	}
+
+	pthread_mutex_lock(&state->queue.lock);
+	state->stats.polls += polls;
+	if (error == ETIMEDOUT)
+		state->stats.poll_timeouts++;
+	pthread_mutex_unlock(&state->queue.lock);
+
+	if (result) {
+		result->polls = polls;
+		result->elapsed_us = now - start;
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,255 @@
+/* libmcp internal per-device state, not part of the public API */
+#ifndef MCP2210_PRIV_H
+#define MCP2210_PRIV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "mcp2210.h"
+
+// A thread, or the asynchronous commands of a device, waiting for a turn
+struct mcp2210_waiter {
+	pthread_cond_t cond;
+	int priority;
+	bool spi;
+	const void *spi_owner;
+	// Handed to the event loop instead of waking a thread
+	bool async;
+	uint64_t since;
+	// Set by the dispatcher when it is this waiter's turn
+	bool ready;
+	struct mcp2210_waiter *next;
+};
+
+// Serializes all commands on a device, see mcp2210_queue.c. The lock also
+// protects the statistics.
+struct mcp2210_queue {
+	pthread_mutex_t lock;
+	// A report is on the wire
+	bool busy;
+	// Transaction owning the SPI bus, other SPI transfers wait for it
+	const void *spi_owner;
+	// Waiters per class, oldest first
+	struct mcp2210_waiter *waiting[MCP2210_CLASSES];
+	size_t depth;
+	// Stands in for the first asynchronous command of the device. Its address
+	// is the bus owner of the asynchronous SPI transfers of the device.
+	struct mcp2210_waiter async_waiter;
+	uint32_t aging_us;
+};
+
+// Kept inside every hid_handle_t by the HID backends
+struct mcp2210_state {
+	// Counters reported by mcp2210_get_stats
+	mcp2210_stats_t stats;
+	// Give up retrying a busy command after this many microseconds
+	uint32_t retry_timeout_us;
+	// Cancel stuck transfers after this many microseconds, 0 -> disabled,
+	// under the queue lock
+	uint32_t watchdog_us;
+	// Time the last unfinished SPI transfer was sent, 0 -> none, under the
+	// queue lock
+	uint64_t transfer_active;
+	// Command queue of the blocking calls
+	struct mcp2210_queue queue;
+	// Asynchronous commands, the first one is in flight
+	mcp2210_async_t *async_head, *async_tail;
+	// Capture recording the SPI transfers, NULL -> none
+	mcp2210_capture_t *capture;
+	uint16_t capture_channel;
+	// Transfers writing to the capture, mcp2210_set_capture waits on
+	// capture_idle until they are done. Under the queue lock.
+	unsigned capture_writers;
+	pthread_cond_t capture_idle;
+	// Round trips are counted in the low latency histogram
+	bool low_latency;
+	// Learned time of a status transaction of mcp2210_spi_poll, 0 -> none yet
+	uint32_t poll_rtt_us;
+	// Next command number of the probes
+	uint64_t trace_seq;
+};
+
+// Called by the backends when a handle is created and destroyed
+void mcp2210_state_init(struct mcp2210_state *state);
+void mcp2210_state_fini(struct mcp2210_state *state);
+
+void mcp2210_queue_init(struct mcp2210_queue *queue);
+void mcp2210_queue_fini(struct mcp2210_queue *queue);
+
+// Wait for the turn to send one report. SPI transfers wait while another
+// transaction holds the bus, a transfer with a spi_owner takes the bus until
+// it is released. Plain transfers pass NULL.
+void mcp2210_queue_enter(struct mcp2210_state *state, int priority,
+	bool spi, const void *spi_owner);
+// Ask for a turn for the first asynchronous command of the device without
+// waiting. If it isn't granted right away mcp2210_async_turn is called once
+// it is, from the thread giving up the device. An SPI transfer takes the bus
+// for the asynchronous commands until it is released with
+// mcp2210_queue_release_async_spi.
+// Returns: true -> granted
+bool mcp2210_queue_enter_async(struct mcp2210_state *state, int priority, bool spi);
+// Let the next report go
+void mcp2210_queue_leave(struct mcp2210_state *state);
+// End the transaction of owner, if it holds the bus
+void mcp2210_queue_release_spi(struct mcp2210_state *state, const void *owner);
+// End the asynchronous SPI transfer of the device, if it holds the bus
+void mcp2210_queue_release_async_spi(struct mcp2210_state *state);
+
+// Hand the first asynchronous command of a device to the event loop, called
+// with the queue lock held
+void mcp2210_async_turn(struct mcp2210_state *state);
+
+// Event loop of the asynchronous commands, kept inside every hid_context_t.
+// See mcp2210_async.c.
+struct mcp2210_loop {
+	pthread_mutex_t lock;
+	// Signalled when the loop completed commands or stopped
+	pthread_cond_t cond;
+	bool running;
+	pthread_t thread;
+	// Commands that got their turn on the device and wait to be sent
+	mcp2210_async_t *ready_head, *ready_tail;
+	// Exchanges that finished, with op->error set by the backend
+	mcp2210_async_t *done_head, *done_tail;
+	// Commands waiting for their backoff to run out, sorted by due time
+	mcp2210_async_t *retry_queue;
+	// Commands completed so far, for the return value of mcp2210_handle_events
+	unsigned completed;
+	// Commands submitted and not completed yet
+	size_t in_flight;
+	int wake_fds[2];
+	// Owned by the thread running the loop
+	struct pollfd *fds;
+	size_t fds_len;
+};
+
+// Called by the backends when a context is created and destroyed
+// Returns: 0 -> success; -1 -> error, errno is set
+int mcp2210_loop_init(struct mcp2210_loop *loop);
+void mcp2210_loop_fini(struct mcp2210_loop *loop);
+
+// Default priority class of a command
+int mcp2210_cmd_priority(uint8_t opcode);
+
+// Memory of the HID backends, from the arena of hid_init_arena if there is
+// one and the heap otherwise. It comes zeroed. Memory given back to the
+// arena is reused by allocations of the same size.
+void *hid_arena_alloc(size_t size);
+void hid_arena_free(void *ptr, size_t size);
+// Same for handles, which are reused after they are freed
+void *hid_alloc_handle(size_t size);
+void hid_free_handle(void *ptr);
+// Bytes of arena an allocation takes
+size_t hid_arena_cost(size_t size);
+// Forget the arena, called by hid_fini
+void hid_arena_release(void);
+
+// USB autosuspend setting of a device, see mcp2210_latency.c
+struct hid_power {
+	// Path of the power/control attribute in sysfs
+	char control[128];
+	// Value before the low latency mode, empty -> nothing to restore
+	char saved[16];
+};
+
+// Keep the device out of runtime suspend, remembering the old setting
+// Returns: 0 -> success; -1 -> error, errno is set
+int hid_power_keep_on(struct hid_power *power);
+void hid_power_restore(struct hid_power *power);
+
+// Monotonic time used throughout the library
+uint64_t mcp2210_now_us(void);
+// Sleep, carrying on after signals
+void mcp2210_sleep_us(uint32_t us);
+
+// Outcomes of mcp2210_check_resp
+#define MCP2210_RESP_OK   0
+#define MCP2210_RESP_BUSY 1
+
+// Check a response against its command and count it in the statistics
+// Returns: one of the outcomes above; -1 -> error, errno is set
+int mcp2210_check_resp(struct mcp2210_state *state, const uint8_t *cmd, const uint8_t *resp);
+
+// Called after a busy response
+// Returns: microseconds to wait before resending; -1 -> deadline expired
+int64_t mcp2210_retry_next(struct mcp2210_state *state, mcp2210_retry_t *retry);
+// Called once the command went through
+void mcp2210_retry_done(struct mcp2210_state *state, mcp2210_retry_t *retry);
+
+// Bytes of an SPI transaction produced and consumed report by report
+struct mcp2210_spi_stream {
+	// Store up to len bytes to send next, 0 once everything was sent
+	size_t (*fill)(void *ctx, uint8_t *data, size_t len);
+	// Take received bytes
+	// Returns: 0 -> success; -1 -> abort the transaction, errno is set
+	int (*drain)(void *ctx, const uint8_t *data, size_t len);
+	void *ctx;
+};
+
+// Run a transaction like mcp2210_spi_transaction on a stream
+// Returns: number of bytes received; -1 -> error, errno is set
+ssize_t mcp2210_spi_stream(hid_handle_t *handle, int priority,
+	const struct mcp2210_spi_stream *stream);
+
+// Count the time from writing a command until its response was read
+void mcp2210_record_rtt(struct mcp2210_state *state, uint64_t rtt_us);
+
+// Remember whether an SPI transaction was left unfinished
+void mcp2210_track_transfer(struct mcp2210_state *state, const uint8_t *resp);
+
+// Forget the unfinished transaction after it was cancelled
+void mcp2210_clear_transfer(struct mcp2210_state *state);
+
+// Record a finished transfer if the device has a capture
+void mcp2210_capture_transfer(struct mcp2210_state *state, uint8_t status,
+	const void *send, size_t send_len, const void *recv, size_t recv_len);
+
+////
+// USDT probes of the provider "libmcp", built with USE_SDT=1. A probe is a
+// single nop until a tracer attaches, without USE_SDT they compile away.
+//
+// cmd_submit       handle, sequence number, opcode, payload length
+// cmd_response     handle, sequence number, opcode, status, payload length
+// hid_write_entry  handle, length
+// hid_write_return handle, result
+// hid_read_entry   handle, length
+// hid_read_return  handle, result
+// enumerate_entry  vid, pid
+// enumerate_return device count or -1
+//
+// Many commands of a handle may be in flight, a response carries the
+// sequence number of the command it answers. The HID probes fire in the
+// thread of the command, between its cmd_submit and cmd_response.
+////
+
+#ifdef MCP2210_SDT
+#include <sys/sdt.h>
+#define MCP2210_TRACE1(name, a)          DTRACE_PROBE1(libmcp, name, a)
+#define MCP2210_TRACE2(name, a, b)       DTRACE_PROBE2(libmcp, name, a, b)
+#define MCP2210_TRACE3(name, a, b, c)    DTRACE_PROBE3(libmcp, name, a, b, c)
+#define MCP2210_TRACE4(name, a, b, c, d) DTRACE_PROBE4(libmcp, name, a, b, c, d)
+#define MCP2210_TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(libmcp, name, a, b, c, d, e)
+#else
+// The arguments still count as used, they have no side effects
+#define MCP2210_TRACE1(name, a)          do { (void) (a); } while (0)
+#define MCP2210_TRACE2(name, a, b)       do { (void) (a); (void) (b); } while (0)
+#define MCP2210_TRACE3(name, a, b, c)    do { (void) (a); (void) (b); (void) (c); } while (0)
+#define MCP2210_TRACE4(name, a, b, c, d) \
+	do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#define MCP2210_TRACE5(name, a, b, c, d, e) \
+	do { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } while (0)
+#endif
+
+// Number a command for the probes
+static inline uint64_t mcp2210_trace_seq(struct mcp2210_state *state)
+{
+#ifdef MCP2210_SDT
+	return __atomic_fetch_add(&state->trace_seq, 1, __ATOMIC_RELAXED);
+#else
+	(void) state;
+	return 0;
+#endif
+}
+
+#endif
@@ -0,0 +1,369 @@
+/* precompiled sequences of SPI transfers and GPIO changes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mcp2210_priv.h"
+
+// Payload of a report after the 4 header bytes
+#define REPORT_DATA (MCP2210_REPORT_SIZE - 4)
+
+// One settings or GPIO report, or the reports of a transfer
+struct program_op {
+	int type;
+	size_t report;
+	size_t reports;
+	// Transfers only
+	size_t send_len;
+	size_t recv_len;
+	int slot;
+};
+
+struct mcp2210_program {
+	struct program_op *ops;
+	size_t op_count;
+	uint8_t (*reports)[MCP2210_REPORT_SIZE];
+	size_t report_count;
+	size_t recv_len;
+	// Continues a transfer once all data is sent
+	uint8_t poll[MCP2210_REPORT_SIZE];
+	uint8_t cancel[MCP2210_REPORT_SIZE];
+};
+
+static size_t transfer_reports(const mcp2210_step_t *step)
+{
+	return (step->send_len + step->recv_len + REPORT_DATA - 1) / REPORT_DATA;
+}
+
+// Validate the steps and count the reports they need at most
+static int check_steps(const mcp2210_step_t *steps, size_t count, size_t *reports)
+{
+	bool have_settings = false;
+	*reports = 0;
+
+	if (!count)
+		goto err;
+
+	for (size_t i = 0; i < count; ++i) {
+		const mcp2210_step_t *step = &steps[i];
+		size_t len = step->send_len + step->recv_len;
+
+		switch (step->type) {
+		case MCP2210_STEP_SETTINGS:
+			have_settings = true;
+			break;
+		case MCP2210_STEP_GPIO:
+			*reports += 1;
+			break;
+		case MCP2210_STEP_TRANSFER:
+			if (!have_settings || !len || len > UINT16_MAX || step->slot < 0)
+				goto err;
+			if (!step->send && !step->slot && step->send_len)
+				goto err;
+			// Every transfer of a slot sends the same number of bytes
+			for (size_t j = 0; j < i && step->slot; ++j) {
+				if (steps[j].type == MCP2210_STEP_TRANSFER &&
+						steps[j].slot == step->slot &&
+						steps[j].send_len != step->send_len)
+					goto err;
+			}
+			// Possibly a settings report before the transfer
+			*reports += 1 + transfer_reports(step);
+			break;
+		default:
+			goto err;
+		}
+	}
+
+	// Only settings, nothing to run
+	if (!*reports)
+		goto err;
+	return 0;
+
+err:
+	errno = EINVAL;
+	return -1;
+}
+
+static uint8_t *new_report(mcp2210_program_t *program, uint8_t opcode, uint8_t arg)
+{
+	uint8_t *report = program->reports[program->report_count++];
+	memset(report, 0, MCP2210_REPORT_SIZE);
+	report[0] = opcode;
+	report[1] = arg;
+	return report;
+}
+
+static struct program_op *new_op(mcp2210_program_t *program, int type)
+{
+	struct program_op *op = &program->ops[program->op_count++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->report = program->report_count;
+	op->reports = 1;
+	return op;
+}
+
+// Store the send data of a transfer in its reports
+static void encode_send(mcp2210_program_t *program, const struct program_op *op,
+	const void *send)
+{
+	for (size_t done = 0; done < op->send_len; done += REPORT_DATA) {
+		size_t chunk = op->send_len - done;
+		if (chunk > REPORT_DATA)
+			chunk = REPORT_DATA;
+		uint8_t *report = program->reports[op->report + done / REPORT_DATA];
+		if (send)
+			memcpy(report + 4, (const uint8_t *) send + done, chunk);
+		else
+			memset(report + 4, 0, chunk);
+	}
+}
+
+static void compile_transfer(mcp2210_program_t *program, const mcp2210_step_t *step)
+{
+	struct program_op *op = new_op(program, MCP2210_STEP_TRANSFER);
+	size_t len = step->send_len + step->recv_len;
+
+	op->reports = transfer_reports(step);
+	op->send_len = step->send_len;
+	op->recv_len = step->recv_len;
+	op->slot = step->slot;
+
+	for (size_t i = 0; i < op->reports; ++i) {
+		size_t chunk = len - i * REPORT_DATA;
+		if (chunk > REPORT_DATA)
+			chunk = REPORT_DATA;
+		new_report(program, MCP2210_CMD_TRANSFER_SPI_DATA, chunk);
+	}
+	encode_send(program, op, step->send);
+	program->recv_len += step->recv_len;
+}
+
+// Encode every report up front
+mcp2210_program_t *mcp2210_program_compile(const mcp2210_step_t *steps, size_t count)
+{
+	size_t max_reports;
+	if (-1 == check_steps(steps, count, &max_reports))
+		return NULL;
+
+	mcp2210_program_t *program = calloc(1, sizeof(*program));
+	if (!program)
+		return NULL;
+	// A transfer needs at most a settings op and its own
+	program->ops = malloc(2 * count * sizeof(*program->ops));
+	if (!program->ops)
+		goto err;
+	program->reports = malloc(max_reports * sizeof(*program->reports));
+	if (!program->reports)
+		goto err;
+
+	program->poll[0] = MCP2210_CMD_TRANSFER_SPI_DATA;
+	program->cancel[0] = MCP2210_CMD_CANCEL_SPI_TRANSFER;
+
+	mcp2210_spi_settings_t settings, sent;
+	bool have_sent = false;
+
+	for (size_t i = 0; i < count; ++i) {
+		const mcp2210_step_t *step = &steps[i];
+		uint8_t *report;
+
+		switch (step->type) {
+		case MCP2210_STEP_SETTINGS:
+			settings = step->settings;
+			break;
+		case MCP2210_STEP_GPIO:
+			new_op(program, MCP2210_STEP_GPIO);
+			report = new_report(program, MCP2210_CMD_SET_GPIO_VALUE, 0);
+			report[4] = step->gpio & 0xff;
+			report[5] = step->gpio >> 8;
+			break;
+		case MCP2210_STEP_TRANSFER:
+			settings.active_cs = b16(step->active_cs);
+			settings.bytes_per_transaction = b16(step->send_len + step->recv_len);
+			// The chip still has the settings of the previous transfer
+			if (!have_sent || memcmp(&settings, &sent, sizeof(settings))) {
+				new_op(program, MCP2210_STEP_SETTINGS);
+				report = new_report(program, MCP2210_CMD_SET_SPI_SETTINGS, 0);
+				memcpy(report + 4, &settings, sizeof(settings));
+				sent = settings;
+				have_sent = true;
+			}
+			compile_transfer(program, step);
+			break;
+		}
+	}
+	return program;
+
+err:
+	mcp2210_program_free(program);
+	return NULL;
+}
+
+int mcp2210_program_patch(mcp2210_program_t *program, int slot,
+    const void *data, size_t data_len)
+{
+	bool found = false;
+
+	for (size_t i = 0; i < program->op_count; ++i) {
+		struct program_op *op = &program->ops[i];
+		if (op->type != MCP2210_STEP_TRANSFER || !slot || op->slot != slot)
+			continue;
+		// Compiling made sure all of them have the same length
+		if (data_len != op->send_len) {
+			errno = EINVAL;
+			return -1;
+		}
+		encode_send(program, op, data);
+		found = true;
+	}
+
+	if (!found) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+size_t mcp2210_program_recv_len(const mcp2210_program_t *program)
+{
+	return program->recv_len;
+}
+
+// Send one report, resending it while the chip is busy. The device stays
+// with the program in the meantime.
+static int run_report(hid_handle_t *handle, uint8_t *cmd, uint8_t *resp)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	mcp2210_retry_t retry = { 0, 0, 0 };
+
+	for (;;) {
+		uint64_t seq = mcp2210_trace_seq(state);
+		MCP2210_TRACE4(cmd_submit, handle, seq, cmd[0], cmd[1]);
+		uint64_t start = mcp2210_now_us();
+		if (-1 == hid_write(handle, cmd, MCP2210_REPORT_SIZE))
+			return -1;
+		if (-1 == hid_read(handle, resp, MCP2210_REPORT_SIZE))
+			return -1;
+		mcp2210_record_rtt(state, mcp2210_now_us() - start);
+		MCP2210_TRACE5(cmd_response, handle, seq, resp[0], resp[1], resp[2]);
+
+		switch (mcp2210_check_resp(state, cmd, resp)) {
+		case MCP2210_RESP_OK:
+			mcp2210_retry_done(state, &retry);
+			return 0;
+		case MCP2210_RESP_BUSY:
+			break;
+		default:
+			return -1;
+		}
+
+		int64_t wait = mcp2210_retry_next(state, &retry);
+		if (wait < 0)
+			return -1;
+		mcp2210_sleep_us(wait);
+	}
+}
+
+// Send the reports of a transfer, then empty ones until the chip finished.
+// What is clocked in while sending is dropped.
+static int run_transfer(hid_handle_t *handle, mcp2210_program_t *program,
+	const struct program_op *op, uint8_t *recv)
+{
+	struct mcp2210_state *state = hid_state(handle);
+	size_t len = op->send_len + op->recv_len, clocked = 0;
+	bool started = false;
+
+	for (size_t i = 0;; ++i) {
+		uint8_t *cmd = i < op->reports ? program->reports[op->report + i] : program->poll;
+		uint8_t resp[MCP2210_REPORT_SIZE];
+		if (-1 == run_report(handle, cmd, resp))
+			goto err;
+		started = true;
+		mcp2210_track_transfer(state, resp);
+
+		size_t n = resp[2];
+		if (n > REPORT_DATA || clocked + n > len) {
+			errno = EPROTO;
+			goto err;
+		}
+		// Bytes clocked in while the command went out are dropped, a report
+		// holding only those must not form a pointer before recv
+		size_t skip = clocked < op->send_len ? op->send_len - clocked : 0;
+		if (skip < n)
+			memcpy(recv + clocked + skip - op->send_len, resp + 4 + skip, n - skip);
+		clocked += n;
+
+		if (resp[3] == MCP2210_SPI_STATUS_FINISHED)
+			break;
+	}
+
+	if (clocked != len) {
+		errno = EPROTO;
+		goto err;
+	}
+	return 0;
+
+err:
+	if (started) {
+		// Don't leave a half done transfer to the next SPI user
+		int error = errno;
+		uint8_t resp[MCP2210_REPORT_SIZE];
+		if (0 == run_report(handle, program->cancel, resp))
+			mcp2210_clear_transfer(state);
+		errno = error;
+	}
+	return -1;
+}
+
+ssize_t mcp2210_program_run(hid_handle_t *handle, mcp2210_program_t *program,
+    int priority, void *recv, size_t recv_len)
+{
+	if (priority < 0 || priority >= MCP2210_CLASSES) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (recv_len < program->recv_len) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	struct mcp2210_state *state = hid_state(handle);
+	size_t received = 0;
+
+	// The whole program is one turn, waiting for transactions holding the bus
+	mcp2210_queue_enter(state, priority, true, NULL);
+
+	for (size_t i = 0; i < program->op_count; ++i) {
+		struct program_op *op = &program->ops[i];
+
+		if (op->type != MCP2210_STEP_TRANSFER) {
+			uint8_t resp[MCP2210_REPORT_SIZE];
+			if (-1 == run_report(handle, program->reports[op->report], resp))
+				goto err;
+			continue;
+		}
+
+		if (-1 == run_transfer(handle, program, op, (uint8_t *) recv + received))
+			goto err;
+		received += op->recv_len;
+	}
+
+	mcp2210_queue_leave(state);
+	return received;
+
+err:
+	mcp2210_queue_leave(state);
+	return -1;
+}
+
+void mcp2210_program_free(mcp2210_program_t *program)
+{
+	if (!program)
+		return;
+	free(program->ops);
+	free(program->reports);
+	free(program);
+}
@@ -0,0 +1,188 @@
+/* per-device command queue with priority classes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "mcp2210_priv.h"
+
+void mcp2210_queue_init(struct mcp2210_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+	pthread_mutex_init(&queue->lock, NULL);
+	queue->async_waiter.async = true;
+	queue->aging_us = MCP2210_DEFAULT_QUEUE_AGING_US;
+}
+
+void mcp2210_queue_fini(struct mcp2210_queue *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+}
+
+void mcp2210_set_queue_aging(hid_handle_t *handle, uint32_t aging_us)
+{
+	struct mcp2210_queue *queue = &hid_state(handle)->queue;
+	pthread_mutex_lock(&queue->lock);
+	queue->aging_us = aging_us;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// SPI transfers can't run in the middle of another owner's transaction
+static bool eligible(struct mcp2210_queue *queue, struct mcp2210_waiter *waiter)
+{
+	return !waiter->spi || !queue->spi_owner || queue->spi_owner == waiter->spi_owner;
+}
+
+// First eligible waiter of a class, which is also its oldest
+static struct mcp2210_waiter **first_eligible(struct mcp2210_queue *queue, int priority)
+{
+	struct mcp2210_waiter **cur = &queue->waiting[priority];
+	while (*cur && !eligible(queue, *cur))
+		cur = &(*cur)->next;
+	return *cur ? cur : NULL;
+}
+
+// Count a granted turn, called with the lock held
+static void record_turn(struct mcp2210_state *state, struct mcp2210_waiter *waiter)
+{
+	uint64_t wait = mcp2210_now_us() - waiter->since;
+	int priority = waiter->priority;
+	state->stats.queued[priority]++;
+	state->stats.queue_wait_us[priority] += wait;
+	if (wait > state->stats.queue_wait_max_us[priority])
+		state->stats.queue_wait_max_us[priority] = wait;
+}
+
+// Start the next report if the device is free, called with the lock held.
+// The waiter of the calling thread, if any, isn't woken.
+static void dispatch(struct mcp2210_state *state, struct mcp2210_waiter *self)
+{
+	struct mcp2210_queue *queue = &state->queue;
+	if (queue->busy)
+		return;
+
+	struct mcp2210_waiter **next = NULL;
+	for (int i = 0; i < MCP2210_CLASSES && !next; ++i)
+		next = first_eligible(queue, i);
+	if (!next)
+		return;
+
+	// A report that waited too long goes first, the oldest of them wins
+	if (queue->aging_us) {
+		uint64_t now = mcp2210_now_us();
+		struct mcp2210_waiter **aged = NULL;
+		for (int i = (*next)->priority + 1; i < MCP2210_CLASSES; ++i) {
+			struct mcp2210_waiter **cur = first_eligible(queue, i);
+			if (cur && now - (*cur)->since >= queue->aging_us &&
+					(!aged || (*cur)->since < (*aged)->since))
+				aged = cur;
+		}
+		if (aged) {
+			next = aged;
+			state->stats.queue_aged++;
+		}
+	}
+
+	struct mcp2210_waiter *waiter = *next;
+	*next = waiter->next;
+	queue->depth--;
+	// The first report of a transaction takes the bus
+	if (waiter->spi && waiter->spi_owner)
+		queue->spi_owner = waiter->spi_owner;
+	waiter->ready = true;
+	queue->busy = true;
+	record_turn(state, waiter);
+
+	if (waiter == self)
+		return;
+	if (waiter->async)
+		mcp2210_async_turn(state);
+	else
+		pthread_cond_signal(&waiter->cond);
+}
+
+// Queue a waiter behind the others of its class, called with the lock held
+static void add_waiter(struct mcp2210_state *state, struct mcp2210_waiter *waiter)
+{
+	struct mcp2210_queue *queue = &state->queue;
+
+	waiter->since = mcp2210_now_us();
+	waiter->ready = false;
+	waiter->next = NULL;
+
+	struct mcp2210_waiter **tail = &queue->waiting[waiter->priority];
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = waiter;
+
+	if (++queue->depth > state->stats.queue_depth_max)
+		state->stats.queue_depth_max = queue->depth;
+	if (queue->busy || queue->depth > 1)
+		state->stats.contended[waiter->priority]++;
+}
+
+void mcp2210_queue_enter(struct mcp2210_state *state, int priority,
+	bool spi, const void *spi_owner)
+{
+	struct mcp2210_queue *queue = &state->queue;
+	struct mcp2210_waiter waiter;
+	pthread_cond_init(&waiter.cond, NULL);
+	waiter.priority = priority;
+	waiter.spi = spi;
+	waiter.spi_owner = spi_owner;
+	waiter.async = false;
+
+	pthread_mutex_lock(&queue->lock);
+
+	add_waiter(state, &waiter);
+	dispatch(state, &waiter);
+	while (!waiter.ready)
+		pthread_cond_wait(&waiter.cond, &queue->lock);
+
+	pthread_mutex_unlock(&queue->lock);
+	pthread_cond_destroy(&waiter.cond);
+}
+
+bool mcp2210_queue_enter_async(struct mcp2210_state *state, int priority, bool spi)
+{
+	struct mcp2210_queue *queue = &state->queue;
+	struct mcp2210_waiter *waiter = &queue->async_waiter;
+
+	pthread_mutex_lock(&queue->lock);
+	waiter->priority = priority;
+	waiter->spi = spi;
+	waiter->spi_owner = waiter;
+	add_waiter(state, waiter);
+	dispatch(state, waiter);
+	bool granted = waiter->ready;
+	pthread_mutex_unlock(&queue->lock);
+
+	return granted;
+}
+
+void mcp2210_queue_leave(struct mcp2210_state *state)
+{
+	struct mcp2210_queue *queue = &state->queue;
+	pthread_mutex_lock(&queue->lock);
+	queue->busy = false;
+	dispatch(state, NULL);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void mcp2210_queue_release_spi(struct mcp2210_state *state, const void *owner)
+{
+	struct mcp2210_queue *queue = &state->queue;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->spi_owner == owner) {
+		queue->spi_owner = NULL;
+		// Waiting SPI transfers may have become eligible
+		dispatch(state, NULL);
+	}
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void mcp2210_queue_release_async_spi(struct mcp2210_state *state)
+{
+	mcp2210_queue_release_spi(state, &state->queue.async_waiter);
+}
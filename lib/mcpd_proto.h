@@ -0,0 +1,77 @@
+/* protocol between the mcpd broker and libmcpclient */
+#ifndef MCPD_PROTO_H
+#define MCPD_PROTO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hid.h"
+
+// Control socket, clients honor MCPD_SOCKET from the environment
+#define MCPD_SOCKET_PATH "/run/mcpd.sock"
+#define MCPD_SOCKET_ENV  "MCPD_SOCKET"
+
+////
+// Control messages are exchanged over a SOCK_SEQPACKET UNIX socket. They
+// only set up channels, the reports themselves travel through a shared
+// memory ring per channel.
+////
+
+// List devices -> MCPD_DEVICES, arg: VID << 16 | PID
+#define MCPD_LIST    1
+// Open a channel -> MCPD_OPENED, arg: device index
+// The reply carries the ring, doorbell and notify fds
+#define MCPD_OPEN    2
+// Close a channel, no reply, arg: channel id
+#define MCPD_CLOSE   3
+
+#define MCPD_DEVICES 0x81
+// arg: channel id
+#define MCPD_OPENED  0x82
+// arg: errno
+#define MCPD_ERROR   0xff
+
+typedef struct mcpd_msg {
+	uint32_t type;
+	uint32_t arg;
+} mcpd_msg_t;
+
+#define MCPD_MAX_DEVICES 32
+#define MCPD_DESC_LEN    64
+
+typedef struct mcpd_device_list {
+	uint32_t type;
+	uint32_t count;
+	struct {
+		// What the broker sees, path is rewritten to mcpd:<index>
+		hid_device_info_t info;
+		char desc[MCPD_DESC_LEN];
+	} devices[MCPD_MAX_DEVICES];
+} mcpd_device_list_t;
+
+////
+// A channel ring holds requests written by the client and the responses of
+// the broker. Every slot is one 64 byte HID report. Indices run freely and
+// are masked on access, a side only signals the eventfd of the other side
+// when that side announced that it went to sleep.
+////
+
+#define MCPD_RING_SLOTS  64
+#define MCPD_REPORT_SIZE 64
+
+typedef struct mcpd_ring {
+	// Client side
+	uint32_t req_head;
+	uint32_t resp_tail;
+	uint32_t client_waiting;
+	// Broker side
+	uint32_t req_tail;
+	uint32_t resp_head;
+	uint32_t broker_waiting;
+	// errno of a failed device access, reported on the next read
+	uint32_t error;
+
+	uint8_t req[MCPD_RING_SLOTS][MCPD_REPORT_SIZE];
+	uint8_t resp[MCPD_RING_SLOTS][MCPD_REPORT_SIZE];
+} mcpd_ring_t;
+
+#endif
@@ -0,0 +1,501 @@
+/* mcpd: broker sharing MCP2210 bridges between processes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <mcp2210.h>
+#include <mcpd_proto.h>
+
+// Cancel the transaction of a channel that stopped sending data for this long
+#define OWNER_TIMEOUT_MS 1000
+// Watchdog on the bridges themselves
+#define WATCHDOG_US 1000000
+
+#define MAX_CLIENTS 256
+// Permissions of the control socket, -m overrides them
+#define SOCKET_MODE 0660
+
+// A client connection to one device
+struct channel {
+	uint32_t id;
+	// Control socket of the client
+	int client;
+	mcpd_ring_t *ring;
+	// Signalled to wake up the client
+	int notify;
+	struct channel *next;
+};
+
+struct device {
+	hid_handle_t *handle;
+	hid_device_info_t info;
+	// Signalled by clients with new requests and on channel changes
+	int doorbell;
+
+	pthread_mutex_t lock;
+	struct channel *channels;
+	// Channel in the middle of an SPI transaction and its last activity
+	struct channel *owner;
+	uint64_t owner_active;
+
+	pthread_t thread;
+};
+
+static struct device devices[MCPD_MAX_DEVICES];
+static size_t device_count;
+
+static uint32_t next_channel_id = 1;
+
+static volatile sig_atomic_t quit;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void notify_client(struct channel *ch)
+{
+	if (__atomic_load_n(&ch->ring->client_waiting, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		(void) !write(ch->notify, &one, sizeof(one));
+	}
+}
+
+static bool has_request(struct channel *ch)
+{
+	mcpd_ring_t *ring = ch->ring;
+	return __atomic_load_n(&ring->req_head, __ATOMIC_SEQ_CST) != ring->req_tail &&
+		ring->resp_head - __atomic_load_n(&ring->resp_tail, __ATOMIC_ACQUIRE)
+			< MCPD_RING_SLOTS;
+}
+
+// Run one request of a channel on the device
+static void serve(struct device *dev, struct channel *ch)
+{
+	mcpd_ring_t *ring = ch->ring;
+	uint8_t cmd[MCP2210_REPORT_SIZE], resp[MCP2210_REPORT_SIZE];
+
+	memcpy(cmd, ring->req[ring->req_tail % MCPD_RING_SLOTS], sizeof(cmd));
+	__atomic_store_n(&ring->req_tail, ring->req_tail + 1, __ATOMIC_RELEASE);
+
+	if (-1 == hid_write(dev->handle, cmd, sizeof(cmd)) ||
+			-1 == hid_read(dev->handle, resp, sizeof(resp))) {
+		__atomic_store_n(&ring->error, errno, __ATOMIC_RELEASE);
+		if (dev->owner == ch)
+			dev->owner = NULL;
+		notify_client(ch);
+		return;
+	}
+
+	memcpy(ring->resp[ring->resp_head % MCPD_RING_SLOTS], resp, sizeof(resp));
+	__atomic_store_n(&ring->resp_head, ring->resp_head + 1, __ATOMIC_SEQ_CST);
+	notify_client(ch);
+
+	// Keep the bus for this channel until its SPI transaction finished
+	if (cmd[0] == MCP2210_CMD_TRANSFER_SPI_DATA && resp[1] == MCP2210_STATUS_SUCCESS) {
+		if (resp[3] == MCP2210_SPI_STATUS_FINISHED) {
+			dev->owner = NULL;
+		} else {
+			dev->owner = ch;
+			dev->owner_active = now_ms();
+		}
+	} else if (cmd[0] == MCP2210_CMD_CANCEL_SPI_TRANSFER && dev->owner == ch) {
+		dev->owner = NULL;
+	}
+}
+
+// Serve one request of every channel in turn, or only the owner of an
+// SPI transaction until it is finished
+static bool serve_round(struct device *dev)
+{
+	bool served = false;
+
+	if (dev->owner) {
+		if (has_request(dev->owner)) {
+			serve(dev, dev->owner);
+			return true;
+		}
+		if (now_ms() - dev->owner_active < OWNER_TIMEOUT_MS)
+			return false;
+		// The owner went silent, free the bus for everybody else
+		mcp2210_cancel_spi_transfer(dev->handle, NULL);
+		dev->owner = NULL;
+	}
+
+	for (struct channel *ch = dev->channels; ch; ch = ch->next) {
+		if (has_request(ch)) {
+			serve(dev, ch);
+			served = true;
+			if (dev->owner)
+				break;
+		}
+	}
+	return served;
+}
+
+static void set_broker_waiting(struct device *dev, uint32_t value)
+{
+	for (struct channel *ch = dev->channels; ch; ch = ch->next)
+		__atomic_store_n(&ch->ring->broker_waiting, value, __ATOMIC_SEQ_CST);
+}
+
+static void *device_worker(void *arg)
+{
+	struct device *dev = arg;
+
+	pthread_mutex_lock(&dev->lock);
+	for (;;) {
+		if (serve_round(dev))
+			continue;
+
+		// Announce the sleep and look again, a client that queued a request
+		// before seeing the flag would not ring the doorbell
+		set_broker_waiting(dev, 1);
+		bool pending = false;
+		for (struct channel *ch = dev->channels; ch; ch = ch->next)
+			pending |= has_request(ch);
+
+		if (!pending) {
+			int timeout = dev->owner ? OWNER_TIMEOUT_MS : -1;
+			pthread_mutex_unlock(&dev->lock);
+			struct pollfd pfd = { dev->doorbell, POLLIN, 0 };
+			if (poll(&pfd, 1, timeout) > 0) {
+				uint64_t count;
+				(void) !read(dev->doorbell, &count, sizeof(count));
+			}
+			pthread_mutex_lock(&dev->lock);
+		}
+		set_broker_waiting(dev, 0);
+	}
+	return NULL;
+}
+
+static void free_channel(struct channel *ch)
+{
+	munmap(ch->ring, sizeof(mcpd_ring_t));
+	close(ch->notify);
+	free(ch);
+}
+
+// Remove channels of a client, every channel if id is 0
+static void close_channels(int client, uint32_t id)
+{
+	for (size_t i = 0; i < device_count; ++i) {
+		struct device *dev = &devices[i];
+
+		pthread_mutex_lock(&dev->lock);
+		for (struct channel **cur = &dev->channels; *cur;) {
+			struct channel *ch = *cur;
+			if (ch->client == client && (!id || ch->id == id)) {
+				if (dev->owner == ch) {
+					mcp2210_cancel_spi_transfer(dev->handle, NULL);
+					dev->owner = NULL;
+				}
+				*cur = ch->next;
+				free_channel(ch);
+			} else {
+				cur = &ch->next;
+			}
+		}
+		pthread_mutex_unlock(&dev->lock);
+	}
+}
+
+static void send_error(int client, int err)
+{
+	mcpd_msg_t msg = { MCPD_ERROR, err };
+	send(client, &msg, sizeof(msg), MSG_NOSIGNAL);
+}
+
+static void command_list(int client, uint32_t arg)
+{
+	mcpd_device_list_t list;
+	memset(&list, 0, sizeof(list));
+	list.type = MCPD_DEVICES;
+
+	// Every device owned by the broker is an MCP2210
+	if (arg >> 16 == MCP2210_VID && (arg & 0xffff) == MCP2210_PID) {
+		list.count = device_count;
+		for (size_t i = 0; i < device_count; ++i) {
+			list.devices[i].info = devices[i].info;
+			snprintf(list.devices[i].info.path, HID_INFO_STRLEN, "mcpd:%zu", i);
+			snprintf(list.devices[i].desc, MCPD_DESC_LEN, "mcpd [%zu] %s", i,
+				hid_device_desc(devices[i].handle));
+		}
+	}
+
+	send(client, &list, sizeof(list), MSG_NOSIGNAL);
+}
+
+static void command_open(int client, uint32_t index)
+{
+	if (index >= device_count) {
+		send_error(client, ENODEV);
+		return;
+	}
+	struct device *dev = &devices[index];
+
+	struct channel *ch = malloc(sizeof(struct channel));
+	if (!ch) {
+		send_error(client, ENOMEM);
+		return;
+	}
+
+	// The ring lives in an unlinked shared memory object
+	char name[64];
+	snprintf(name, sizeof(name), "/mcpd-%ld-%u", (long) getpid(), next_channel_id);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		goto err1;
+	shm_unlink(name);
+	if (-1 == ftruncate(fd, sizeof(mcpd_ring_t)))
+		goto err2;
+	ch->ring = mmap(NULL, sizeof(mcpd_ring_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (ch->ring == MAP_FAILED)
+		goto err2;
+	ch->notify = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ch->notify == -1)
+		goto err3;
+	ch->id = next_channel_id++;
+	ch->client = client;
+	// The worker may be asleep already, so the first request has to wake it
+	ch->ring->broker_waiting = 1;
+
+	int fds[3] = { fd, dev->doorbell, ch->notify };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	mcpd_msg_t msg = { MCPD_OPENED, ch->id };
+	struct iovec iov = { &msg, sizeof(msg) };
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control.buf;
+	hdr.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	pthread_mutex_lock(&dev->lock);
+	ch->next = dev->channels;
+	dev->channels = ch;
+	pthread_mutex_unlock(&dev->lock);
+
+	if (-1 == sendmsg(client, &hdr, MSG_NOSIGNAL))
+		close_channels(client, ch->id);
+	close(fd);
+	return;
+
+err3:
+	munmap(ch->ring, sizeof(mcpd_ring_t));
+err2:
+	close(fd);
+err1:
+	send_error(client, errno);
+	free(ch);
+}
+
+// Returns: false -> the client hung up
+static bool handle_client(int client)
+{
+	mcpd_msg_t msg;
+	ssize_t len = recv(client, &msg, sizeof(msg), 0);
+	if (len <= 0)
+		return false;
+	if ((size_t) len != sizeof(msg)) {
+		send_error(client, EPROTO);
+		return true;
+	}
+
+	switch (msg.type) {
+	case MCPD_LIST:
+		command_list(client, msg.arg);
+		break;
+	case MCPD_OPEN:
+		command_open(client, msg.arg);
+		break;
+	case MCPD_CLOSE:
+		close_channels(client, msg.arg);
+		break;
+	default:
+		send_error(client, EPROTO);
+		break;
+	}
+	return true;
+}
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	quit = 1;
+}
+
+static int open_devices()
+{
+	hid_device_info_t info[MCPD_MAX_DEVICES];
+	ssize_t count = hid_enumerate(MCP2210_VID, MCP2210_PID,
+		info, MCPD_MAX_DEVICES);
+	if (-1 == count)
+		return -1;
+
+	for (size_t i = 0; i < (size_t) count; ++i) {
+		struct device *dev = &devices[device_count];
+		dev->info = info[i];
+		dev->handle = hid_open(&info[i]);
+		if (!dev->handle) {
+			fprintf(stderr, "Failed to open %s: %s\n",
+				info[i].port_path, strerror(errno));
+			continue;
+		}
+
+		// Clean up after whoever used the bridge before
+		if (-1 == mcp2210_set_watchdog(dev->handle, WATCHDOG_US))
+			fprintf(stderr, "Failed to recover %s: %s\n",
+				hid_device_desc(dev->handle), strerror(errno));
+
+		dev->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (dev->doorbell == -1)
+			return -1;
+		pthread_mutex_init(&dev->lock, NULL);
+		dev->channels = NULL;
+		dev->owner = NULL;
+		if (pthread_create(&dev->thread, NULL, device_worker, dev)) {
+			close(dev->doorbell);
+			return -1;
+		}
+		device_count++;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = MCPD_SOCKET_PATH;
+	mode_t mode = SOCKET_MODE;
+
+	int opt;
+	unsigned long bits;
+	char *end;
+	while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+		switch ((char) opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'm':
+			bits = strtoul(optarg, &end, 8);
+			if (*end || end == optarg || bits > 0777) {
+				fprintf(stderr, "Invalid socket mode %s\n", optarg);
+				return 1;
+			}
+			mode = bits;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s socket] [-m mode]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if (-1 == hid_init()) {
+		perror("Failed to initialize HID module");
+		return 1;
+	}
+
+	if (-1 == open_devices()) {
+		perror("Failed to open devices");
+		return 1;
+	}
+	printf("Serving %zu devices on %s\n", device_count, path);
+
+	int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener == -1) {
+		perror("Failed to create socket");
+		return 1;
+	}
+	unlink(path);
+	// Nobody else can connect before the mode is set, whatever the umask
+	mode_t umask_prev = umask(0177);
+	int bound = bind(listener, (struct sockaddr *) &addr, sizeof(addr));
+	umask(umask_prev);
+	if (-1 == bound || -1 == chmod(path, mode) || -1 == listen(listener, 16)) {
+		perror("Failed to listen on socket");
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// Slot 0 is the listener, the rest are clients
+	struct pollfd fds[MAX_CLIENTS + 1];
+	size_t nfds = 1;
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+
+	while (!quit) {
+		if (-1 == poll(fds, nfds, -1)) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (size_t i = nfds - 1; i > 0; --i) {
+			if (!fds[i].revents)
+				continue;
+			if (!handle_client(fds[i].fd)) {
+				close_channels(fds[i].fd, 0);
+				close(fds[i].fd);
+				fds[i] = fds[--nfds];
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int client = accept(listener, NULL, NULL);
+			if (client == -1)
+				continue;
+			if (nfds > MAX_CLIENTS) {
+				close(client);
+				continue;
+			}
+			fds[nfds].fd = client;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+	}
+
+	close(listener);
+	unlink(path);
+	return 0;
+}
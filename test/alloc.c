@@ -0,0 +1,153 @@
+/* check that commands on an open device don't touch the heap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "hid.h"
+#include "mcp2210.h"
+
+////
+// Heap calls of the library are counted by linking with
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+////
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static size_t heap_calls;
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #cond, \
+			strerror(errno)); \
+		failures++; \
+	} \
+} while (0)
+
+// Blocking SPI, GPIO and settings commands
+static void blocking_commands(hid_handle_t *handle)
+{
+	mcp2210_spi_settings_t spi_settings;
+	CHECK(0 == read_spi_settings(handle, &spi_settings, false));
+	spi_settings.bytes_per_transaction = 4;
+	CHECK(0 == write_spi_settings(handle, &spi_settings, false));
+	mcp2210_chip_settings_t chip_settings;
+	CHECK(0 == read_chip_settings(handle, &chip_settings, true));
+
+	uint16_t gpio;
+	CHECK(0 == mcp2210_set_gpio_direction(handle, 0x00ff));
+	CHECK(0 == mcp2210_set_gpio(handle, 0x0102));
+	CHECK(0 == mcp2210_get_gpio(handle, &gpio) && gpio == 0x0102);
+
+	uint8_t send[100], recv[100];
+	for (size_t i = 0; i < sizeof(send); ++i)
+		send[i] = i;
+	size_t recv_len = sizeof(recv);
+	CHECK(MCP2210_SPI_STATUS_FINISHED ==
+		mcp2210_spi_transfer(handle, send, 4, recv, &recv_len));
+	spi_settings.bytes_per_transaction = sizeof(send);
+	CHECK(0 == write_spi_settings(handle, &spi_settings, false));
+	CHECK((ssize_t) sizeof(send) == mcp2210_spi_transaction(handle,
+		MCP2210_CLASS_NORMAL, send, sizeof(send), recv, sizeof(recv)));
+	CHECK(!memcmp(send, recv, sizeof(send)));
+}
+
+static void complete(mcp2210_async_t *op)
+{
+	int *done = op->arg;
+	(*done)++;
+}
+
+static void async_commands(hid_handle_t *handle)
+{
+	int done = 0;
+	mcp2210_async_t op;
+	memset(&op, 0, sizeof(op));
+	op.handle = handle;
+	op.cmd[0] = MCP2210_CMD_GET_GPIO_VALUE;
+	op.callback = complete;
+	op.arg = &done;
+	CHECK(0 == mcp2210_submit(&op));
+	while (mcp2210_in_flight())
+		CHECK(-1 != mcp2210_handle_events(100));
+	CHECK(done == 1 && op.error == 0);
+}
+
+int main(void)
+{
+	static uint8_t arena[1 << 16];
+	size_t arena_len = 2 * hid_arena_size(1);
+	CHECK(arena_len <= sizeof(arena));
+	CHECK(0 == hid_init_arena(arena, arena_len));
+
+	hid_handle_t *handle = hid_open_path("sim0");
+	CHECK(handle);
+	if (!handle)
+		return 1;
+
+	// The event loop sizes its buffers on first use
+	async_commands(handle);
+
+	size_t before = heap_calls;
+	for (int i = 0; i < 100; ++i) {
+		blocking_commands(handle);
+		async_commands(handle);
+	}
+	if (heap_calls != before) {
+		fprintf(stderr, "commands called the heap %zu times\n", heap_calls - before);
+		failures++;
+	}
+
+	// Contexts freed go back to the arena, which only has room for one more
+	before = heap_calls;
+	for (int i = 0; i < 100; ++i) {
+		hid_context_t *ctx = hid_context_create();
+		CHECK(ctx);
+		if (ctx)
+			hid_context_free(ctx);
+	}
+	if (heap_calls != before) {
+		fprintf(stderr, "contexts called the heap %zu times\n", heap_calls - before);
+		failures++;
+	}
+
+	// Closed handles are reused
+	for (int i = 0; i < 100; ++i) {
+		hid_cleanup_device(handle);
+		handle = hid_open_path("sim0");
+		CHECK(handle);
+		if (!handle)
+			return 1;
+	}
+
+	hid_cleanup_device(handle);
+	hid_fini();
+	if (failures)
+		return 1;
+	printf("alloc: ok\n");
+	return 0;
+}
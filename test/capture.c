@@ -0,0 +1,171 @@
+/* check writing capture files and finding records in them */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "hid.h"
+#include "mcp2210.h"
+#include "mcp2210_priv.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #cond, \
+			strerror(errno)); \
+		failures++; \
+	} \
+} while (0)
+
+// With a segment of a page every segment takes a few dozen records
+#define RECORDS 1000
+#define DATA_LEN 32
+// The channel of the transfers of the simulated device
+#define DEVICE_CHANNEL 7
+
+static uint64_t times[RECORDS];
+
+// Data of a record tells which one it is
+static void record_data(uint8_t *data, uint32_t i, uint8_t salt)
+{
+	for (size_t j = 0; j < DATA_LEN; ++j)
+		data[j] = (i >> (j % 4 * 8)) ^ salt ^ j;
+}
+
+static bool is_record(const mcp2210_capture_record_t *record, uint32_t i)
+{
+	uint8_t send[DATA_LEN], recv[DATA_LEN];
+	record_data(send, i, 0x00);
+	record_data(recv, i, 0xff);
+	return record->channel == i % 4 && record->status == i % 256 &&
+		record->send_len == DATA_LEN && record->recv_len == i % DATA_LEN &&
+		!memcmp(record->send, send, DATA_LEN) &&
+		!memcmp(record->recv, recv, record->recv_len);
+}
+
+// The first record at or after a time, RECORDS if none
+static uint32_t first_at(uint64_t time_us)
+{
+	uint32_t i = 0;
+	while (i < RECORDS && times[i] < time_us)
+		i++;
+	return i;
+}
+
+static void check_seek(mcp2210_capture_reader_t *reader, uint64_t time_us)
+{
+	mcp2210_capture_record_t record;
+	uint32_t want = first_at(time_us);
+	CHECK(0 == mcp2210_capture_seek(reader, time_us));
+	int got = mcp2210_capture_next(reader, &record);
+	if (want == RECORDS) {
+		// Only the record of the device is left
+		CHECK(got == 1 && record.channel == DEVICE_CHANNEL);
+		return;
+	}
+	if (got != 1 || !is_record(&record, want)) {
+		fprintf(stderr, "seek to %llu didn't find record %u\n",
+			(unsigned long long) time_us, want);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	char path[] = "/tmp/mcp2210-capture-XXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd != -1);
+	if (fd == -1)
+		return 1;
+	close(fd);
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	mcp2210_capture_t *capture = mcp2210_capture_create(path, page);
+	CHECK(capture);
+	if (!capture)
+		return 1;
+
+	uint8_t send[DATA_LEN], recv[DATA_LEN];
+	for (uint32_t i = 0; i < RECORDS; ++i) {
+		record_data(send, i, 0x00);
+		record_data(recv, i, 0xff);
+		CHECK(0 == mcp2210_capture_write(capture, i % 4, i % 256,
+			send, DATA_LEN, recv, i % DATA_LEN));
+		// Spread the records over time, several share a microsecond
+		if (i % 16 == 15)
+			mcp2210_sleep_us(50);
+	}
+	static uint8_t big[1 << 16];
+	errno = 0;
+	CHECK(-1 == mcp2210_capture_write(capture, 0, 0, big, page, NULL, 0) &&
+		errno == EMSGSIZE);
+
+	// Transfers of a device go to the capture while it is set
+	CHECK(0 == hid_init());
+	hid_handle_t *handle = hid_open_path("sim0");
+	CHECK(handle);
+	if (!handle)
+		return 1;
+	mcp2210_spi_settings_t settings;
+	CHECK(0 == read_spi_settings(handle, &settings, false));
+	settings.bytes_per_transaction = 4;
+	CHECK(0 == write_spi_settings(handle, &settings, false));
+	// After the last record written above
+	mcp2210_sleep_us(50);
+	mcp2210_set_capture(handle, capture, DEVICE_CHANNEL);
+	CHECK(4 == mcp2210_spi_transaction(handle, MCP2210_CLASS_NORMAL,
+		"\x9f\x01\x02\x03", 4, recv, 4));
+	mcp2210_set_capture(handle, NULL, 0);
+	CHECK(4 == mcp2210_spi_transaction(handle, MCP2210_CLASS_NORMAL,
+		"\x9f\x01\x02\x03", 4, recv, 4));
+	CHECK(0 == mcp2210_capture_close(capture));
+
+	mcp2210_capture_reader_t *reader = mcp2210_capture_reader_open(path);
+	CHECK(reader);
+	if (!reader)
+		return 1;
+
+	// Every record in the order it was written, across all segments
+	mcp2210_capture_record_t record;
+	for (uint32_t i = 0; i < RECORDS; ++i) {
+		if (1 != mcp2210_capture_next(reader, &record) || !is_record(&record, i)) {
+			fprintf(stderr, "record %u differs\n", i);
+			failures++;
+			break;
+		}
+		times[i] = record.time_us;
+		CHECK(!i || times[i] >= times[i - 1]);
+	}
+	CHECK(1 == mcp2210_capture_next(reader, &record));
+	CHECK(record.channel == DEVICE_CHANNEL && record.status == MCP2210_SPI_STATUS_FINISHED &&
+		record.send_len == 4 && record.recv_len == 4 &&
+		!memcmp(record.send, "\x9f\x01\x02\x03", 4) &&
+		!memcmp(record.recv, "\x9f\x01\x02\x03", 4));
+	CHECK(0 == mcp2210_capture_next(reader, &record));
+
+	// Times of records, between them and around the whole capture
+	check_seek(reader, 0);
+	for (uint32_t i = 0; i < RECORDS; i += 7) {
+		check_seek(reader, times[i]);
+		check_seek(reader, times[i] + 1);
+	}
+	check_seek(reader, times[RECORDS - 1]);
+	CHECK(0 == mcp2210_capture_seek(reader, UINT64_MAX));
+	CHECK(0 == mcp2210_capture_next(reader, &record));
+	mcp2210_capture_reader_close(reader);
+
+	errno = 0;
+	CHECK(!mcp2210_capture_reader_open("/dev/null") && errno == EINVAL);
+
+	hid_cleanup_device(handle);
+	hid_fini();
+	unlink(path);
+	if (failures)
+		return 1;
+	printf("capture: ok\n");
+	return 0;
+}
@@ -0,0 +1,199 @@
+/* check word framing against a bit by bit reference */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "hid.h"
+#include "mcp2210.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #cond, \
+			strerror(errno)); \
+		failures++; \
+	} \
+} while (0)
+
+// Enough words for several blocks of every kernel and a tail
+#define MAX_WORDS 150
+
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 1 ^ rand_state << 15;
+}
+
+static size_t word_size(unsigned bits)
+{
+	return bits == 8 ? 1 : bits <= 16 ? 2 : 4;
+}
+
+static uint32_t get_word(const void *words, unsigned bits, size_t i)
+{
+	switch (word_size(bits)) {
+	case 1:
+		return ((const uint8_t *) words)[i];
+	case 2:
+		return ((const uint16_t *) words)[i];
+	default:
+		return ((const uint32_t *) words)[i];
+	}
+}
+
+static void set_word(void *words, unsigned bits, size_t i, uint32_t value)
+{
+	switch (word_size(bits)) {
+	case 1:
+		((uint8_t *) words)[i] = value;
+		break;
+	case 2:
+		((uint16_t *) words)[i] = value;
+		break;
+	default:
+		((uint32_t *) words)[i] = value;
+		break;
+	}
+}
+
+// Bit b of a word in the order it goes on the wire
+static unsigned word_bit(const mcp2210_framing_t *framing, uint32_t value, unsigned b)
+{
+	unsigned shift = framing->lsb_first ? b : framing->word_bits - 1 - b;
+	return value >> shift & 1;
+}
+
+// Every bit to its place in a stream shifted MSB first
+static void ref_pack(const mcp2210_framing_t *framing, const void *words,
+	size_t count, uint8_t *wire)
+{
+	unsigned bits = framing->word_bits;
+	memset(wire, 0, (count * bits + 7) / 8);
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = get_word(words, bits, i);
+		for (unsigned b = 0; b < bits; ++b) {
+			size_t pos = i * bits + b;
+			wire[pos / 8] |= word_bit(framing, value, b) << (7 - pos % 8);
+		}
+	}
+}
+
+static void ref_unpack(const mcp2210_framing_t *framing, const uint8_t *wire,
+	void *words, size_t count)
+{
+	unsigned bits = framing->word_bits;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = 0;
+		for (unsigned b = 0; b < bits; ++b) {
+			size_t pos = i * bits + b;
+			unsigned bit = wire[pos / 8] >> (7 - pos % 8) & 1;
+			unsigned shift = framing->lsb_first ? b : bits - 1 - b;
+			value |= (uint32_t) bit << shift;
+		}
+		set_word(words, bits, i, value);
+	}
+}
+
+static void check_framing(const mcp2210_framing_t *framing)
+{
+	unsigned bits = framing->word_bits;
+	// A word past the end catches writes beyond count
+	static uint32_t words[MAX_WORDS + 1], got[MAX_WORDS + 1], want[MAX_WORDS + 1];
+	static uint8_t wire[MAX_WORDS * 3 + 1], ref[MAX_WORDS * 3 + 1];
+
+	for (size_t count = 0; count <= MAX_WORDS; ++count) {
+		// Unused high bits are set and have to be ignored
+		for (size_t i = 0; i <= MAX_WORDS; ++i)
+			set_word(words, bits, i, next_rand());
+		size_t len = mcp2210_framed_len(framing, count);
+		CHECK(len == (count * bits + 7) / 8);
+
+		memset(wire, 0x5a, sizeof(wire));
+		ref_pack(framing, words, count, ref);
+		CHECK(0 == mcp2210_frame_pack(framing, words, count, wire));
+		if (memcmp(wire, ref, len) || wire[len] != 0x5a) {
+			fprintf(stderr, "pack of %zu words of %u bits, %s first differs\n",
+				count, bits, framing->lsb_first ? "LSB" : "MSB");
+			failures++;
+		}
+
+		// Random wire bytes, the fill bits of the last byte are ignored
+		for (size_t i = 0; i < len; ++i)
+			wire[i] = next_rand();
+		memset(got, 0x5a, sizeof(got));
+		memcpy(want, got, sizeof(want));
+		ref_unpack(framing, wire, want, count);
+		CHECK(0 == mcp2210_frame_unpack(framing, wire, got, count));
+		if (memcmp(got, want, sizeof(got))) {
+			fprintf(stderr, "unpack of %zu words of %u bits, %s first differs\n",
+				count, bits, framing->lsb_first ? "LSB" : "MSB");
+			failures++;
+		}
+	}
+}
+
+// Words through the simulated slave, which echoes what it is sent
+static void check_transaction(hid_handle_t *handle, const mcp2210_framing_t *framing)
+{
+	unsigned bits = framing->word_bits;
+	uint32_t send[MAX_WORDS], recv[MAX_WORDS], want[MAX_WORDS];
+	size_t count = MAX_WORDS;
+
+	memset(recv, 0, sizeof(recv));
+	memset(want, 0, sizeof(want));
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = next_rand();
+		set_word(send, bits, i, value);
+		set_word(want, bits, i, value & ((uint32_t) -1 >> (32 - bits)));
+	}
+
+	mcp2210_spi_settings_t settings;
+	CHECK(0 == read_spi_settings(handle, &settings, false));
+	settings.bytes_per_transaction = mcp2210_framed_len(framing, count);
+	CHECK(0 == write_spi_settings(handle, &settings, false));
+	CHECK((ssize_t) count == mcp2210_spi_transaction_words(handle,
+		MCP2210_CLASS_NORMAL, framing, send, recv, count));
+	CHECK(!memcmp(recv, want, count * word_size(bits)));
+}
+
+int main(void)
+{
+	CHECK(0 == hid_init());
+	hid_handle_t *handle = hid_open_path("sim0");
+	CHECK(handle);
+	if (!handle)
+		return 1;
+
+	mcp2210_framing_t framing;
+	for (unsigned bits = 8; bits <= 24; ++bits) {
+		if (bits > 16 && bits < 24)
+			continue;
+		for (int lsb_first = 0; lsb_first < 2; ++lsb_first) {
+			framing.word_bits = bits;
+			framing.lsb_first = lsb_first;
+			check_framing(&framing);
+			check_transaction(handle, &framing);
+		}
+	}
+
+	framing.word_bits = 17;
+	framing.lsb_first = false;
+	CHECK(0 == mcp2210_framed_len(&framing, 1));
+	uint8_t wire[4];
+	uint32_t word = 0;
+	errno = 0;
+	CHECK(-1 == mcp2210_frame_pack(&framing, &word, 1, wire) && errno == EINVAL);
+
+	hid_cleanup_device(handle);
+	hid_fini();
+	if (failures)
+		return 1;
+	printf("framing: ok\n");
+	return 0;
+}
@@ -0,0 +1,317 @@
+/* simulated MCP2210 behind the HID module interface, for the tests */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include "hid.h"
+#include "mcp2210_priv.h"
+#include "hid_sim.h"
+
+#define SIM_PATH "sim0"
+#define SIM_PORT "1-1"
+#define SIM_SERIAL "0001"
+// Bytes of MOSI kept for sim_mosi
+#define SIM_MOSI_LEN 4096
+
+struct hid_context {
+	// Handles with an asynchronous exchange waiting for hid_handle_events
+	struct hid_handle *pending;
+	struct mcp2210_loop loop;
+};
+
+struct hid_handle {
+	hid_context_t *ctx;
+	// Response to the last report written
+	uint8_t resp[MCP2210_REPORT_SIZE];
+	mcp2210_spi_settings_t spi_settings;
+	// Bytes of the SPI transaction in progress sent so far
+	size_t spi_sent;
+	uint16_t gpio, gpio_direction;
+	// Reports answered per command
+	unsigned reports[256];
+	// Bytes shifted out since the last sim_mosi
+	uint8_t mosi[SIM_MOSI_LEN];
+	size_t mosi_len;
+	// MISO reads ones until then
+	uint64_t busy_until_us;
+
+	// Asynchronous exchange in flight
+	void *in;
+	size_t in_len;
+	hid_callback_t callback;
+	void *arg;
+	struct hid_handle *pending_next;
+
+	struct mcp2210_state state;
+};
+
+hid_context_t *hid_context_create(void)
+{
+	hid_context_t *ctx = hid_arena_alloc(sizeof(hid_context_t));
+	if (!ctx)
+		return NULL;
+	if (-1 == mcp2210_loop_init(&ctx->loop)) {
+		hid_arena_free(ctx, sizeof(hid_context_t));
+		return NULL;
+	}
+	return ctx;
+}
+
+void hid_context_free(hid_context_t *ctx)
+{
+	mcp2210_loop_fini(&ctx->loop);
+	hid_arena_free(ctx, sizeof(hid_context_t));
+}
+
+ssize_t hid_ctx_enumerate(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_device_info_t *dest, size_t dest_len)
+{
+	(void) ctx;
+	if (vid != MCP2210_VID || pid != MCP2210_PID)
+		return 0;
+	if (dest_len) {
+		memset(dest, 0, sizeof(*dest));
+		dest->vid = vid;
+		dest->pid = pid;
+		strcpy(dest->port_path, SIM_PORT);
+		strcpy(dest->path, SIM_PATH);
+		strcpy(dest->serial, SIM_SERIAL);
+	}
+	return 1;
+}
+
+hid_handle_t *hid_ctx_open(hid_context_t *ctx, const hid_device_info_t *info)
+{
+	(void) info;
+	hid_handle_t *handle = hid_alloc_handle(sizeof(hid_handle_t));
+	if (!handle)
+		return NULL;
+	handle->ctx = ctx;
+	handle->spi_settings.bytes_per_transaction = 4;
+	mcp2210_state_init(&handle->state);
+	return handle;
+}
+
+hid_handle_t *hid_ctx_open_port(hid_context_t *ctx, const char *port_path)
+{
+	if (strcmp(port_path, SIM_PORT)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return hid_ctx_open(ctx, NULL);
+}
+
+hid_handle_t *hid_ctx_open_path(hid_context_t *ctx, const char *path)
+{
+	if (strcmp(path, SIM_PATH)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return hid_ctx_open(ctx, NULL);
+}
+
+hid_handle_t *hid_ctx_open_serial(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	const char *serial)
+{
+	if (vid != MCP2210_VID || pid != MCP2210_PID || strcmp(serial, SIM_SERIAL)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return hid_ctx_open(ctx, NULL);
+}
+
+ssize_t hid_ctx_find_devices(hid_context_t *ctx, uint16_t vid, uint16_t pid,
+	hid_handle_t **dest, size_t dest_len)
+{
+	if (vid != MCP2210_VID || pid != MCP2210_PID || !dest_len)
+		return 0;
+	if (!(dest[0] = hid_ctx_open(ctx, NULL)))
+		return -1;
+	return 1;
+}
+
+const char *hid_device_desc(hid_handle_t *handle)
+{
+	(void) handle;
+	return "simulated MCP2210";
+}
+
+// Answer a command the way the chip would, successfully
+static void respond(hid_handle_t *handle, const uint8_t *cmd)
+{
+	uint8_t *resp = handle->resp;
+	memset(resp, 0, MCP2210_REPORT_SIZE);
+	resp[0] = cmd[0];
+	resp[1] = MCP2210_STATUS_SUCCESS;
+	handle->reports[cmd[0]]++;
+
+	switch (cmd[0]) {
+	case MCP2210_CMD_GET_NVRAM:
+	case MCP2210_CMD_SET_NVRAM:
+		resp[2] = cmd[1];
+		break;
+	case MCP2210_CMD_GET_SPI_SETTINGS:
+		memcpy(resp + 4, &handle->spi_settings, sizeof(handle->spi_settings));
+		break;
+	case MCP2210_CMD_SET_SPI_SETTINGS:
+		memcpy(&handle->spi_settings, cmd + 4, sizeof(handle->spi_settings));
+		break;
+	case MCP2210_CMD_TRANSFER_SPI_DATA:
+		// MISO wired to MOSI, the bytes come back right away
+		resp[2] = cmd[1];
+		memcpy(resp + 4, cmd + 4, cmd[1]);
+		if (mcp2210_now_us() < handle->busy_until_us)
+			memset(resp + 4, 0xff, cmd[1]);
+		for (size_t i = 0; i < cmd[1] && handle->mosi_len < SIM_MOSI_LEN; ++i)
+			handle->mosi[handle->mosi_len++] = cmd[4 + i];
+		handle->spi_sent += cmd[1];
+		if (handle->spi_sent >= handle->spi_settings.bytes_per_transaction) {
+			handle->spi_sent = 0;
+			resp[3] = MCP2210_SPI_STATUS_FINISHED;
+		} else {
+			resp[3] = MCP2210_SPI_STATUS_DATA_NEEDED;
+		}
+		break;
+	case MCP2210_CMD_CANCEL_SPI_TRANSFER:
+		handle->spi_sent = 0;
+		break;
+	case MCP2210_CMD_SET_GPIO_VALUE:
+		handle->gpio = cmd[4] | cmd[5] << 8;
+		break;
+	case MCP2210_CMD_GET_GPIO_VALUE:
+		resp[4] = handle->gpio;
+		resp[5] = handle->gpio >> 8;
+		break;
+	case MCP2210_CMD_SET_GPIO_DIRECTION:
+		handle->gpio_direction = cmd[4] | cmd[5] << 8;
+		break;
+	case MCP2210_CMD_GET_GPIO_DIRECTION:
+		resp[4] = handle->gpio_direction;
+		resp[5] = handle->gpio_direction >> 8;
+		break;
+	}
+}
+
+ssize_t hid_write(hid_handle_t *handle, void *data, size_t data_len)
+{
+	if (data_len != MCP2210_REPORT_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	respond(handle, data);
+	return data_len;
+}
+
+ssize_t hid_read(hid_handle_t *handle, void *buffer, size_t buffer_len)
+{
+	if (buffer_len > MCP2210_REPORT_SIZE)
+		buffer_len = MCP2210_REPORT_SIZE;
+	memcpy(buffer, handle->resp, buffer_len);
+	return buffer_len;
+}
+
+int hid_set_low_latency(hid_handle_t *handle, uint32_t spin_us)
+{
+	(void) handle;
+	(void) spin_us;
+	return 0;
+}
+
+size_t hid_pipeline_depth(hid_handle_t *handle)
+{
+	(void) handle;
+	return 1;
+}
+
+int hid_exchange_async(hid_handle_t *handle, void *out, size_t out_len,
+	void *in, size_t in_len, hid_callback_t callback, void *arg)
+{
+	if (-1 == hid_write(handle, out, out_len))
+		return -1;
+	handle->in = in;
+	handle->in_len = in_len;
+	handle->callback = callback;
+	handle->arg = arg;
+	handle->pending_next = handle->ctx->pending;
+	handle->ctx->pending = handle;
+	return 0;
+}
+
+int hid_ctx_handle_events(hid_context_t *ctx, int timeout_ms)
+{
+	(void) timeout_ms;
+	// Callbacks may submit again
+	struct hid_handle *done = ctx->pending;
+	ctx->pending = NULL;
+
+	int count = 0;
+	while (done) {
+		struct hid_handle *handle = done;
+		done = handle->pending_next;
+		hid_read(handle, handle->in, handle->in_len);
+		handle->callback(handle, 0, handle->arg);
+		count++;
+	}
+	return count;
+}
+
+ssize_t hid_ctx_get_pollfds(hid_context_t *ctx, struct pollfd *fds, size_t fds_len,
+	int *timeout_ms)
+{
+	(void) fds;
+	(void) fds_len;
+	// Responses are there right away
+	if (ctx->pending)
+		*timeout_ms = 0;
+	return 0;
+}
+
+void hid_cleanup_device(hid_handle_t *handle)
+{
+	mcp2210_state_fini(&handle->state);
+	hid_free_handle(handle);
+}
+
+struct mcp2210_state *hid_state(hid_handle_t *handle)
+{
+	return &handle->state;
+}
+
+hid_context_t *hid_context(hid_handle_t *handle)
+{
+	return handle->ctx;
+}
+
+struct mcp2210_loop *hid_loop(hid_context_t *ctx)
+{
+	return &ctx->loop;
+}
+
+unsigned sim_reports(hid_handle_t *handle, uint8_t cmd)
+{
+	return handle->reports[cmd];
+}
+
+size_t sim_mosi(hid_handle_t *handle, void *dest, size_t len)
+{
+	if (len > handle->mosi_len)
+		len = handle->mosi_len;
+	memcpy(dest, handle->mosi, len);
+	handle->mosi_len = 0;
+	return len;
+}
+
+void sim_busy_until(hid_handle_t *handle, uint64_t time_us)
+{
+	handle->busy_until_us = time_us;
+}
+
+size_t hid_arena_size(size_t handles)
+{
+	// Slack for aligning the start of the arena
+	return hid_arena_cost(sizeof(hid_context_t)) +
+		handles * hid_arena_cost(sizeof(hid_handle_t)) + hid_arena_cost(1);
+}
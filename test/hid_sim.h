@@ -0,0 +1,20 @@
+/* test hooks of the simulated MCP2210 */
+#ifndef HID_SIM_H
+#define HID_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hid.h"
+
+// Reports with the given command the device answered since it was opened
+unsigned sim_reports(hid_handle_t *handle, uint8_t cmd);
+
+// Take the bytes shifted out on MOSI since the last call, up to len
+// Returns: number of bytes stored in dest
+size_t sim_mosi(hid_handle_t *handle, void *dest, size_t len);
+
+// Read ones on MISO instead of the bytes sent until time_us, as taken by
+// mcp2210_now_us, like a slave busy with an operation
+void sim_busy_until(hid_handle_t *handle, uint64_t time_us);
+
+#endif
@@ -0,0 +1,109 @@
+/* check polling a status register until it shows a condition */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "hid.h"
+#include "mcp2210.h"
+#include "mcp2210_priv.h"
+#include "hid_sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #cond, \
+			strerror(errno)); \
+		failures++; \
+	} \
+} while (0)
+
+// How long the simulated operation runs
+#define BUSY_US 20000
+// Slack for the scheduler of a loaded machine
+#define LATE_US 10000
+
+// Read status register of a flash memory, bit 0 is set while it is busy
+static const uint8_t status_cmd[2] = { 0x05, 0x00 };
+static const uint8_t busy_mask[2] = { 0x00, 0x01 };
+static const uint8_t idle_value[2] = { 0x00, 0x00 };
+
+static void poll_init(mcp2210_poll_t *poll, uint32_t timeout_us)
+{
+	memset(poll, 0, sizeof(*poll));
+	poll->send = status_cmd;
+	poll->len = sizeof(status_cmd);
+	poll->mask = busy_mask;
+	poll->value = idle_value;
+	poll->timeout_us = timeout_us;
+}
+
+// Poll a simulated operation of BUSY_US, which it has to notice in time
+static void run_operation(hid_handle_t *handle)
+{
+	mcp2210_poll_t poll;
+	mcp2210_poll_result_t result;
+	uint8_t recv[2];
+	poll_init(&poll, 1000000);
+
+	uint64_t start = mcp2210_now_us();
+	sim_busy_until(handle, start + BUSY_US);
+	CHECK(0 == mcp2210_spi_poll(handle, MCP2210_CLASS_NORMAL, &poll, recv, &result));
+	CHECK(!(recv[1] & 0x01));
+	CHECK(mcp2210_now_us() - start >= BUSY_US);
+	CHECK(result.elapsed_us < BUSY_US + LATE_US && result.polls >= 1);
+}
+
+int main(void)
+{
+	CHECK(0 == hid_init());
+	hid_handle_t *handle = hid_open_path("sim0");
+	CHECK(handle);
+	if (!handle)
+		return 1;
+
+	mcp2210_spi_settings_t settings;
+	CHECK(0 == read_spi_settings(handle, &settings, false));
+	settings.bytes_per_transaction = sizeof(status_cmd);
+	CHECK(0 == write_spi_settings(handle, &settings, false));
+
+	// The first operation learns how long it takes, the ones after it sleep
+	// through most of that
+	run_operation(handle);
+	mcp2210_stats_t stats;
+	mcp2210_get_stats(handle, &stats);
+	CHECK(stats.poll_estimate_us[0] > BUSY_US - LATE_US &&
+		stats.poll_estimate_us[0] < BUSY_US + LATE_US);
+	for (int i = 0; i < 4; ++i)
+		run_operation(handle);
+
+	// An operation that never finishes
+	mcp2210_poll_t poll;
+	mcp2210_poll_result_t result;
+	uint8_t recv[2];
+	poll_init(&poll, BUSY_US);
+	poll.slot = 1;
+	sim_busy_until(handle, UINT64_MAX);
+	errno = 0;
+	CHECK(-1 == mcp2210_spi_poll(handle, MCP2210_CLASS_NORMAL, &poll, recv, &result) &&
+		errno == ETIMEDOUT);
+	CHECK(result.elapsed_us >= BUSY_US && result.elapsed_us < BUSY_US + LATE_US);
+	CHECK(recv[1] & 0x01);
+	mcp2210_get_stats(handle, &stats);
+	CHECK(stats.poll_timeouts == 1 && stats.poll_estimate_us[1] == 0);
+
+	poll.slot = MCP2210_POLL_SLOTS;
+	errno = 0;
+	CHECK(-1 == mcp2210_spi_poll(handle, MCP2210_CLASS_NORMAL, &poll, recv, NULL) &&
+		errno == EINVAL);
+
+	hid_cleanup_device(handle);
+	hid_fini();
+	if (failures)
+		return 1;
+	printf("poll: ok\n");
+	return 0;
+}
@@ -0,0 +1,172 @@
+/* check compiling, patching and running transaction programs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "hid.h"
+#include "mcp2210.h"
+#include "hid_sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #cond, \
+			strerror(errno)); \
+		failures++; \
+	} \
+} while (0)
+
+static const uint8_t read_cmd[4] = { 0x03, 0x00, 0x10, 0x00 };
+static const uint8_t patched_cmd[4] = { 0x03, 0x00, 0x20, 0x40 };
+static uint8_t block[100];
+
+// Expected MOSI of a run: the send data of every transfer followed by
+// zeros while its recv_len bytes are clocked in
+static size_t expect_mosi(uint8_t *dest, const uint8_t *cmd)
+{
+	size_t n = 0;
+	// A, B and D send the slot, C the block
+	memcpy(dest + n, cmd, 4);
+	memset(dest + n + 4, 0, 8);
+	n += 12;
+	memcpy(dest + n, cmd, 4);
+	memset(dest + n + 4, 0, 8);
+	n += 12;
+	memcpy(dest + n, block, sizeof(block));
+	memset(dest + n + sizeof(block), 0, 10);
+	n += sizeof(block) + 10;
+	memcpy(dest + n, cmd, 4);
+	memset(dest + n + 4, 0, 2);
+	n += 6;
+	return n;
+}
+
+static void run(hid_handle_t *handle, mcp2210_program_t *program, const uint8_t *cmd)
+{
+	uint8_t recv[64], mosi[256], expected[256];
+	memset(recv, 0xaa, sizeof(recv));
+	sim_mosi(handle, mosi, sizeof(mosi));
+	unsigned settings = sim_reports(handle, MCP2210_CMD_SET_SPI_SETTINGS);
+
+	CHECK(28 == mcp2210_program_run(handle, program, MCP2210_CLASS_NORMAL,
+		recv, sizeof(recv)));
+	// The slave echoes the zeros clocked out while it is read
+	for (size_t i = 0; i < 28; ++i)
+		CHECK(recv[i] == 0);
+
+	size_t len = expect_mosi(expected, cmd);
+	CHECK(len == sim_mosi(handle, mosi, sizeof(mosi)));
+	CHECK(!memcmp(mosi, expected, len));
+	// B repeats the settings of A, the others change the length
+	CHECK(sim_reports(handle, MCP2210_CMD_SET_SPI_SETTINGS) - settings == 3);
+
+	uint16_t gpio;
+	CHECK(0 == mcp2210_get_gpio(handle, &gpio) && gpio == 0x0155);
+}
+
+static void invalid_steps(void)
+{
+	mcp2210_step_t steps[2];
+	memset(steps, 0, sizeof(steps));
+
+	// A transfer needs settings before it
+	steps[0].type = MCP2210_STEP_TRANSFER;
+	steps[0].send = read_cmd;
+	steps[0].send_len = sizeof(read_cmd);
+	errno = 0;
+	CHECK(!mcp2210_program_compile(steps, 1) && errno == EINVAL);
+
+	// Only settings
+	steps[0].type = MCP2210_STEP_SETTINGS;
+	errno = 0;
+	CHECK(!mcp2210_program_compile(steps, 1) && errno == EINVAL);
+
+	// Transfers of a slot send the same number of bytes
+	steps[1].type = MCP2210_STEP_TRANSFER;
+	steps[1].send_len = 4;
+	steps[1].slot = 1;
+	mcp2210_step_t more[3] = { steps[0], steps[1], steps[1] };
+	more[2].send_len = 5;
+	errno = 0;
+	CHECK(!mcp2210_program_compile(more, 3) && errno == EINVAL);
+}
+
+int main(void)
+{
+	CHECK(0 == hid_init());
+	hid_handle_t *handle = hid_open_path("sim0");
+	CHECK(handle);
+	if (!handle)
+		return 1;
+
+	for (size_t i = 0; i < sizeof(block); ++i)
+		block[i] = i + 1;
+
+	mcp2210_step_t steps[6];
+	memset(steps, 0, sizeof(steps));
+	steps[0].type = MCP2210_STEP_SETTINGS;
+	steps[0].settings.bitrate = 1000000;
+	// A and B: the same read through slot 1
+	steps[1].type = MCP2210_STEP_TRANSFER;
+	steps[1].active_cs = 0x01fe;
+	steps[1].send = read_cmd;
+	steps[1].send_len = sizeof(read_cmd);
+	steps[1].recv_len = 8;
+	steps[1].slot = 1;
+	steps[2] = steps[1];
+	// C: two reports of fixed data
+	steps[3].type = MCP2210_STEP_TRANSFER;
+	steps[3].active_cs = 0x01fe;
+	steps[3].send = block;
+	steps[3].send_len = sizeof(block);
+	steps[3].recv_len = 10;
+	steps[4].type = MCP2210_STEP_GPIO;
+	steps[4].gpio = 0x0155;
+	// D: slot 1 again, without initial data
+	steps[5] = steps[1];
+	steps[5].send = NULL;
+	steps[5].recv_len = 2;
+
+	mcp2210_program_t *program = mcp2210_program_compile(steps, 6);
+	CHECK(program);
+	if (!program)
+		return 1;
+	CHECK(mcp2210_program_recv_len(program) == 28);
+
+	// D shares the slot but sent zeros until patched, the compiled send of
+	// A and B stays until then
+	uint8_t recv[64], mosi[256];
+	sim_mosi(handle, mosi, sizeof(mosi));
+	CHECK(28 == mcp2210_program_run(handle, program, MCP2210_CLASS_NORMAL,
+		recv, sizeof(recv)));
+	CHECK(sim_mosi(handle, mosi, sizeof(mosi)) == 140);
+	CHECK(!memcmp(mosi, read_cmd, 4) && !memcmp(mosi + 12, read_cmd, 4));
+	CHECK(!memcmp(mosi + 134, "\0\0\0\0", 4));
+
+	CHECK(0 == mcp2210_program_patch(program, 1, read_cmd, sizeof(read_cmd)));
+	run(handle, program, read_cmd);
+	CHECK(0 == mcp2210_program_patch(program, 1, patched_cmd, sizeof(patched_cmd)));
+	run(handle, program, patched_cmd);
+
+	errno = 0;
+	CHECK(-1 == mcp2210_program_patch(program, 1, patched_cmd, 3) && errno == EINVAL);
+	errno = 0;
+	CHECK(-1 == mcp2210_program_patch(program, 2, patched_cmd, 4) && errno == EINVAL);
+	errno = 0;
+	CHECK(-1 == mcp2210_program_run(handle, program, MCP2210_CLASS_NORMAL,
+		recv, 27) && errno == ENOMEM);
+
+	invalid_steps();
+
+	mcp2210_program_free(program);
+	hid_cleanup_device(handle);
+	hid_fini();
+	if (failures)
+		return 1;
+	printf("program: ok\n");
+	return 0;
+}